@@ -6,31 +6,56 @@
 #include "binary_writer.h" /* Include our new interface */
 
 /* Constants for assembly processing */
-#define MAX_LINE_LEN 256
-#define MAX_LINES    1024
-#define MAX_SYMBOLS  100
+#define MAX_LINE_LEN    256
+#define MAX_LINES       1024
+#define MAX_SYMBOLS     100
+#define MAX_RELOCATIONS MAX_LINES
 
 /* Base address for code (used to calculate entry point and symbol addresses) */
-#define BASE_ADDR   0x400000
-#define CODE_OFFSET 120 /* Reasonable offset for most formats */
+#define BASE_ADDR           0x400000
+#define CODE_OFFSET         120 /* Reasonable offset for most formats */
+#define DYNAMIC_CODE_OFFSET 288 /* ELF header and four program headers */
 
 /* Assembly options struct to control the assembler behavior */
 typedef struct {
-    const char *input_filename;  /* Source file to assemble */
-    const char *output_filename; /* Output binary file name */
-    binary_writer_fn writer;     /* Function to write the output binary */
-    int verbose;                 /* Enable verbose output */
+    const char *const *input_filenames; /* Source files, one module each */
+    size_t input_count;                 /* Number of source files */
+    const char *output_filename;        /* Output binary file name */
+    binary_writer_fn writer;            /* Function to write the output binary */
+    int verbose;                        /* Enable verbose output */
+    int relocatable;                    /* Keep unresolved symbols as relocations */
+    char *const *run_argv;              /* If set, execute the program with these
+                                           arguments instead of writing output */
+    size_t loop_align;                  /* Align loop heads to this many bytes, 0 for no */
+    const char *march;                  /* Target CPU (x86-64-v1..v4, native), or NULL
+                                           to allow every instruction */
 } AssemblerOptions;
 
-/* The assembler module provides functions to assemble an input file
+/* The assembler module provides functions to assemble input files
    into different binary formats.
 */
 
-/* Main assembly function - processes the input file and generates
-   code and data buffers, then uses the specified writer to create output */
+/* Main assembly function - assembles each input file as a module, links
+   the modules' code and data, then uses the specified writer to create output */
 int assemble(const AssemblerOptions *options);
 
 /* Predefined writer functions for supported formats */
 int assemble_to_elf(const char *input_filename, const char *output_filename);
 
+/* Code assembled into the memory of the running process */
+typedef struct {
+    void *memory; /* Start of the mapping: code pages, then data and .bss */
+    size_t size;  /* Size of the mapping in bytes */
+    void *entry;  /* Address of the first instruction */
+} JitCode;
+
+/* Assemble `length` bytes of source into executable memory and return the
+   entry address, which can be cast to a function pointer and called; use
+   'ret' to return to the caller. Extern functions are bound to the
+   libraries loaded in the process. Returns NULL if the source has errors,
+   after printing them; only running out of memory ends the process.
+   Several threads may assemble at once. Release the code with jit_free(). */
+void *jit_assemble(const char *source, size_t length, JitCode *code);
+void jit_free(JitCode *code);
+
 #endif  // ASSEMBLER_H
\ No newline at end of file
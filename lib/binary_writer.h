@@ -20,13 +20,63 @@ typedef struct {
     uint8_t *bytes;
     size_t size;
     size_t capacity;
+    size_t bss_size; /* Zero-initialised bytes that follow the data, not stored in bytes */
 } DataBuffer;
 
+/* Section a symbol is defined in. SECTION_UNDEF marks symbols that are
+ * referenced but defined by another object. */
+typedef enum { SECTION_UNDEF, SECTION_TEXT, SECTION_DATA, SECTION_BSS } SectionType;
+
+/* ELF x86-64 relocation types used by the object writer */
+#define R_X86_64_64       1
+#define R_X86_64_PC32     2
+#define R_X86_64_PLT32    4
+#define R_X86_64_GOTPCREL 9
+#define R_X86_64_32S      11
+
+/* A symbol as seen by the writers. The offset is relative to the start of
+ * its section. */
+typedef struct {
+    const char *name;
+    SectionType section;
+    uint64_t offset;
+    int global;
+} LinkSymbol;
+
+/* A reference from the code or data section that could not be resolved at
+ * assembly time and has to be patched by the linker. */
+typedef struct {
+    SectionType section; /* SECTION_TEXT or SECTION_DATA, where the field is */
+    uint64_t offset;      /* Offset of the field within that section */
+    size_t symbol;        /* Index into LinkInfo.symbols */
+    uint32_t type;   /* R_X86_64_* relocation type */
+    int64_t addend;
+} Relocation;
+
+/* Symbol and relocation information for formats that need it. Writers that
+ * produce fully linked output may ignore it. */
+typedef struct {
+    const LinkSymbol *symbols;
+    size_t symbol_count;
+    const Relocation *relocations;
+    size_t relocation_count;
+
+    /* Functions imported from libc. Slot i of the GOT, at got_offset within
+       the data section, receives the address of imports[i] at load time. */
+    const char *const *imports;
+    size_t import_count;
+    uint64_t got_offset;
+
+    /* Largest code alignment requested with 'align' */
+    uint64_t text_align;
+} LinkInfo;
+
 /* Function pointer type for writing binary output */
 typedef int (*binary_writer_fn)(const char *output_filename,
                                 const CodeBuffer *codeBuf,
                                 const DataBuffer *dataBuf,
-                                uint64_t entry_point);
+                                uint64_t entry_point,
+                                const LinkInfo *link);
 
 /* Buffer management functions */
 void init_code_buffer(CodeBuffer *buffer, size_t initial_capacity);
@@ -39,12 +89,29 @@ void ensure_buffer_capacity(void *buffer, size_t additional_bytes);
 int write_elf_file(const char *output_filename,
                    const CodeBuffer *codeBuf,
                    const DataBuffer *dataBuf,
-                   uint64_t entry_point);
+                   uint64_t entry_point,
+                   const LinkInfo *link);
+
+/* Execute an ELF image from memory instead of writing it to a file
+   (implementation in elf_writer.c). Only returns on failure. */
+int run_elf_image(const CodeBuffer *codeBuf,
+                  const DataBuffer *dataBuf,
+                  uint64_t entry_point,
+                  const LinkInfo *link,
+                  char *const argv[]);
 
 /* Write a raw binary file (implementation in raw_writer.c) */
 int write_binary_file(const char *output_filename,
                       const CodeBuffer *codeBuf,
                       const DataBuffer *dataBuf,
-                      uint64_t entry_point);
+                      uint64_t entry_point,
+                      const LinkInfo *link);
+
+/* Write an ELF relocatable object file (implementation in object_writer.c) */
+int write_object_file(const char *output_filename,
+                      const CodeBuffer *codeBuf,
+                      const DataBuffer *dataBuf,
+                      uint64_t entry_point,
+                      const LinkInfo *link);
 
 #endif /* BINARY_WRITER_H */
@@ -4,7 +4,7 @@
 #include <stdio.h>
 
 /* Output format types supported by the assembler */
-typedef enum { FORMAT_ELF, FORMAT_BINARY, FORMAT_UNKNOWN } OutputFormat;
+typedef enum { FORMAT_ELF, FORMAT_BINARY, FORMAT_OBJECT, FORMAT_UNKNOWN } OutputFormat;
 
 /* Function declarations */
 void print_usage(const char *program_name);
@@ -12,11 +12,18 @@ void print_version(void);
 OutputFormat parse_format(const char *format_str);
 int process_arguments(int argc,
                       char **argv,
-                      const char **input_file,
+                      const char **input_files,
+                      size_t *input_count,
                       const char **output_file,
                       OutputFormat *output_format,
-                      int *verbose);
-void print_assembly_info(const char *input_file,
+                      int *verbose,
+                      int *run,
+                      char ***program_args,
+                      int *program_argc,
+                      size_t *loop_align,
+                      const char **march);
+void print_assembly_info(const char *const *input_files,
+                         size_t input_count,
                          const char *output_file,
                          OutputFormat output_format);
 
@@ -0,0 +1,52 @@
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "binary_writer.h"
+
+/* Byte-level x86-64 encoding helpers shared by the instruction emitters.
+   Register numbers are 0-15: the low three bits go into the ModR/M or SIB
+   byte, the fourth bit into the REX prefix.
+*/
+
+/* Append a single byte, growing the buffer as needed */
+void encode_byte(CodeBuffer *buf, uint8_t byte);
+
+/* Append the low `size` bytes of value, little-endian */
+void encode_imm(CodeBuffer *buf, uint64_t value, size_t size);
+
+/* Append a REX prefix for an instruction with 64-bit operand size (w),
+   whose ModR/M reg field, SIB index and ModR/M rm or SIB base are the
+   given registers. Nothing is emitted when no REX bit is needed. */
+void encode_rex(CodeBuffer *buf, int w, uint8_t reg, uint8_t index, uint8_t base);
+
+/* Like encode_rex(), but also emit the REX prefix when `force` is set.
+   8-bit operands in spl, bpl, sil and dil (4-7) need one even when no bit
+   is set, without it those numbers select ah, ch, dh and bh. */
+void encode_rex_forced(
+    CodeBuffer *buf, int force, int w, uint8_t reg, uint8_t index, uint8_t base);
+
+/* Append a VEX prefix, which replaces the mandatory prefix (0, 66, F3 or
+   F2), REX and the 0F [38/3A] escape (`map` 1, 2 or 3) of SSE encodings.
+   `vvvv` is the extra source register, 0 when there is none, and `l`
+   selects 256-bit vectors. The two-byte form is used when possible. */
+void encode_vex(CodeBuffer *buf,
+                uint8_t prefix,
+                uint8_t map,
+                int w,
+                int l,
+                uint8_t reg,
+                uint8_t vvvv,
+                uint8_t index,
+                uint8_t base);
+
+/* Append [REX] opcode ModR/M for a register-direct operand (mod = 11).
+   `reg` is a register or an opcode extension (/n). */
+void encode_reg_reg(
+    CodeBuffer *buf, int w, const uint8_t *opcode, size_t opcode_len, uint8_t reg, uint8_t rm);
+
+/* Append `count` bytes of padding as the recommended multi-byte NOPs */
+void encode_nops(CodeBuffer *buf, size_t count);
+
+#endif /* ENCODER_H */
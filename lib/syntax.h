@@ -32,9 +32,9 @@ typedef enum {
     INSTR_MOVE,
     INSTR_CALL,
     INSTR_JUMP,
-    INSTR_JUMPLT,
-    INSTR_JUMPGT,
-    INSTR_JUMPEQ,
+    INSTR_JUMPCC, /* jmp<cc> or j<cc>, see syntax_get_condition_code() */
+    INSTR_CMOVCC, /* cmov<cc> */
+    INSTR_SETCC,  /* set<cc> */
     INSTR_COMP,
     INSTR_ADD,
     /* New arithmetic instructions */
@@ -49,14 +49,128 @@ typedef enum {
     INSTR_NOT,
     INSTR_SHL,
     INSTR_SHR,
+    INSTR_SAR,
+    INSTR_ROL,
+    INSTR_ROR,
+    INSTR_RCL,
+    INSTR_RCR,
+    INSTR_RET,
+    INSTR_LEA,
+    INSTR_INC,
+    INSTR_DEC,
+    INSTR_NEG,
+    INSTR_TEST,
+    INSTR_MOVZX,
+    INSTR_MOVSX,
+    INSTR_STRING, /* movs, cmps, stos, lods, scas with a size suffix */
+    INSTR_REP,    /* rep, repe/repz, repne/repnz prefix */
+    INSTR_CLD,
+    INSTR_STD,
+    INSTR_VECTOR, /* SSE and AVX, see syntax_get_vector_instruction() */
+    INSTR_POPCNT,
+    INSTR_LZCNT,
+    INSTR_TZCNT,
+    INSTR_BSF,
+    INSTR_BSR,
+    INSTR_BSWAP,
+    INSTR_MOVBE,
+    INSTR_BMI, /* VEX-encoded BMI1/BMI2, see syntax_get_bmi_instruction() */
+    INSTR_LOCK, /* lock prefix */
+    INSTR_XCHG,
+    INSTR_XADD,
+    INSTR_CMPXCHG,
+    INSTR_CMPXCHG8B,
+    INSTR_CMPXCHG16B,
+    INSTR_MFENCE,
+    INSTR_LFENCE,
+    INSTR_SFENCE,
+    INSTR_PAUSE,
+    INSTR_PREFETCHT0,
+    INSTR_PREFETCHT1,
+    INSTR_PREFETCHT2,
+    INSTR_PREFETCHNTA,
+    INSTR_PREFETCHW,
+    INSTR_CLFLUSH,
+    INSTR_CLFLUSHOPT,
+    INSTR_CLWB,
+    INSTR_MOVNTI,
+    INSTR_RDTSC,
+    INSTR_RDTSCP,
+    INSTR_RDPMC,
+    INSTR_CPUID,
+    INSTR_RDRAND,
+    INSTR_SYSCALL,
+    INSTR_PUSH,
+    INSTR_POP,
+    INSTR_XGETBV,
     INSTR_UNKNOWN
 } InstructionType;
 
 /* Register types */
-typedef enum { REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSI, REG_RDI, REG_UNKNOWN } RegisterType;
+typedef enum {
+    REG_RAX,
+    REG_RCX,
+    REG_RDX,
+    REG_RBX,
+    REG_RSI,
+    REG_RDI,
+    REG_RSP,
+    REG_RBP,
+    REG_R8,
+    REG_R9,
+    REG_R10,
+    REG_R11,
+    REG_R12,
+    REG_R13,
+    REG_R14,
+    REG_R15,
+    REG_UNKNOWN
+} RegisterType;
+
+/* CPU features beyond the x86-64 baseline (SSE2) that instructions need.
+   x86-64-v2 adds SSE3 to POPCNT and CX16, v3 adds AVX to MOVBE, and v4
+   the AVX-512 features; the rest belong to no level. */
+typedef enum {
+    CPU_SSE3 = 1 << 0,
+    CPU_SSSE3 = 1 << 1,
+    CPU_SSE41 = 1 << 2,
+    CPU_SSE42 = 1 << 3,
+    CPU_POPCNT = 1 << 4,
+    CPU_CX16 = 1 << 5,
+    CPU_AVX = 1 << 6,
+    CPU_AVX2 = 1 << 7,
+    CPU_FMA = 1 << 8,
+    CPU_BMI1 = 1 << 9,
+    CPU_BMI2 = 1 << 10,
+    CPU_LZCNT = 1 << 11,
+    CPU_MOVBE = 1 << 12,
+    CPU_AVX512F = 1 << 13,
+    CPU_AVX512BW = 1 << 14,
+    CPU_AVX512CD = 1 << 15,
+    CPU_AVX512DQ = 1 << 16,
+    CPU_AVX512VL = 1 << 17,
+    CPU_RDRAND = 1 << 18,
+    CPU_RDTSCP = 1 << 19,
+    CPU_PREFETCHW = 1 << 20,
+    CPU_CLFLUSHOPT = 1 << 21,
+    CPU_CLWB = 1 << 22
+} CpuFeature;
+
+/* The CPUID words a feature is read from, as stored by the ifcpu dispatch
+   code: leaf 1 ECX, leaf 7 EBX, leaf 0x80000001 ECX and EDX */
+enum { CPUID_1_ECX, CPUID_7_EBX, CPUID_EXT_ECX, CPUID_EXT_EDX, CPUID_WORDS };
 
 /* Data directive types */
-typedef enum { DATA_STRING, DATA_BUFFER, DATA_FILE, DATA_RAW, DATA_UNKNOWN } DataDirectiveType;
+typedef enum {
+    DATA_STRING,
+    DATA_BUFFER,
+    DATA_FILE,
+    DATA_RAW,
+    DATA_F32, /* IEEE single, its bits in data.value */
+    DATA_F64, /* IEEE double, its bits in data.value */
+    DATA_JUMPTABLE, /* Label addresses, their names in data.literal */
+    DATA_UNKNOWN
+} DataDirectiveType;
 
 /* Data directive structure for storing parsed data info */
 typedef struct {
@@ -70,6 +184,76 @@ typedef struct {
     } data;
 } SyntaxDataDirective;
 
+/* Memory operand: [symbol + base + index*scale + displacement], where
+   every part is optional, with an optional size qualifier in front */
+typedef struct {
+    uint8_t base;      /* Register code, 0xFF for none */
+    uint8_t index;     /* Register code, 0xFF for none */
+    uint8_t indexSize; /* 16 or 32 for an xmm or ymm index (gathers), 0 otherwise */
+    uint8_t scale;     /* 1, 2, 4 or 8 */
+    int64_t disp;
+    char symbol[SYNTAX_MAX_LABEL_LEN]; /* Empty for none */
+    uint8_t size;                      /* From byte/word/dword/qword, 0 if not given */
+} SyntaxMemoryOperand;
+
+/* Operand forms of vector instructions. The AVX (VEX) forms take ymm as
+   well as xmm registers. */
+typedef enum {
+    VECTOR_RM,           /* xmm, xmm/m128; AVX: xmm, xmm, xmm/m128 with a separate destination */
+    VECTOR_RM_IMM,       /* VECTOR_RM followed by an imm8 */
+    VECTOR_UNARY,        /* xmm, xmm/m128, also in AVX */
+    VECTOR_UNARY_IMM,    /* VECTOR_UNARY followed by an imm8 */
+    VECTOR_MOVE,         /* xmm, xmm/m128 or m128, xmm with the store opcode */
+    VECTOR_STORE,        /* m128, xmm only */
+    VECTOR_LOAD,         /* xmm, m128 only */
+    VECTOR_MOVE_SCALAR,  /* movss/movsd: VECTOR_MOVE, in AVX xmm, xmm, xmm between registers */
+    VECTOR_SHIFT_IMM,    /* xmm, imm8 with an opcode extension; AVX: xmm, xmm, imm8 */
+    VECTOR_MASK,         /* r32, xmm */
+    VECTOR_MOVE_GPR,     /* movd/movq between xmm and a general-purpose register */
+    VECTOR_CVT_TO_GPR,   /* r32/64, xmm/m: conversion to an integer */
+    VECTOR_CVT_FROM_GPR, /* xmm, r/m32/64; AVX: xmm, xmm, r/m32/64 */
+    VECTOR_WIDEN,        /* ymm, xmm/m: a narrower source, broadcast or widened */
+    VECTOR_INSERT,       /* AVX only: ymm, ymm, xmm/m128, imm8 */
+    VECTOR_EXTRACT,      /* AVX only: xmm/m128, ymm, imm8 */
+    VECTOR_GATHER,       /* AVX only: ymm, [base + ymm*scale], ymm mask */
+    VECTOR_NONE          /* AVX only: no operands and no ModR/M */
+} SyntaxVectorForm;
+
+/* A vector instruction: [prefix] 0F [38/3A] opcode /r, or the same fields
+   in a VEX prefix */
+typedef struct {
+    const char *name;
+    uint8_t prefix; /* Mandatory prefix: 0, 0x66, 0xF2 or 0xF3 */
+    uint8_t map;    /* Opcode map: 1 for 0F, 2 for 0F 38, 3 for 0F 3A */
+    uint8_t opcode;
+    SyntaxVectorForm form;
+    uint8_t ext;   /* Store opcode of VECTOR_MOVE(_GPR), extension of VECTOR_SHIFT_IMM */
+    uint8_t w;     /* REX.W or VEX.W: 64-bit general-purpose operand or element */
+    uint8_t width; /* Vector length in bytes the instruction requires, 0 for either */
+    uint32_t feature; /* CPU_* feature of the SSE form, or of an AVX-only instruction */
+} SyntaxVectorInstruction;
+
+/* Operand forms of the VEX-encoded BMI1/BMI2 instructions, named after
+   where their operands go: r is ModR/M reg, v is VEX.vvvv, m is ModR/M r/m */
+typedef enum {
+    BMI_RVM,   /* r32/64, r32/64, r/m32/64 */
+    BMI_RMV,   /* r32/64, r/m32/64, r32/64 */
+    BMI_VM,    /* r32/64, r/m32/64 with an opcode extension in reg */
+    BMI_RM_IMM /* r32/64, r/m32/64, imm8 */
+} SyntaxBmiForm;
+
+/* A BMI instruction on general-purpose registers, VEX-encoded like the
+   vector instructions. W selects 64-bit operands. */
+typedef struct {
+    const char *name;
+    uint8_t prefix; /* Mandatory prefix in VEX.pp: 0, 0x66, 0xF2 or 0xF3 */
+    uint8_t map;    /* Opcode map: 2 for 0F 38, 3 for 0F 3A */
+    uint8_t opcode;
+    SyntaxBmiForm form;
+    uint8_t ext;      /* Opcode extension of BMI_VM */
+    uint32_t feature; /* CPU_BMI1 or CPU_BMI2 */
+} SyntaxBmiInstruction;
+
 /**
  * Initialize the syntax module.
  * This would allow for runtime configuration of syntax elements.
@@ -85,6 +269,14 @@ bool syntax_is_register(const char *str);
 bool syntax_is_label(const char *str);
 bool syntax_is_comment(const char *str);
 bool syntax_is_data_directive(const char *str);
+bool syntax_is_global_directive(const char *str);
+bool syntax_is_extern_directive(const char *str);
+bool syntax_is_align_directive(const char *str);
+bool syntax_is_proc_directive(const char *str);
+bool syntax_is_endp_directive(const char *str);
+bool syntax_is_ifcpu_directive(const char *str);
+bool syntax_is_else_directive(const char *str);
+bool syntax_is_endif_directive(const char *str);
 bool syntax_is_memory_reference(const char *str);
 bool syntax_is_numeric(const char *str);
 
@@ -92,8 +284,19 @@ bool syntax_is_numeric(const char *str);
  * Functions to get specific element types
  */
 InstructionType syntax_get_instruction_type(const char *str);
+uint8_t syntax_get_condition_code(const char *str, const char *prefix);
+uint8_t syntax_get_string_opcode(const char *str, uint8_t *size);
+const SyntaxVectorInstruction *syntax_get_vector_instruction(const char *str, bool *vex);
+const SyntaxBmiInstruction *syntax_get_bmi_instruction(const char *str);
+uint32_t syntax_get_cpu_feature(const char *name);
+uint32_t syntax_get_implied_cpu_features(uint32_t features);
+bool syntax_get_cpuid_bit(uint32_t feature, uint8_t *word, uint8_t *bit);
+bool syntax_get_cpu_target(const char *name, uint32_t *features);
 RegisterType syntax_get_register_type(const char *str);
 uint8_t syntax_get_register_code(const char *reg);
+uint8_t syntax_get_byte_register_code(const char *reg);
+uint8_t syntax_get_sized_register_code(const char *reg, uint8_t *size);
+uint8_t syntax_get_vector_register_code(const char *reg, uint8_t *size);
 uint8_t syntax_get_register_code_by_type(RegisterType reg);
 
 /**
@@ -101,6 +304,7 @@ uint8_t syntax_get_register_code_by_type(RegisterType reg);
  */
 const char *syntax_instruction_to_string(InstructionType instr);
 const char *syntax_register_to_string(RegisterType reg);
+const char *syntax_cpu_feature_to_string(uint32_t feature);
 
 /**
  * Parsing functions
@@ -108,6 +312,8 @@ const char *syntax_register_to_string(RegisterType reg);
 char *syntax_extract_label_name(const char *str);
 char *syntax_extract_memory_reference(const char *str);
 char *syntax_trim(char *str);
+size_t syntax_split_operands(char *str, char **operands, size_t max);
+bool syntax_parse_memory_operand(const char *str, SyntaxMemoryOperand *mem);
 
 /**
  * Data directive parsing
@@ -122,6 +328,17 @@ extern char syntax_comment_char;
 extern const char *syntax_data_keyword;
 extern const char *syntax_size_keyword;
 extern const char *syntax_file_keyword;
+extern const char *syntax_f32_keyword;
+extern const char *syntax_f64_keyword;
+extern const char *syntax_jumptable_keyword;
+extern const char *syntax_global_keyword;
+extern const char *syntax_extern_keyword;
+extern const char *syntax_align_keyword;
+extern const char *syntax_proc_keyword;
+extern const char *syntax_endp_keyword;
+extern const char *syntax_ifcpu_keyword;
+extern const char *syntax_else_keyword;
+extern const char *syntax_endif_keyword;
 extern const char *syntax_label_suffix;
 
 #endif /* SYNTAX_H */
\ No newline at end of file
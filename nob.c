@@ -159,6 +159,9 @@ static bool link_executable(const char *output_dir,
         nob_cmd_append(&cmd, obj_files->items[i]);
     }
 
+    // Modules are assembled on separate threads
+    nob_cmd_append(&cmd, "-lpthread", "-ldl");
+
     // Add output executable
     nob_cmd_append(&cmd, "-o", "jasm");
 
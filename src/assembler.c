@@ -1,59 +1,284 @@
+#define _GNU_SOURCE /* RTLD_DEFAULT */
 #include "assembler.h"
 #include <ctype.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "binary_writer.h"
 #include "color_utils.h"
+#include "encoder.h"
 #include "error.h"
 #include "syntax.h"
 
 /* ---- Internal Constants and Structures ---- */
 
-/* Internal arrays for symbol and data directive storage. */
-static char lines[MAX_LINES][MAX_LINE_LEN];
-static SyntaxDataDirective dataDirectives[MAX_SYMBOLS];
-static size_t dataDirCount = 0;
-
-/* Symbol structure. */
+/* Symbol structure. Values are offsets relative to the start of the
+   symbol's section within its module. */
 typedef struct {
     char name[32];
     uint64_t value;
+    SectionType section;
+    int global;
+    int external; /* Declared with 'extern': imported from a shared library */
 } Symbol;
 
-/* Internal symbol table. */
-static Symbol symbols[MAX_SYMBOLS];
-static size_t symbolCount = 0;
+/* A relocation recorded while emitting a module, with the line it came from
+   so that unresolved symbols can be reported at link time. */
+typedef struct {
+    Relocation reloc;
+    int line_number;
+} ModuleRelocation;
+
+/* A single source file. Each module is lexed and encoded on its own into
+   section-relative code and data, with every reference that leaves its
+   code section recorded as a relocation. link_modules() then lays out all
+   modules and resolves those references. */
+typedef struct {
+    const char *filename;
+    const char *source; /* If set, the module is read from this buffer */
+    size_t sourceLength;
+
+    /* Source lines and data directives */
+    char lines[MAX_LINES][MAX_LINE_LEN];
+    size_t lineCount;
+    SyntaxDataDirective dataDirectives[MAX_SYMBOLS];
+    int dataDirLine[MAX_SYMBOLS]; /* Source line of each data directive */
+    size_t dataDirCount;
+
+    /* Symbol table. Undefined entries are the module's imports, entries
+       marked global are its exports. */
+    Symbol symbols[MAX_SYMBOLS];
+    size_t symbolCount;
+
+    /* Names listed in 'global' directives */
+    char globalNames[MAX_SYMBOLS][32];
+    size_t globalCount;
+
+    ModuleRelocation relocations[MAX_RELOCATIONS];
+    size_t relocationCount;
+
+    /* Code layout and branch relaxation, per source line */
+    size_t lineOffset[MAX_LINES];
+    size_t lineAlign[MAX_LINES];        /* Pad the code to this alignment before the line */
+    size_t branchTarget[MAX_LINES];     /* Symbol index + 1 of a rel8 jump, or 0 */
+    unsigned char longBranch[MAX_LINES]; /* Jump needs the rel32 form */
+    size_t lineFrame[MAX_LINES];        /* Stack frame of the proc around the line */
+    uint32_t lineFeatures[MAX_LINES];   /* CPU features the line may use */
+    size_t lineBlock[MAX_LINES];        /* Line number of the runtime-checked ifcpu that
+                                           an ifcpu, else or endif line belongs to, or 0 */
+    unsigned char lineDead[MAX_LINES];  /* In the else of an ifcpu that --march decides */
+
+    /* Encoded sections */
+    size_t simulatedCodeSize;
+    CodeBuffer codeBuf;
+    DataBuffer dataBuf;
+    CodeBuffer scratchBuf; /* Used to size instructions */
+    size_t loopAlign;      /* Align the targets of backward jumps, 0 for no */
+    size_t textAlign;      /* Largest alignment used, for placing the module */
+
+    /* Target CPU */
+    const char *march;    /* Name given to --march, or NULL */
+    uint32_t cpuFeatures; /* Features the target is known to have (CPU_*) */
+} Module;
+
+/* State for encoding one source line */
+typedef struct {
+    Module *module;
+    CodeBuffer *codeBuf;
+    const char *filename;
+    int line_number;
+    const char *line_content;
+    int sizing; /* Only measure: leave symbols and relocations alone */
+} EmitContext;
+
+static void emit_instruction_line_ctx(EmitContext *ctx, const char *line);
+
+/* Set while jit_assemble() runs on this thread, so that errors in the
+   source return to it instead of ending the process */
+static __thread jmp_buf *failureJump;
 
 /* ---- Utility Functions ---- */
 
+/* Give up on the source after an error has been reported */
+static void fail(void) __attribute__((noreturn));
+static void fail(void)
+{
+    if (failureJump)
+        longjmp(*failureJump, 1);
+    exit(1);
+}
+
 /* Add a symbol to the symbol table. */
-static void add_symbol(const char *name, uint64_t value)
+static void add_symbol(Module *m, const char *name, uint64_t value, SectionType section)
 {
-    if (symbolCount >= MAX_SYMBOLS) {
+    if (m->symbolCount >= MAX_SYMBOLS) {
         color_error("symbol table overflow");
-        exit(1);
+        fail();
+    }
+    Symbol *sym = &m->symbols[m->symbolCount];
+    snprintf(sym->name, sizeof(sym->name), "%s", name);
+    sym->value = value;
+    sym->section = section;
+    sym->global = 0;
+    sym->external = 0;
+    m->symbolCount++;
+}
+
+/* Find a symbol by name. Returns NULL if the module does not know it. */
+static Symbol *find_symbol(Module *m, const char *name)
+{
+    for (size_t i = 0; i < m->symbolCount; i++) {
+        if (strcmp(m->symbols[i].name, name) == 0)
+            return &m->symbols[i];
+    }
+    return NULL;
+}
+
+/* Lines that produce no instruction bytes of their own */
+static int is_directive_line(const char *trimmed)
+{
+    return trimmed[0] == '\0' || syntax_is_comment(trimmed) || syntax_is_data_directive(trimmed)
+           || syntax_is_global_directive(trimmed) || syntax_is_extern_directive(trimmed)
+           || syntax_is_align_directive(trimmed) || syntax_is_endp_directive(trimmed)
+           || syntax_is_endif_directive(trimmed);
+}
+
+/* Parse 'proc <name> [<bytes>]' into the proc's name and the stack it
+   reserves for locals. The frame is rounded up so that rsp is 16-byte
+   aligned inside the proc, ready for calls; without a size there is no
+   frame and rsp is left alone. */
+static void parse_proc_directive(const char *trimmed, char *name, size_t *frame)
+{
+    char buf[MAX_LINE_LEN];
+    strncpy(buf, trimmed + strlen(syntax_proc_keyword), MAX_LINE_LEN - 1);
+    buf[MAX_LINE_LEN - 1] = '\0';
+    char *comment = strchr(buf, syntax_comment_char);
+    if (comment)
+        *comment = '\0';
+
+    char *save = NULL;
+    const char *label = strtok_r(buf, " \t", &save);
+    const char *bytes = strtok_r(NULL, " \t", &save);
+    if (!label || strtok_r(NULL, " \t", &save)) {
+        color_error("proc needs a name and an optional frame size: %s", trimmed);
+        fail();
+    }
+    strncpy(name, label, 31);
+    name[31] = '\0';
+
+    *frame = 0;
+    if (bytes) {
+        char *end = NULL;
+        const unsigned long long size = strtoull(bytes, &end, 0);
+        if (*end || size > INT32_MAX - 16) {
+            color_error("invalid proc frame size: %s", bytes);
+            fail();
+        }
+        /* The call pushed 8 bytes, so the frame is 8 modulo 16 */
+        *frame = (size_t)((size + 8 + 15) & ~15ULL) - 8;
+    }
+}
+
+/* Parse 'ifcpu <feature> [<feature>...]' into the features it checks for */
+static uint32_t parse_ifcpu_directive(const char *filename, size_t line, const char *trimmed)
+{
+    char buf[MAX_LINE_LEN];
+    strncpy(buf, trimmed + strlen(syntax_ifcpu_keyword), MAX_LINE_LEN - 1);
+    buf[MAX_LINE_LEN - 1] = '\0';
+    char *comment = strchr(buf, syntax_comment_char);
+    if (comment)
+        *comment = '\0';
+
+    uint32_t features = 0;
+    char *save = NULL;
+    for (const char *name = strtok_r(buf, " \t,", &save); name;
+         name = strtok_r(NULL, " \t,", &save)) {
+        const uint32_t feature = syntax_get_cpu_feature(name);
+        if (!feature) {
+            color_error("%s:%zu: unknown CPU feature '%s'", filename, line, name);
+            fail();
+        }
+        features |= feature;
+    }
+    if (!features) {
+        color_error("%s:%zu: ifcpu needs a CPU feature such as avx2", filename, line);
+        fail();
+    }
+    return features;
+}
+
+/* Symbols that jasm generates start with this; user symbols may not */
+#define RESERVED_PREFIX "__jasm_"
+
+/* Reject a symbol defined on `line` of the source that uses the reserved
+   prefix, as it could collide with a generated one */
+static void check_symbol_name(const char *filename, size_t line, const char *name)
+{
+    if (strncmp(name, RESERVED_PREFIX, strlen(RESERVED_PREFIX)) == 0) {
+        color_error("%s:%zu: '%s' starts with " RESERVED_PREFIX
+                    ", which is reserved for the symbols jasm generates",
+                    filename,
+                    line,
+                    name);
+        fail();
+    }
+}
+
+/* Room for the longest ifcpu label; it also fits a symbol name */
+#define IFCPU_LABEL_SIZE (sizeof "__jasm_endif_" + 10)
+
+/* Name of the label that starts the else branch ("else") or follows the
+   block ("endif") of the runtime-checked ifcpu on `line` */
+static void ifcpu_label(char *name, size_t size, const char *part, size_t line)
+{
+    snprintf(name, size, RESERVED_PREFIX "%s_%u", part, (unsigned)line);
+}
+
+/* Record a relocation of a field at `offset` in the module's code or data
+   section. */
+static void add_relocation(Module *m,
+                           SectionType section,
+                           uint64_t offset,
+                           size_t symbol,
+                           uint32_t type,
+                           int64_t addend,
+                           int line_number)
+{
+    if (m->relocationCount >= MAX_RELOCATIONS) {
+        color_error("too many relocations");
+        fail();
     }
-    strncpy(symbols[symbolCount].name, name, sizeof(symbols[symbolCount].name) - 1);
-    symbols[symbolCount].name[sizeof(symbols[symbolCount].name) - 1] = '\0';
-    symbols[symbolCount].value = value;
-    symbolCount++;
+    ModuleRelocation *r = &m->relocations[m->relocationCount++];
+    r->reloc.section = section;
+    r->reloc.offset = offset;
+    r->reloc.symbol = symbol;
+    r->reloc.type = type;
+    r->reloc.addend = addend;
+    r->line_number = line_number;
 }
 
-/* Lookup symbol value by name. Returns 0 and reports error if symbol not found. */
-static uint64_t lookup_symbol(const char *name,
-                              const char *filename,
-                              int line_number,
-                              const char *line_content)
+/* Mark the symbols named in 'global' directives as exported. */
+static void apply_global_directives(Module *m)
 {
-    for (size_t i = 0; i < symbolCount; i++) {
-        if (strcmp(symbols[i].name, name) == 0)
-            return symbols[i].value;
+    for (size_t i = 0; i < m->globalCount; i++) {
+        Symbol *sym = find_symbol(m, m->globalNames[i]);
+        if (!sym) {
+            error_report_simple(ERROR_SEVERITY_ERROR,
+                                "%s: global symbol '%s' is not defined",
+                                m->filename,
+                                m->globalNames[i]);
+            continue;
+        }
+        sym->global = 1;
     }
-    error_report(
-        filename, line_number, 0, line_content, ERROR_SEVERITY_ERROR, "unknown symbol '%s'", name);
-    return 0;
 }
 
 /* Check if a line is a label definition (ends with ':') */
@@ -86,336 +311,540 @@ static char *process_label(const char *line)
    - data <label> 0b10110011    (binary)
    - data <label> 123           (decimal)
 */
-static void process_data_directive(char *trimmed) __attribute__((unused));
-static void process_data_directive(char *trimmed)
+static void process_data_directive(Module *m, char *trimmed) __attribute__((unused));
+static void process_data_directive(Module *m, char *trimmed)
 {
     char *p = trimmed + 4;
     p = syntax_trim(p);
-    char *label = strtok(p, " \t");
+    char *save = NULL;
+    char *label = strtok_r(p, " \t", &save);
     if (!label) {
         color_error("data directive requires a label");
-        exit(1);
+        fail();
     }
-    char *value = strtok(NULL, "\n");
+    char *value = strtok_r(NULL, "\n", &save);
     if (!value) {
         color_error("data directive missing value");
-        exit(1);
+        fail();
     }
     value = syntax_trim(value);
 
     /* Save the directive for later processing */
     strncpy(
-        dataDirectives[dataDirCount].label, label, sizeof(dataDirectives[dataDirCount].label) - 1);
-    dataDirectives[dataDirCount].label[sizeof(dataDirectives[dataDirCount].label) - 1] = '\0';
+        m->dataDirectives[m->dataDirCount].label, label, sizeof(m->dataDirectives[m->dataDirCount].label) - 1);
+    m->dataDirectives[m->dataDirCount].label[sizeof(m->dataDirectives[m->dataDirCount].label) - 1] = '\0';
 
     if (value[0] == '"') {
         /* String literal */
-        dataDirectives[dataDirCount].type = DATA_STRING;
+        m->dataDirectives[m->dataDirCount].type = DATA_STRING;
         value++; /* skip opening quote */
         char *endQuote = strchr(value, '"');
         if (!endQuote) {
             color_error("missing closing quote in data directive");
-            exit(1);
+            fail();
         }
         *endQuote = '\0';
-        strncpy(dataDirectives[dataDirCount].data.literal,
+        strncpy(m->dataDirectives[m->dataDirCount].data.literal,
                 value,
-                sizeof(dataDirectives[dataDirCount].data.literal) - 1);
-        dataDirectives[dataDirCount]
-            .data.literal[sizeof(dataDirectives[dataDirCount].data.literal) - 1] = '\0';
+                sizeof(m->dataDirectives[m->dataDirCount].data.literal) - 1);
+        m->dataDirectives[m->dataDirCount]
+            .data.literal[sizeof(m->dataDirectives[m->dataDirCount].data.literal) - 1] = '\0';
     } else if (strncmp(value, "file", 4) == 0) {
         /* File inclusion */
-        dataDirectives[dataDirCount].type = DATA_FILE;
+        m->dataDirectives[m->dataDirCount].type = DATA_FILE;
 
         /* Get filename after "file" keyword */
         char *filename = value + 4;
         filename = syntax_trim(filename);
         if (!filename || !*filename) {
             color_error("file directive requires a filename");
-            exit(1);
+            fail();
         }
 
-        strncpy(dataDirectives[dataDirCount].data.filename,
+        strncpy(m->dataDirectives[m->dataDirCount].data.filename,
                 filename,
-                sizeof(dataDirectives[dataDirCount].data.filename) - 1);
-        dataDirectives[dataDirCount]
-            .data.filename[sizeof(dataDirectives[dataDirCount].data.filename) - 1] = '\0';
+                sizeof(m->dataDirectives[m->dataDirCount].data.filename) - 1);
+        m->dataDirectives[m->dataDirCount]
+            .data.filename[sizeof(m->dataDirectives[m->dataDirCount].data.filename) - 1] = '\0';
     } else if (strncmp(value, "size", 4) == 0) {
         /* Buffer allocation */
-        dataDirectives[dataDirCount].type = DATA_BUFFER;
+        m->dataDirectives[m->dataDirCount].type = DATA_BUFFER;
         char *sizeStr = value + 4;
         sizeStr = syntax_trim(sizeStr);
         if (!syntax_is_numeric(sizeStr)) {
             color_error("size must be a number");
-            exit(1);
+            fail();
         }
-        dataDirectives[dataDirCount].data.size = strtoull(sizeStr, NULL, 0);
+        m->dataDirectives[m->dataDirCount].data.size = strtoull(sizeStr, NULL, 0);
     } else if (value[0] == '0'
                && (value[1] == 'x' || value[1] == 'X' || value[1] == 'b' || value[1] == 'B')) {
         /* Hex or binary value */
-        dataDirectives[dataDirCount].type = DATA_RAW;
+        m->dataDirectives[m->dataDirCount].type = DATA_RAW;
         char *endptr;
         if (value[1] == 'x' || value[1] == 'X') {
-            dataDirectives[dataDirCount].data.value = strtoull(value, &endptr, 16);
+            m->dataDirectives[m->dataDirCount].data.value = strtoull(value, &endptr, 16);
         } else /* binary */
         {
             /* Skip 0b prefix */
             value += 2;
-            dataDirectives[dataDirCount].data.value = 0;
+            m->dataDirectives[m->dataDirCount].data.value = 0;
             while (*value == '0' || *value == '1') {
-                dataDirectives[dataDirCount].data.value =
-                    (dataDirectives[dataDirCount].data.value << 1) | (*value - '0');
+                m->dataDirectives[m->dataDirCount].data.value =
+                    (m->dataDirectives[m->dataDirCount].data.value << 1) | (*value - '0');
                 value++;
             }
             if (*value && !isspace((unsigned char)*value)) {
                 color_error("invalid binary number");
-                exit(1);
+                fail();
             }
         }
     } else if (isdigit((unsigned char)value[0]) || value[0] == '-') {
         /* Decimal value */
-        dataDirectives[dataDirCount].type = DATA_RAW;
+        m->dataDirectives[m->dataDirCount].type = DATA_RAW;
         char *endptr;
-        dataDirectives[dataDirCount].data.value = strtoull(value, &endptr, 10);
+        m->dataDirectives[m->dataDirCount].data.value = strtoull(value, &endptr, 10);
         if (*endptr && !isspace((unsigned char)*endptr)) {
             color_error("invalid decimal number");
-            exit(1);
+            fail();
         }
     } else {
         color_error("data directive requires a string literal, 'size <number>', or "
                     "a numeric value (decimal, 0x... for hex, 0b... for binary)");
-        exit(1);
+        fail();
     }
-    dataDirCount++;
+    m->dataDirCount++;
 }
 
 /* ---- File Reading and First Pass ---- */
 
-/* Read all lines from a file into the global lines array.
+/* Read all lines of the module's source file into its lines array.
    Returns number of lines read.
 */
-static size_t read_all_lines(const char *filename)
+static size_t read_all_lines(Module *m)
 {
-    FILE *fp = fopen(filename, "r");
+    if (m->source && m->sourceLength == 0) {
+        m->lineCount = 0;
+        return 0;
+    }
+    FILE *fp = m->source ? fmemopen((void *)m->source, m->sourceLength, "r")
+                         : fopen(m->filename, "r");
     if (!fp) {
-        color_error("Failed to open file: %s", filename);
+        color_error("Failed to open file: %s", m->filename);
         perror("fopen");
-        exit(1);
+        fail();
     }
     size_t count = 0;
-    while (fgets(lines[count], MAX_LINE_LEN, fp) != NULL && count < MAX_LINES)
+    while (count < MAX_LINES && fgets(m->lines[count], MAX_LINE_LEN, fp) != NULL)
         count++;
     fclose(fp);
+    m->lineCount = count;
     return count;
 }
 
-/* Simulate instruction emission size.
-   Supported:
-     move <reg>, <immediate> -> 5 bytes if immediate fits in 32 bits, else 10 bytes
-     call -> 2 bytes
-     jump -> 5 bytes
-     jmplt/jumpgt/jumpeq -> 6 bytes
-     comp <reg>, <reg/immediate> -> 3-7 bytes
-     add/sub/mul/div/mod <reg>, <reg/immediate> -> 3-7 bytes
-     and/or/xor <reg>, <reg/immediate> -> 3-7 bytes
-     not <reg> -> 3 bytes
-     shl/shr <reg>, <reg/immediate> -> 3-7 bytes
+/* Size of the instruction on line `index`. The line is run through the
+   emitter in sizing mode, which encodes into a scratch buffer without
+   touching symbols or relocations, so that the sizes used for the layout
+   always match what is emitted later.
 */
-static size_t simulate_instruction(const char *line)
+static size_t simulate_instruction(Module *m, size_t index)
 {
-    char buf[MAX_LINE_LEN];
-    strncpy(buf, line, MAX_LINE_LEN - 1);
-    buf[MAX_LINE_LEN - 1] = '\0';
-    char *trimmed = syntax_trim(buf);
-
-    InstructionType instrType = syntax_get_instruction_type(trimmed);
+    m->scratchBuf.size = 0;
+    EmitContext ctx = {m, &m->scratchBuf, m->filename, (int)index + 1, m->lines[index], 1};
+    emit_instruction_line_ctx(&ctx, syntax_trim(m->lines[index]));
+    return m->scratchBuf.size;
+}
 
-    switch (instrType) {
-        case INSTR_MOVE: {
-            /* Format:
-               move <register>, <immediate>
-               move <register>, [<symbol>]  ; load from memory
-               move [<symbol>], <register>  ; store to memory
-            */
-            char *token = strtok(trimmed, " ,\t"); /* "move" */
-            (void)token;
-            token = strtok(NULL, " ,\t"); /* destination */
-            if (!token)
-                return 0;
-            char dest[MAX_LINE_LEN];
-            strncpy(dest, token, sizeof(dest) - 1);
-            dest[sizeof(dest) - 1] = '\0';
-
-            token = strtok(NULL, " ,\t"); /* source */
-            if (!token)
-                return 0;
-
-            if (syntax_is_memory_reference(dest) || syntax_is_memory_reference(token)) {
-                /* Memory operations:
-                   - REX.W prefix (1 byte)
-                   - Opcode (1 byte)
-                   - ModR/M (1 byte)
-                   - 32-bit displacement (4 bytes)
-                */
-                return 7;
-            }
-            if (syntax_is_numeric(token)) {
-                uint64_t val = strtoull(token, NULL, 0);
-                if (val <= 0xffffffffULL) {
-                    /* 32-bit immediate:
-                       - REX.W prefix (1 byte)
-                       - Opcode (1 byte)
-                       - ModR/M (1 byte)
-                       - 32-bit immediate (4 bytes)
-                    */
-                    return 7;
-                } else {
-                    /* 64-bit immediate:
-                       - REX.W prefix (1 byte)
-                       - Opcode (1 byte)
-                       - 64-bit immediate (8 bytes)
-                    */
-                    return 10;
-                }
-            } else {
-                /* Symbol address (using lea):
-                   - REX.W prefix (1 byte)
-                   - Opcode (1 byte)
-                   - ModR/M (1 byte)
-                   - 32-bit displacement (4 bytes)
-                */
-                return 7;
+/* Assign a code offset to every line and label with the current branch
+   sizes. Returns the total code size.
+*/
+static size_t layout_code(Module *m)
+{
+    size_t codeSize = 0;
+    int hasElse = 0; /* The open ifcpu has an else */
+    for (size_t i = 0; i < m->lineCount; i++) {
+        if (m->lineAlign[i] > 1 && !m->lineDead[i])
+            codeSize = (codeSize + m->lineAlign[i] - 1) & ~(m->lineAlign[i] - 1);
+        m->lineOffset[i] = codeSize;
+        if (m->lineDead[i])
+            continue;
+        char *trimmed = syntax_trim(m->lines[i]);
+        if (m->lineBlock[i] && syntax_is_endif_directive(trimmed)) {
+            /* Without an else, the failed check jumps here as well */
+            char label[IFCPU_LABEL_SIZE];
+            ifcpu_label(label, sizeof(label), "endif", m->lineBlock[i]);
+            find_symbol(m, label)->value = codeSize;
+            if (!hasElse) {
+                ifcpu_label(label, sizeof(label), "else", m->lineBlock[i]);
+                find_symbol(m, label)->value = codeSize;
             }
+            hasElse = 0;
+            continue;
         }
+        if (is_directive_line(trimmed))
+            continue;
+        if (syntax_is_label(trimmed)) {
+            char *label = syntax_extract_label_name(trimmed);
+            Symbol *sym = label ? find_symbol(m, label) : NULL;
+            if (sym && sym->section == SECTION_TEXT)
+                sym->value = codeSize;
+            continue;
+        }
+        if (syntax_is_proc_directive(trimmed)) {
+            /* A proc is a label followed by its frame setup */
+            char name[32];
+            size_t frame;
+            parse_proc_directive(trimmed, name, &frame);
+            Symbol *sym = find_symbol(m, name);
+            if (sym && sym->section == SECTION_TEXT)
+                sym->value = codeSize;
+        }
+        codeSize += simulate_instruction(m, i);
+        if (m->lineBlock[i] && syntax_is_else_directive(trimmed)) {
+            /* The else branch starts after the jump over it */
+            char label[IFCPU_LABEL_SIZE];
+            ifcpu_label(label, sizeof(label), "else", m->lineBlock[i]);
+            find_symbol(m, label)->value = codeSize;
+            hasElse = 1;
+        }
+    }
+    return codeSize;
+}
 
-        case INSTR_CALL:
-            return 2;
-
-        case INSTR_JUMPLT:
-        case INSTR_JUMPGT:
-        case INSTR_JUMPEQ:
-            /* Conditional jump:
-               - Opcode (2 bytes)
-               - 32-bit relative offset (4 bytes)
-            */
-            return 6;
-
-        case INSTR_JUMP:
-            /* jump instruction:
-               - Opcode (1 byte)
-               - 32-bit relative offset (4 bytes)
-            */
-            return 5;
-
-        case INSTR_COMP:
-        case INSTR_ADD:
-        case INSTR_SUB:
-        case INSTR_MUL:
-        case INSTR_DIV:
-        case INSTR_MOD:
-        case INSTR_AND:
-        case INSTR_OR:
-        case INSTR_XOR:
-        case INSTR_SHL:
-        case INSTR_SHR: {
-            /* Format: <instr> <reg>, <reg/immediate> */
-            char *token = strtok(trimmed, " ,\t");
-            if (!token)
-                return 0;
-
-            char *first = strtok(NULL, " ,\t"); /* first operand */
-            if (!first)
-                return 0;
-
-            char *second = strtok(NULL, " ,\t"); /* second operand */
-            if (!second)
-                return 0;
-
-            uint8_t reg = syntax_get_register_code(first);
-            if (reg == 0xFF)
-                return 0;
-
-            if (syntax_is_numeric(second)) {
-                /* Operation with immediate:
-                   - REX.W (1 byte)
-                   - Opcode (1 byte)
-                   - ModR/M (1 byte)
-                   - 32-bit immediate (4 bytes)
-                */
-                return 7;
-            } else {
-                /* Register-register:
-                   - REX.W (1 byte)
-                   - Opcode (1 byte)
-                   - ModR/M (1 byte)
-                */
-                return 3;
+/* Branch relaxation. Every jump to a label of this module starts out in
+   its 2-byte rel8 form; after each layout, the jumps whose target is out
+   of range are switched to rel32 and the code is laid out again. Jumps
+   only ever grow, so this converges. Returns the final code size.
+*/
+static size_t relax_branches(Module *m)
+{
+    for (;;) {
+        size_t codeSize = layout_code(m);
+        int changed = 0;
+        for (size_t i = 0; i < m->lineCount; i++) {
+            if (m->longBranch[i] || !m->branchTarget[i])
+                continue;
+            const Symbol *target = &m->symbols[m->branchTarget[i] - 1];
+            int64_t rel = (int64_t)target->value - (int64_t)(m->lineOffset[i] + 2);
+            if (rel < INT8_MIN || rel > INT8_MAX) {
+                m->longBranch[i] = 1;
+                changed = 1;
             }
         }
+        if (!changed)
+            return codeSize;
+    }
+}
 
-        case INSTR_NOT: {
-            /* Format: not <reg> */
-            char *token = strtok(trimmed, " ,\t"); /* "not" */
-            if (!token)
-                return 0;
-            char *reg = strtok(NULL, " ,\t"); /* register */
-            if (!reg)
-                return 0;
-
-            uint8_t reg_code = syntax_get_register_code(reg);
-            if (reg_code == 0xFF)
-                return 0;
+/* Align every label that a later jump goes back to, i.e. every loop head */
+static void align_loop_heads(Module *m)
+{
+    for (size_t i = 0; i < m->lineCount; i++) {
+        char buf[MAX_LINE_LEN];
+        strncpy(buf, m->lines[i], MAX_LINE_LEN - 1);
+        buf[MAX_LINE_LEN - 1] = '\0';
+        char *trimmed = syntax_trim(buf);
+        InstructionType type = syntax_get_instruction_type(trimmed);
+        if (type != INSTR_JUMP && type != INSTR_JUMPCC)
+            continue;
 
-            /* Register operation:
-               - REX.W (1 byte)
-               - Opcode (1 byte)
-               - ModR/M (1 byte)
-            */
-            return 3;
+        char *save = NULL;
+        strtok_r(trimmed, " \t", &save); /* mnemonic */
+        const char *target = strtok_r(NULL, " \t", &save);
+        if (!target)
+            continue;
+        for (size_t j = 0; j < i; j++) {
+            char *line = syntax_trim(m->lines[j]);
+            if (!syntax_is_label(line))
+                continue;
+            const char *label = syntax_extract_label_name(line);
+            if (label && strcmp(label, target) == 0 && m->lineAlign[j] < m->loopAlign)
+                m->lineAlign[j] = m->loopAlign;
         }
+    }
+}
 
-        default:
-            return 0;
+/* The CPUID bits that report `features`, by CPUID word (CPUID_*) */
+static void cpuid_masks(uint32_t features, uint32_t masks[CPUID_WORDS])
+{
+    memset(masks, 0, CPUID_WORDS * sizeof(masks[0]));
+    for (uint32_t feature = 1; feature; feature <<= 1) {
+        uint8_t word, bit;
+        if ((features & feature) && syntax_get_cpuid_bit(feature, &word, &bit))
+            masks[word] |= 1u << bit;
+    }
+}
+
+/* Append a line of assembler-generated source to the module */
+static void append_line(Module *m, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void append_line(Module *m, const char *format, ...)
+{
+    if (m->lineCount >= MAX_LINES) {
+        color_error("%s: too many lines to add the ifcpu CPU check", m->filename);
+        fail();
+    }
+    va_list args;
+    va_start(args, format);
+    vsnprintf(m->lines[m->lineCount++], MAX_LINE_LEN, format, args);
+    va_end(args);
+}
+
+/* Append __jasm_cpu_init, which the first runtime ifcpu check calls. It
+   stores the CPUID words that report features in __jasm_cpu, inverted so
+   that a set bit is a missing feature, then sets the dword after them.
+   AVX and AVX-512 count as missing unless the OS saves their registers
+   (XCR0). The words are built in registers and stored once, so threads
+   that race through the first check only ever store the same values. */
+static void append_cpu_init(Module *m)
+{
+    static const char *const saved[] = {"rax", "rbx", "rcx", "rdx", "rsi", "r8", "r9", "r10", "r11"};
+    static const char *const words[CPUID_WORDS] = {"r8d", "r9d", "r10d", "r11d"};
+    const uint32_t avx512 =
+        CPU_AVX512F | CPU_AVX512BW | CPU_AVX512CD | CPU_AVX512DQ | CPU_AVX512VL;
+    uint32_t ymm[CPUID_WORDS], zmm[CPUID_WORDS];
+    cpuid_masks(CPU_AVX | CPU_AVX2 | CPU_FMA | avx512, ymm);
+    cpuid_masks(avx512, zmm);
+    const size_t savedCount = sizeof(saved) / sizeof(saved[0]);
+
+    append_line(m, "__jasm_cpu_init:");
+    for (size_t i = 0; i < savedCount; i++)
+        append_line(m, "push %s", saved[i]);
+    for (int w = 0; w < CPUID_WORDS; w++)
+        append_line(m, "mov %s, 0", words[w]);
+    append_line(m, "mov eax, 0");
+    append_line(m, "cpuid");
+    append_line(m, "mov esi, eax"); /* highest basic leaf */
+    append_line(m, "mov eax, 1");
+    append_line(m, "cpuid");
+    append_line(m, "mov %s, ecx", words[CPUID_1_ECX]);
+    append_line(m, "cmp esi, 7");
+    append_line(m, "jb __jasm_cpu_ext");
+    append_line(m, "mov eax, 7");
+    append_line(m, "mov ecx, 0");
+    append_line(m, "cpuid");
+    append_line(m, "mov %s, ebx", words[CPUID_7_EBX]);
+    append_line(m, "__jasm_cpu_ext:");
+    append_line(m, "mov eax, 0x80000000");
+    append_line(m, "cpuid");
+    append_line(m, "cmp eax, 0x80000001");
+    append_line(m, "jb __jasm_cpu_xcr0");
+    append_line(m, "mov eax, 0x80000001");
+    append_line(m, "cpuid");
+    append_line(m, "mov %s, ecx", words[CPUID_EXT_ECX]);
+    append_line(m, "mov %s, edx", words[CPUID_EXT_EDX]);
+    append_line(m, "__jasm_cpu_xcr0:");
+    append_line(m, "mov eax, 0");
+    append_line(m, "test %s, 0x8000000", words[CPUID_1_ECX]); /* OSXSAVE */
+    append_line(m, "je __jasm_cpu_ymm");
+    append_line(m, "mov ecx, 0");
+    append_line(m, "xgetbv");
+    append_line(m, "__jasm_cpu_ymm:");
+    append_line(m, "mov esi, eax");
+    append_line(m, "and esi, 0x6"); /* SSE and AVX state */
+    append_line(m, "cmp esi, 0x6");
+    append_line(m, "je __jasm_cpu_zmm");
+    for (int w = 0; w < CPUID_WORDS; w++) {
+        if (ymm[w])
+            append_line(m, "and %s, 0x%x", words[w], ~ymm[w]);
+    }
+    append_line(m, "__jasm_cpu_zmm:");
+    append_line(m, "and eax, 0xE6"); /* and the AVX-512 state */
+    append_line(m, "cmp eax, 0xE6");
+    append_line(m, "je __jasm_cpu_store");
+    for (int w = 0; w < CPUID_WORDS; w++) {
+        if (zmm[w])
+            append_line(m, "and %s, 0x%x", words[w], ~zmm[w]);
+    }
+    append_line(m, "__jasm_cpu_store:");
+    for (int w = 0; w < CPUID_WORDS; w++) {
+        append_line(m, "not %s", words[w]);
+        append_line(m, "mov [__jasm_cpu + %d], %s", 4 * w, words[w]);
     }
+    append_line(m, "mov dword [__jasm_cpu + %d], 1", 4 * CPUID_WORDS);
+    for (size_t i = savedCount; i > 0; i--)
+        append_line(m, "pop %s", saved[i - 1]);
+    append_line(m, "ret");
+    append_line(m, "data __jasm_cpu size %d", 4 * (CPUID_WORDS + 1));
 }
 
 /* First pass: simulate code emission and collect data directives.
    Returns total simulated code size.
 */
-static size_t first_pass(size_t lineCount)
+static size_t first_pass(Module *m)
 {
-    size_t codeSize = 0;
-    for (size_t i = 0; i < lineCount; i++) {
-        char *trimmed = syntax_trim(lines[i]);
-        if (trimmed[0] == '\0' || syntax_is_comment(trimmed))
+    /* Calls to extern functions are encoded differently, so collect them
+       before any instruction is sized */
+    for (size_t i = 0; i < m->lineCount; i++) {
+        char *trimmed = syntax_trim(m->lines[i]);
+        if (!syntax_is_extern_directive(trimmed))
+            continue;
+        char *name = syntax_trim(trimmed + strlen(syntax_extern_keyword));
+        if (!*name) {
+            color_error("extern directive requires a symbol name");
+            fail();
+        }
+        check_symbol_name(m->filename, i + 1, name);
+        if (!find_symbol(m, name)) {
+            add_symbol(m, name, 0, SECTION_UNDEF);
+            m->symbols[m->symbolCount - 1].global = 1;
+            m->symbols[m->symbolCount - 1].external = 1;
+        }
+    }
+
+    size_t procLine = 0; /* Line number of the open proc, 0 outside one */
+    size_t frame = 0;
+    size_t ifLine = 0; /* Line number of the open ifcpu, 0 outside one */
+    uint32_t ifFeatures = 0;
+    int ifStatic = 0;  /* --march decides the open ifcpu */
+    int inElse = 0;
+    int hasInit = 0;   /* __jasm_cpu_init has been appended */
+    const size_t sourceLines = m->lineCount; /* Lines after these are generated */
+    const uint32_t allowed = m->march ? m->cpuFeatures : ~0u;
+    for (size_t i = 0; i < m->lineCount; i++) {
+        char *trimmed = syntax_trim(m->lines[i]);
+        m->lineFrame[i] = frame;
+        m->lineFeatures[i] = allowed | (ifLine && !inElse ? ifFeatures : 0);
+        if (syntax_is_ifcpu_directive(trimmed)) {
+            /* Without --march guaranteeing the features, check for them
+               at runtime */
+            if (ifLine) {
+                color_error("%s:%zu: ifcpu inside the ifcpu on line %zu",
+                            m->filename,
+                            i + 1,
+                            ifLine);
+                fail();
+            }
+            const uint32_t features = parse_ifcpu_directive(m->filename, i + 1, trimmed);
+            ifFeatures = syntax_get_implied_cpu_features(features);
+            ifLine = i + 1;
+            ifStatic = m->march && (m->cpuFeatures & features) == features;
+            inElse = 0;
+            if (!ifStatic) {
+                char label[IFCPU_LABEL_SIZE];
+                ifcpu_label(label, sizeof(label), "else", ifLine);
+                add_symbol(m, label, 0, SECTION_TEXT);
+                ifcpu_label(label, sizeof(label), "endif", ifLine);
+                add_symbol(m, label, 0, SECTION_TEXT);
+                m->lineBlock[i] = ifLine;
+                if (!hasInit) {
+                    append_cpu_init(m);
+                    hasInit = 1;
+                }
+            }
+            continue;
+        }
+        if (syntax_is_else_directive(trimmed) || syntax_is_endif_directive(trimmed)) {
+            const int isElse = syntax_is_else_directive(trimmed);
+            if (!ifLine || (isElse && inElse)) {
+                color_error("%s:%zu: %s without an ifcpu",
+                            m->filename,
+                            i + 1,
+                            isElse ? syntax_else_keyword : syntax_endif_keyword);
+                fail();
+            }
+            m->lineBlock[i] = ifStatic ? 0 : ifLine;
+            inElse = isElse;
+            if (!isElse)
+                ifLine = 0;
+            continue;
+        }
+        if (ifLine && ifStatic && inElse) {
+            /* The target always takes the other branch */
+            m->lineDead[i] = 1;
+            continue;
+        }
+        if (trimmed[0] == '\0' || syntax_is_comment(trimmed) || syntax_is_extern_directive(trimmed))
             continue;
         if (syntax_is_data_directive(trimmed)) {
             /* Process data directive */
-            if (dataDirCount >= MAX_SYMBOLS) {
+            if (m->dataDirCount >= MAX_SYMBOLS) {
                 color_error("too many data directives");
-                exit(1);
+                fail();
             }
 
-            if (!syntax_process_data_directive(trimmed, &dataDirectives[dataDirCount])) {
+            if (!syntax_process_data_directive(trimmed, &m->dataDirectives[m->dataDirCount])) {
                 color_error("invalid data directive: %s", trimmed);
-                exit(1);
+                fail();
             }
 
-            dataDirCount++;
+            if (i < sourceLines)
+                check_symbol_name(m->filename, i + 1, m->dataDirectives[m->dataDirCount].label);
+            m->dataDirLine[m->dataDirCount] = (int)i + 1;
+            m->dataDirCount++;
+        } else if (syntax_is_global_directive(trimmed)) {
+            /* Remember the name, it is resolved once all symbols are known */
+            char *name = syntax_trim(trimmed + strlen(syntax_global_keyword));
+            if (!*name) {
+                color_error("global directive requires a symbol name");
+                fail();
+            }
+            if (m->globalCount >= MAX_SYMBOLS) {
+                color_error("too many global directives");
+                fail();
+            }
+            strncpy(m->globalNames[m->globalCount], name, sizeof(m->globalNames[0]) - 1);
+            m->globalNames[m->globalCount][sizeof(m->globalNames[0]) - 1] = '\0';
+            m->globalCount++;
+        } else if (syntax_is_align_directive(trimmed)) {
+            /* Pad the following code to a power of two up to a page */
+            char *value = syntax_trim(trimmed + strlen(syntax_align_keyword));
+            char *end = NULL;
+            unsigned long long bytes = strtoull(value, &end, 0);
+            if (!*value || *end || bytes == 0 || bytes > 4096 || (bytes & (bytes - 1))) {
+                color_error("align needs a power of two up to 4096: %s", trimmed);
+                fail();
+            }
+            m->lineAlign[i] = (size_t)bytes;
+        } else if (syntax_is_proc_directive(trimmed)) {
+            /* The proc's name is a label, its frame applies to every line
+               up to the matching endp */
+            if (procLine) {
+                color_error("%s:%zu: proc inside the proc on line %zu",
+                            m->filename,
+                            i + 1,
+                            procLine);
+                fail();
+            }
+            char name[32];
+            parse_proc_directive(trimmed, name, &frame);
+            check_symbol_name(m->filename, i + 1, name);
+            add_symbol(m, name, 0, SECTION_TEXT);
+            m->lineFrame[i] = frame;
+            procLine = i + 1;
+        } else if (syntax_is_endp_directive(trimmed)) {
+            if (!procLine) {
+                color_error("%s:%zu: endp without a proc", m->filename, i + 1);
+                fail();
+            }
+            procLine = 0;
+            frame = 0;
         } else if (syntax_is_label(trimmed)) {
             /* Process label definition */
             char *label = syntax_extract_label_name(trimmed);
             if (label) {
-                /* Store label position in symbol table */
-                add_symbol(label, BASE_ADDR + CODE_OFFSET + codeSize);
+                /* Store label in symbol table, its position is set by the layout */
+                if (i < sourceLines)
+                    check_symbol_name(m->filename, i + 1, label);
+                add_symbol(m, label, 0, SECTION_TEXT);
             }
-        } else {
-            /* Instruction line */
-            size_t sz = simulate_instruction(trimmed);
-            codeSize += sz;
         }
     }
-    return codeSize;
+
+    if (procLine) {
+        color_error("%s:%zu: proc has no endp", m->filename, procLine);
+        fail();
+    }
+    if (ifLine) {
+        color_error("%s:%zu: ifcpu has no endif", m->filename, ifLine);
+        fail();
+    }
+
+    if (m->loopAlign > 1)
+        align_loop_heads(m);
+    for (size_t i = 0; i < m->lineCount; i++) {
+        if (m->lineAlign[i] > m->textAlign)
+            m->textAlign = m->lineAlign[i];
+    }
+    return relax_branches(m);
 }
 
 /* ---- Instruction Emission ---- */
@@ -432,240 +861,1691 @@ static void ensure_data_buffer_capacity(DataBuffer *dataBuf, size_t additional_b
     ensure_buffer_capacity(dataBuf, additional_bytes);
 }
 
-typedef struct {
-    CodeBuffer *codeBuf;
-    const char *filename;
-    int line_number;
-    const char *line_content;
-} EmitContext;
+/* Find a symbol referenced from code. Unknown names are imports, to be
+   resolved against the other modules' exports. */
+static Symbol *reference_symbol(Module *m, const char *name)
+{
+    Symbol *sym = find_symbol(m, name);
+    if (!sym) {
+        add_symbol(m, name, 0, SECTION_UNDEF);
+        sym = &m->symbols[m->symbolCount - 1];
+        sym->global = 1;
+    }
+    return sym;
+}
 
-static void emit_instruction_line_ctx(EmitContext *ctx, const char *line)
+/* Emit the 32-bit PC-relative displacement to a symbol plus `disp`. `tail`
+   is the number of instruction bytes that still follow the displacement,
+   since the CPU computes the target relative to the end of the instruction.
+   Labels in the module's own code are resolved right away; references to
+   data and to symbols of other modules are recorded as relocations of
+   `type` for the link step: R_X86_64_PLT32 for call and jump targets, so
+   that a PIE or shared library can reach a function through its PLT, and
+   R_X86_64_PC32 for data. */
+static void emit_symbol_rel32(
+    EmitContext *ctx, const char *name, int64_t disp, size_t tail, uint32_t type)
 {
+    Module *m = ctx->module;
     CodeBuffer *codeBuf = ctx->codeBuf;
-    const char *filename = ctx->filename;
-    int line_number = ctx->line_number;
-    const char *line_content = ctx->line_content;
-    char buf[MAX_LINE_LEN];
-    strncpy(buf, line, MAX_LINE_LEN - 1);
-    buf[MAX_LINE_LEN - 1] = '\0';
-    char *trimmed = syntax_trim(buf);
 
-    if (trimmed[0] == '\0' || syntax_is_comment(trimmed))
+    if (ctx->sizing) {
+        codeBuf->size += 4;
         return;
-    if (syntax_is_data_directive(trimmed))
-        return; /* skip data directives */
-    if (syntax_is_label(trimmed))
-        return; /* skip label definitions */
-
-    InstructionType instrType = syntax_get_instruction_type(trimmed);
-
-    switch (instrType) {
-        case INSTR_MOVE: {
-            /* Format:
-               move <register>, <immediate>
-               move <register>, [<symbol>]  ; load from memory
-               move [<symbol>], <register>  ; store to memory
-            */
-            char *token = strtok(trimmed, " ,\t"); /* "move" */
-            (void)token;
-            token = strtok(NULL, " ,\t"); /* destination */
-            if (!token) {
-                color_error("expected destination after 'move'");
-                exit(1);
-            }
-            char dest[MAX_LINE_LEN];
-            strncpy(dest, token, sizeof(dest) - 1);
-            dest[sizeof(dest) - 1] = '\0';
-
-            token = strtok(NULL, " ,\t"); /* source */
-            if (!token) {
-                color_error("expected source after destination");
-                exit(1);
-            }
-
-            if (syntax_is_memory_reference(dest)) {
-                /* Store to memory: move [symbol], reg */
-                ensure_code_buffer_capacity(codeBuf, 7);  // Need 7 bytes
-
-                char *symbol = syntax_extract_memory_reference(dest);
-                uint64_t addr = lookup_symbol(symbol, filename, line_number, line_content);
-                uint8_t reg = syntax_get_register_code(token);
-
-                if (reg == 0xFF) {
-                    color_error("unknown register '%s'", token);
-                    exit(1);
-                }
-
-                /* Calculate relative offset from next instruction */
-                const int64_t rel_addr = addr - (BASE_ADDR + CODE_OFFSET + codeBuf->size + 7);
-
-                /* mov [rip + disp32], reg */
-                codeBuf->bytes[codeBuf->size++] = 0x48;              /* REX.W */
-                codeBuf->bytes[codeBuf->size++] = 0x89;              /* mov r/m64, r64 */
-                codeBuf->bytes[codeBuf->size++] = (reg << 3) | 0x05; /* ModR/M: RIP-relative */
-                /* 32-bit relative address */
-                for (int i = 0; i < 4; i++)
-                    codeBuf->bytes[codeBuf->size++] = (uint8_t)((rel_addr >> (8 * i)) & 0xff);
-            } else if (syntax_is_memory_reference(token)) {
-                /* Load from memory: move reg, [symbol] */
-                ensure_code_buffer_capacity(codeBuf, 7);  // Need 7 bytes
-
-                char *symbol = syntax_extract_memory_reference(token);
-                uint64_t addr = lookup_symbol(symbol, filename, line_number, line_content);
-                uint8_t reg = syntax_get_register_code(dest);
+    }
+    Symbol *sym = reference_symbol(m, name);
+    if (sym->section == SECTION_TEXT) {
+        /* Calculate relative offset from next instruction */
+        int64_t rel_addr = (int64_t)sym->value + disp - (int64_t)(codeBuf->size + 4 + tail);
+        for (int i = 0; i < 4; i++)
+            codeBuf->bytes[codeBuf->size++] = (uint8_t)((rel_addr >> (8 * i)) & 0xff);
+        return;
+    }
 
-                if (reg == 0xFF) {
-                    color_error("unknown register '%s'", dest);
-                    exit(1);
-                }
+    add_relocation(m,
+                   SECTION_TEXT,
+                   codeBuf->size,
+                   (size_t)(sym - m->symbols),
+                   type,
+                   disp - 4 - (int64_t)tail,
+                   ctx->line_number);
+    for (int i = 0; i < 4; i++)
+        codeBuf->bytes[codeBuf->size++] = 0;
+}
 
-                /* Calculate relative offset from next instruction */
-                int64_t rel_addr = addr - (BASE_ADDR + CODE_OFFSET + codeBuf->size + 7);
+/* Emit the absolute address of a symbol plus `disp` as a sign-extended
+   32-bit displacement, for addressing modes that cannot be RIP-relative.
+   The address is only known after linking, so this is always a
+   relocation. */
+static void emit_symbol_abs32(EmitContext *ctx, const char *name, int64_t disp)
+{
+    Module *m = ctx->module;
+    CodeBuffer *codeBuf = ctx->codeBuf;
 
-                /* mov reg, [rip + disp32] */
-                codeBuf->bytes[codeBuf->size++] = 0x48;              /* REX.W */
-                codeBuf->bytes[codeBuf->size++] = 0x8B;              /* mov r64, r/m64 */
-                codeBuf->bytes[codeBuf->size++] = (reg << 3) | 0x05; /* ModR/M: RIP-relative */
-                /* 32-bit relative address */
-                for (int i = 0; i < 4; i++)
-                    codeBuf->bytes[codeBuf->size++] = (uint8_t)((rel_addr >> (8 * i)) & 0xff);
-            } else if (syntax_is_numeric(token)) {
-                /* Move immediate to register */
-                uint64_t val = strtoull(token, NULL, 0);
-                uint8_t reg = syntax_get_register_code(dest);
+    if (ctx->sizing) {
+        codeBuf->size += 4;
+        return;
+    }
+    const Symbol *sym = reference_symbol(m, name);
+    add_relocation(m,
+                   SECTION_TEXT,
+                   codeBuf->size,
+                   (size_t)(sym - m->symbols),
+                   R_X86_64_32S,
+                   disp,
+                   ctx->line_number);
+    for (int i = 0; i < 4; i++)
+        codeBuf->bytes[codeBuf->size++] = 0;
+}
 
-                if (reg == 0xFF) {
-                    color_error("unknown register '%s'", dest);
-                    exit(1);
-                }
+/* Emit the 32-bit PC-relative displacement to the GOT slot of an extern
+   function. The slot is allocated by the link step and filled in by the
+   dynamic loader. */
+static void emit_symbol_got32(EmitContext *ctx, const Symbol *sym)
+{
+    Module *m = ctx->module;
+    CodeBuffer *codeBuf = ctx->codeBuf;
 
-                /* For small values, use 32-bit move which zero-extends to 64 bits */
-                if (val <= 0xffffffffULL) {
-                    ensure_code_buffer_capacity(codeBuf, 7);  // Need 7 bytes
+    if (ctx->sizing) {
+        codeBuf->size += 4;
+        return;
+    }
+    add_relocation(m,
+                   SECTION_TEXT,
+                   codeBuf->size,
+                   (size_t)(sym - m->symbols),
+                   R_X86_64_GOTPCREL,
+                   -4,
+                   ctx->line_number);
+    for (int i = 0; i < 4; i++)
+        codeBuf->bytes[codeBuf->size++] = 0;
+}
 
-                    codeBuf->bytes[codeBuf->size++] = 0x48;       /* REX.W */
-                    codeBuf->bytes[codeBuf->size++] = 0xC7;       /* mov r/m64, imm32 */
-                    codeBuf->bytes[codeBuf->size++] = 0xC0 | reg; /* ModR/M: register direct */
-                    for (int i = 0; i < 4; i++)
-                        codeBuf->bytes[codeBuf->size++] = (uint8_t)((val >> (8 * i)) & 0xff);
-                } else {
-                    ensure_code_buffer_capacity(codeBuf, 10);  // Need 10 bytes
+/* Emit a jump to a label: `short_opcode` rel8 when relaxation found the
+   target in range, otherwise the `long_len` opcode bytes of the rel32 form.
+   While sizing, jumps to anything but a label of this module are marked
+   as needing rel32 right away. */
+static void emit_branch(EmitContext *ctx,
+                        const char *label,
+                        uint8_t short_opcode,
+                        const uint8_t *long_opcode,
+                        size_t long_len)
+{
+    Module *m = ctx->module;
+    CodeBuffer *codeBuf = ctx->codeBuf;
+    const size_t line = (size_t)ctx->line_number - 1;
+    const Symbol *sym = find_symbol(m, label);
+
+    if (ctx->sizing) {
+        m->branchTarget[line] = 0;
+        if (!sym || sym->section != SECTION_TEXT)
+            m->longBranch[line] = 1;
+        else
+            m->branchTarget[line] = (size_t)(sym - m->symbols) + 1;
+    }
 
-                    /* For large values, use movabs */
-                    codeBuf->bytes[codeBuf->size++] = 0x48;       /* REX.W */
-                    codeBuf->bytes[codeBuf->size++] = 0xB8 + reg; /* movabs r64, imm64 */
-                    for (int i = 0; i < 8; i++)
-                        codeBuf->bytes[codeBuf->size++] = (uint8_t)((val >> (8 * i)) & 0xff);
-                }
-            } else {
-                /* Move symbol address to register */
-                ensure_code_buffer_capacity(codeBuf, 7);  // Need 7 bytes
+    ensure_code_buffer_capacity(codeBuf, long_len + 4);
+    if (m->longBranch[line]) {
+        for (size_t i = 0; i < long_len; i++)
+            codeBuf->bytes[codeBuf->size++] = long_opcode[i];
+        emit_symbol_rel32(ctx, label, 0, 0, R_X86_64_PLT32);
+        return;
+    }
 
-                uint64_t symVal = lookup_symbol(token, filename, line_number, line_content);
-                uint8_t reg = syntax_get_register_code(dest);
+    int64_t rel = ctx->sizing ? 0 : (int64_t)sym->value - (int64_t)(codeBuf->size + 2);
+    if (rel < INT8_MIN || rel > INT8_MAX) {
+        color_error("internal error: short jump to '%s' out of range", label);
+        fail();
+    }
+    codeBuf->bytes[codeBuf->size++] = short_opcode;
+    codeBuf->bytes[codeBuf->size++] = (uint8_t)rel;
+}
 
-                if (reg == 0xFF) {
-                    color_error("unknown register '%s'", dest);
-                    exit(1);
-                }
+/* Emit the ModR/M byte, SIB byte and displacement that address a memory
+   operand, with `reg` (a register or an opcode extension /n) in the reg
+   field. `tail` is the number of immediate bytes that follow. A symbol on
+   its own is addressed RIP-relative; combined with registers, its absolute
+   address becomes the displacement. */
+static void emit_memory_operand(EmitContext *ctx,
+                                uint8_t reg,
+                                const SyntaxMemoryOperand *mem,
+                                size_t tail)
+{
+    CodeBuffer *codeBuf = ctx->codeBuf;
+    const int hasBase = mem->base != 0xFF;
+    const int hasIndex = mem->index != 0xFF;
+    const int hasSymbol = mem->symbol[0] != '\0';
+    reg = (uint8_t)((reg & 7) << 3);
+
+    if (hasSymbol && !hasBase && !hasIndex) {
+        encode_byte(codeBuf, reg | 0x05); /* ModR/M: RIP-relative */
+        ensure_code_buffer_capacity(codeBuf, 4);
+        emit_symbol_rel32(ctx, mem->symbol, mem->disp, tail, R_X86_64_PC32);
+        return;
+    }
+    if (hasIndex && mem->index == 4 && mem->indexSize == 0) {
+        color_error("rsp cannot be used as an index register");
+        fail();
+    }
+    if (mem->disp < INT32_MIN || mem->disp > INT32_MAX) {
+        color_error("displacement %lld out of range", (long long)mem->disp);
+        fail();
+    }
 
-                /* Use lea for symbol addresses */
-                codeBuf->bytes[codeBuf->size++] = 0x48;              /* REX.W */
-                codeBuf->bytes[codeBuf->size++] = 0x8D;              /* lea r64, m */
-                codeBuf->bytes[codeBuf->size++] = (reg << 3) | 0x05; /* ModR/M: RIP-relative */
+    /* Without a base register only the disp32 form exists. [rbp] and [r13]
+       cannot be encoded without a displacement, and a symbol's address
+       always takes 32 bits. */
+    size_t dispSize = 4;
+    uint8_t mod = 0x00;
+    if (hasBase) {
+        if (!hasSymbol && mem->disp == 0 && (mem->base & 7) != 5)
+            dispSize = 0;
+        else if (!hasSymbol && mem->disp >= INT8_MIN && mem->disp <= INT8_MAX)
+            dispSize = 1;
+        mod = dispSize == 0 ? 0x00 : dispSize == 1 ? 0x40 : 0x80;
+    }
 
-                /* Calculate relative offset from next instruction */
-                int64_t rel_addr = symVal - (BASE_ADDR + CODE_OFFSET + codeBuf->size + 4);
-                for (int i = 0; i < 4; i++)
-                    codeBuf->bytes[codeBuf->size++] = (uint8_t)((rel_addr >> (8 * i)) & 0xff);
-            }
-            break;
-        }
+    /* rm = 100 selects a SIB byte, needed for an index, for no base, and
+       for rsp and r12 as the base */
+    if (hasIndex || !hasBase || (mem->base & 7) == 4) {
+        const uint8_t scaleBits =
+            mem->scale == 8 ? 3 : mem->scale == 4 ? 2 : mem->scale == 2 ? 1 : 0;
+        const uint8_t index = hasIndex ? (mem->index & 7) : 4; /* 100: no index */
+        const uint8_t base = hasBase ? (mem->base & 7) : 5;    /* 101: no base */
+        encode_byte(codeBuf, mod | reg | 0x04);
+        encode_byte(codeBuf, (uint8_t)((scaleBits << 6) | (index << 3) | base));
+    } else {
+        encode_byte(codeBuf, mod | reg | (mem->base & 7));
+    }
 
-        case INSTR_CALL: {
-            ensure_code_buffer_capacity(codeBuf, 2);  // Need 2 bytes
+    if (hasSymbol) {
+        ensure_code_buffer_capacity(codeBuf, 4);
+        emit_symbol_abs32(ctx, mem->symbol, mem->disp);
+    } else if (dispSize > 0) {
+        encode_imm(codeBuf, (uint64_t)mem->disp, dispSize);
+    }
+}
 
-            /* syscall opcode */
-            codeBuf->bytes[codeBuf->size++] = 0x0F;
-            codeBuf->bytes[codeBuf->size++] = 0x05;
-            break;
+/* Split the operands after the mnemonic of `trimmed` into `operands`,
+   which must be between `min` and `max` of them. Returns their number. */
+static size_t split_operand_range(char *trimmed, char **operands, size_t min, size_t max)
+{
+    char *p = trimmed;
+    while (*p && !isspace((unsigned char)*p))
+        p++;
+    const size_t mnemonicLen = (size_t)(p - trimmed);
+
+    size_t count = syntax_split_operands(p, operands, max);
+    if (count < min || count > max) {
+        if (min == max)
+            color_error("'%.*s' expects %zu operand%s",
+                        (int)mnemonicLen,
+                        trimmed,
+                        min,
+                        min == 1 ? "" : "s");
+        else
+            color_error(
+                "'%.*s' expects %zu to %zu operands", (int)mnemonicLen, trimmed, min, max);
+        fail();
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (*operands[i] == '\0') {
+            color_error("empty operand in '%.*s'", (int)mnemonicLen, trimmed);
+            fail();
         }
+    }
+    return count;
+}
 
-        case INSTR_JUMPLT:
-        case INSTR_JUMPGT:
-        case INSTR_JUMPEQ: {
-            ensure_code_buffer_capacity(codeBuf, 6);  // Need 6 bytes
+/* Split the operands after the mnemonic of `trimmed` into `operands`,
+   which must be exactly `expected` of them */
+static void split_operands(char *trimmed, char **operands, size_t expected)
+{
+    split_operand_range(trimmed, operands, expected, expected);
+}
 
-            /* Get label name */
-            char *label = strtok(trimmed + strlen(syntax_instruction_to_string(instrType)), " \t");
-            if (!label) {
-                color_error("conditional jump instruction requires a label");
-                exit(1);
-            }
-            label = syntax_trim(label);
+/* Parse a memory operand, or exit with an error */
+static void parse_memory_operand(const char *text, SyntaxMemoryOperand *mem)
+{
+    if (!syntax_parse_memory_operand(text, mem)) {
+        color_error("invalid memory operand '%s'", text);
+        fail();
+    }
+    if (mem->indexSize != 0) {
+        color_error("only gathers take a vector index register, not '%s'", text);
+        fail();
+    }
+}
+
+/* ModR/M extension of the group 1 ALU instructions (81 /n, 83 /n). The
+   register forms use the opcodes n*8+1 (r/m64, r64) and n*8+3 (r64, r/m64).
+   Returns -1 for other instructions. */
+static int group1_extension(InstructionType instrType)
+{
+    switch (instrType) {
+        case INSTR_ADD:
+            return 0;
+        case INSTR_OR:
+            return 1;
+        case INSTR_AND:
+            return 4;
+        case INSTR_SUB:
+            return 5;
+        case INSTR_XOR:
+            return 6;
+        case INSTR_COMP:
+            return 7;
+        default:
+            return -1;
+    }
+}
+
+/* ModR/M extension of the shifts and rotates (C1 /n, D1 /n, D3 /n).
+   Returns -1 for other instructions. */
+static int shift_extension(InstructionType instrType)
+{
+    switch (instrType) {
+        case INSTR_ROL:
+            return 0;
+        case INSTR_ROR:
+            return 1;
+        case INSTR_RCL:
+            return 2;
+        case INSTR_RCR:
+            return 3;
+        case INSTR_SHL:
+            return 4;
+        case INSTR_SHR:
+            return 5;
+        case INSTR_SAR:
+            return 7;
+        default:
+            return -1;
+    }
+}
+
+/* A register or memory operand, the ModR/M r/m side of an instruction */
+typedef struct {
+    int inMemory;
+    uint8_t reg;             /* Register code, if not in memory */
+    SyntaxMemoryOperand mem; /* Address, if in memory */
+    uint8_t size;            /* Operand size in bytes, 0 if not given */
+} RmOperand;
+
+/* Parse a register of any size or a memory operand. Returns 0 if the text
+   is neither. */
+static int parse_rm_operand(const char *text, RmOperand *rm)
+{
+    if (syntax_is_memory_reference(text)) {
+        parse_memory_operand(text, &rm->mem);
+        rm->inMemory = 1;
+        rm->size = rm->mem.size;
+        return 1;
+    }
+    rm->inMemory = 0;
+    rm->reg = syntax_get_sized_register_code(text, &rm->size);
+    return rm->reg != 0xFF;
+}
 
-            /* Look up label address */
-            uint64_t target = lookup_symbol(label, filename, line_number, line_content);
+/* Parse a register or memory operand, or exit with an error */
+static void expect_rm_operand(const char *text, RmOperand *rm)
+{
+    if (!parse_rm_operand(text, rm)) {
+        color_error("unknown register '%s'", text);
+        fail();
+    }
+}
 
-            /* Calculate relative offset from next instruction */
-            int64_t rel_addr = target - (BASE_ADDR + CODE_OFFSET + codeBuf->size + 6);
+/* Parse a register of any size, or exit with an error. Returns its code. */
+static uint8_t expect_register(const char *text, uint8_t *size)
+{
+    uint8_t reg = syntax_get_sized_register_code(text, size);
+    if (reg == 0xFF) {
+        if (syntax_is_memory_reference(text))
+            color_error("expected a register, not '%s'", text);
+        else
+            color_error("unknown register '%s'", text);
+        fail();
+    }
+    return reg;
+}
+
+/* Size in bytes of an operation on `rm` and a register of `regSize` bytes,
+   0 for none. Memory without a size qualifier takes the size of the
+   register, or 64 bits. */
+static uint8_t operand_size(const RmOperand *rm, uint8_t regSize)
+{
+    if (regSize && rm->size && regSize != rm->size) {
+        color_error("operand size mismatch: %u and %u bits", rm->size * 8, regSize * 8);
+        fail();
+    }
+    return regSize ? regSize : rm->size ? rm->size : 8;
+}
+
+/* Opcode for `size`-byte operands of an instruction whose 8-bit form is
+   the even opcode below the full-size one */
+static uint8_t sized_opcode(uint8_t opcode, uint8_t size)
+{
+    return size == 1 ? (uint8_t)(opcode & ~1) : opcode;
+}
+
+/* Number of immediate bytes for `size`-byte operands: 64-bit operations
+   take a sign-extended imm32 */
+static size_t immediate_size(uint8_t size)
+{
+    return size == 8 ? 4 : size;
+}
+
+/* Value of an immediate operand for `size`-byte operands, or exit if it does
+   not fit */
+static int64_t immediate_value(const char *text, uint8_t size)
+{
+    const int64_t imm = (int64_t)strtoull(text, NULL, 0);
+    const int bits = (int)immediate_size(size) * 8;
+    const int64_t min = -((int64_t)1 << (bits - 1));
+    const int64_t max = size == 8 ? INT32_MAX : ((int64_t)1 << bits) - 1;
+    if (imm < min || imm > max) {
+        color_error("immediate '%s' does not fit in %d bits", text, bits);
+        fail();
+    }
+    return imm;
+}
+
+/* Value of an 8-bit immediate such as a shuffle control, or exit */
+static uint8_t expect_imm8(const char *text)
+{
+    if (!syntax_is_numeric(text)) {
+        color_error("expected an immediate, not '%s'", text);
+        fail();
+    }
+    return (uint8_t)immediate_value(text, 1);
+}
+
+/* Emit ModR/M [SIB] [disp] for `rm` with `reg` in the reg field */
+static void emit_rm_operand(EmitContext *ctx, uint8_t reg, const RmOperand *rm, size_t tail)
+{
+    if (rm->inMemory)
+        emit_memory_operand(ctx, reg, &rm->mem, tail);
+    else
+        encode_byte(ctx->codeBuf, 0xC0 | ((reg & 7) << 3) | (rm->reg & 7));
+}
+
+/* Append [66] [REX] opcode ModR/M [SIB] [disp] for an instruction with
+   `size`-byte operands. `reg` is a register of `regSize` bytes, or an
+   opcode extension (/n) when regSize is 0. `tail` is the number of
+   immediate bytes that follow. A mandatory F2 or F3 prefix at the start
+   of the opcode goes before REX. */
+static void emit_rm_instruction(EmitContext *ctx,
+                                uint8_t size,
+                                const uint8_t *opcode,
+                                size_t opcode_len,
+                                uint8_t reg,
+                                uint8_t regSize,
+                                const RmOperand *rm,
+                                size_t tail)
+{
+    CodeBuffer *codeBuf = ctx->codeBuf;
+    const uint8_t index = rm->inMemory && rm->mem.index != 0xFF ? rm->mem.index : 0;
+    const uint8_t base = !rm->inMemory ? rm->reg : rm->mem.base != 0xFF ? rm->mem.base : 0;
+
+    /* spl, bpl, sil and dil exist only with a REX prefix */
+    const int forceRex = (regSize == 1 && reg >= 4 && reg < 8)
+                         || (!rm->inMemory && rm->size == 1 && rm->reg >= 4 && rm->reg < 8);
+
+    size_t first = 0;
+    if (size == 2)
+        encode_byte(codeBuf, 0x66); /* operand-size prefix */
+    if (opcode_len > 1 && (opcode[0] == 0xF2 || opcode[0] == 0xF3))
+        encode_byte(codeBuf, opcode[first++]);
+    encode_rex_forced(codeBuf, forceRex, size == 8, reg, index, base);
+    for (size_t i = first; i < opcode_len; i++)
+        encode_byte(codeBuf, opcode[i]);
+    emit_rm_operand(ctx, reg, rm, tail);
+}
+
+/* Emit a group 1 ALU instruction (add, or, and, sub, xor, cmp) with
+   extension `ext`: <instr> <reg/memory>, <reg/immediate> or
+   <instr> <reg>, [<memory>] */
+static void emit_alu(EmitContext *ctx, uint8_t ext, const char *first, const char *second)
+{
+    RmOperand dst, src;
+    expect_rm_operand(first, &dst);
+
+    if (syntax_is_numeric(second)) {
+        /* 80 /n ib for bytes. Otherwise 83 /n ib when the immediate fits in
+           a signed byte, 81 /n iw/id when it does not. */
+        const uint8_t size = operand_size(&dst, 0);
+        const int64_t imm = immediate_value(second, size);
+        const int fits_imm8 = size == 1 || (imm >= INT8_MIN && imm <= INT8_MAX);
+        const size_t immSize = fits_imm8 ? 1 : immediate_size(size);
+        const uint8_t opcode[] = {size == 1 ? 0x80 : fits_imm8 ? 0x83 : 0x81};
+        emit_rm_instruction(ctx, size, opcode, sizeof(opcode), ext, 0, &dst, immSize);
+        encode_imm(ctx->codeBuf, (uint64_t)imm, immSize);
+        return;
+    }
+
+    expect_rm_operand(second, &src);
+    if (dst.inMemory && src.inMemory) {
+        color_error("at most one operand can be in memory");
+        fail();
+    }
+    if (src.inMemory) {
+        /* <instr> r, r/m: opcode n*8+3 */
+        const uint8_t size = operand_size(&src, dst.size);
+        const uint8_t opcode[] = {sized_opcode((uint8_t)(ext * 8 + 3), size)};
+        emit_rm_instruction(ctx, size, opcode, sizeof(opcode), dst.reg, size, &src, 0);
+    } else {
+        /* <instr> r/m, r: opcode n*8+1 */
+        const uint8_t size = operand_size(&dst, src.size);
+        const uint8_t opcode[] = {sized_opcode((uint8_t)(ext * 8 + 1), size)};
+        emit_rm_instruction(ctx, size, opcode, sizeof(opcode), src.reg, size, &dst, 0);
+    }
+}
+
+/* Emit div or mod as idiv r/m: F6 /7, F7 /7. The first operand only sets
+   the size: idiv divides ax, dx:ax, edx:eax or rdx:rax and leaves the
+   quotient in the accumulator and the remainder in ah or the d register. */
+static void emit_divide(EmitContext *ctx, const char *dest, const char *src)
+{
+    uint8_t regSize;
+    expect_register(dest, &regSize);
+    if (syntax_is_numeric(src)) {
+        color_error("idiv has no immediate form, divide by a register");
+        fail();
+    }
+    RmOperand rm;
+    expect_rm_operand(src, &rm);
+    const uint8_t size = operand_size(&rm, regSize);
+    const uint8_t opcode[] = {sized_opcode(0xF7, size)};
+    emit_rm_instruction(ctx, size, opcode, sizeof(opcode), 7, 0, &rm, 0);
+}
+
+/* Emit imul r, r/m: 0F AF /r */
+static void emit_imul(EmitContext *ctx, const char *dest, const char *src)
+{
+    uint8_t regSize;
+    const uint8_t reg = expect_register(dest, &regSize);
+    RmOperand rm;
+    expect_rm_operand(src, &rm);
+    const uint8_t size = operand_size(&rm, regSize);
+    if (size == 1) {
+        color_error("imul has no 8-bit form with a destination register");
+        fail();
+    }
+    const uint8_t opcode[] = {0x0F, 0xAF};
+    emit_rm_instruction(ctx, size, opcode, sizeof(opcode), reg, size, &rm, 0);
+}
+
+/* Emit imul r, r/m, imm: 6B /r ib or 69 /r iw/id */
+static void emit_imul_immediate(EmitContext *ctx,
+                                const char *dest,
+                                const char *src,
+                                const char *immediate)
+{
+    uint8_t regSize;
+    const uint8_t reg = expect_register(dest, &regSize);
+    RmOperand rm;
+    expect_rm_operand(src, &rm);
+    const uint8_t size = operand_size(&rm, regSize);
+    if (size == 1) {
+        color_error("imul has no 8-bit form with a destination register");
+        fail();
+    }
+    if (!syntax_is_numeric(immediate)) {
+        color_error("expected an immediate, not '%s'", immediate);
+        fail();
+    }
+    const int64_t imm = immediate_value(immediate, size);
+    const int fits_imm8 = imm >= INT8_MIN && imm <= INT8_MAX;
+    const size_t immSize = fits_imm8 ? 1 : immediate_size(size);
+    const uint8_t opcode[] = {fits_imm8 ? 0x6B : 0x69};
+    emit_rm_instruction(ctx, size, opcode, sizeof(opcode), reg, size, &rm, immSize);
+    encode_imm(ctx->codeBuf, (uint64_t)imm, immSize);
+}
+
+/* Emit a shift of a register or memory operand with extension `ext` (/4
+   shl, /5 shr) by an immediate or by cl */
+static void emit_shift(EmitContext *ctx, uint8_t ext, const char *first, const char *second)
+{
+    RmOperand dst;
+    expect_rm_operand(first, &dst);
+    const uint8_t size = operand_size(&dst, 0);
+
+    if (syntax_is_numeric(second)) {
+        /* D1 /n for 1, C1 /n ib otherwise */
+        const uint64_t count = strtoull(second, NULL, 0);
+        const uint8_t opcode[] = {sized_opcode(count == 1 ? 0xD1 : 0xC1, size)};
+        emit_rm_instruction(ctx, size, opcode, sizeof(opcode), ext, 0, &dst, count == 1 ? 0 : 1);
+        if (count != 1)
+            encode_byte(ctx->codeBuf, (uint8_t)(count & 0x3f));
+        return;
+    }
+
+    /* D3 /n: the count can only come from cl */
+    uint8_t countSize;
+    if (syntax_get_sized_register_code(second, &countSize) != 1
+        || (countSize != 1 && countSize != 8)) {
+        color_error("shift count must be an immediate or rcx");
+        fail();
+    }
+    const uint8_t opcode[] = {sized_opcode(0xD3, size)};
+    emit_rm_instruction(ctx, size, opcode, sizeof(opcode), ext, 0, &dst, 0);
+}
+
+/* Emit test with a register or memory operand and a register or immediate:
+   85 /r, or F7 /0 (A9 for the accumulator) */
+static void emit_test(EmitContext *ctx, const char *first, const char *second)
+{
+    CodeBuffer *codeBuf = ctx->codeBuf;
+    const char *other = second;
+
+    /* test is commutative: keep the memory operand, if any, in `first` */
+    if (syntax_is_memory_reference(second)) {
+        other = first;
+        first = second;
+    }
+    RmOperand dst;
+    expect_rm_operand(first, &dst);
+
+    if (syntax_is_numeric(other)) {
+        const uint8_t size = operand_size(&dst, 0);
+        const int64_t imm = immediate_value(other, size);
+        const size_t immSize = immediate_size(size);
+        if (!dst.inMemory && dst.reg == 0) {
+            /* test al/ax/eax/rax, imm */
+            if (size == 2)
+                encode_byte(codeBuf, 0x66);
+            encode_rex(codeBuf, size == 8, 0, 0, 0);
+            encode_byte(codeBuf, sized_opcode(0xA9, size));
+        } else {
+            const uint8_t opcode[] = {sized_opcode(0xF7, size)};
+            emit_rm_instruction(ctx, size, opcode, sizeof(opcode), 0, 0, &dst, immSize);
+        }
+        encode_imm(codeBuf, (uint64_t)imm, immSize);
+        return;
+    }
+
+    RmOperand src;
+    expect_rm_operand(other, &src);
+    if (src.inMemory) {
+        color_error("at most one operand can be in memory");
+        fail();
+    }
+    const uint8_t size = operand_size(&dst, src.size);
+    const uint8_t opcode[] = {sized_opcode(0x85, size)}; /* test r/m, r */
+    emit_rm_instruction(ctx, size, opcode, sizeof(opcode), src.reg, size, &dst, 0);
+}
+
+/* Emit movzx or movsx: widen an 8- or 16-bit operand into a register
+   (0F B6/B7, 0F BE/BF), or a 32-bit one with movsxd (63 /r) */
+static void emit_extend(EmitContext *ctx, int signExtend, const char *dest, const char *src)
+{
+    uint8_t size;
+    const uint8_t reg = expect_register(dest, &size);
+    RmOperand rm;
+    expect_rm_operand(src, &rm);
+
+    if (rm.size == 0) {
+        color_error("the size of '%s' is needed, such as byte %s", src, src);
+        fail();
+    }
+    if (rm.size >= size) {
+        color_error("cannot extend %u bits to %u bits", rm.size * 8, size * 8);
+        fail();
+    }
+    if (rm.size == 4) {
+        if (!signExtend) {
+            color_error("use mov with a 32-bit destination, which zero-extends");
+            fail();
+        }
+        const uint8_t opcode[] = {0x63};
+        emit_rm_instruction(ctx, size, opcode, sizeof(opcode), reg, size, &rm, 0);
+        return;
+    }
+    const uint8_t opcode[] = {0x0F, (signExtend ? 0xBE : 0xB6) | (rm.size == 2)};
+    emit_rm_instruction(ctx, size, opcode, sizeof(opcode), reg, size, &rm, 0);
+}
+
+/* Size in bytes of the xmm or ymm register `text`, or exit with an error */
+static uint8_t vector_register_size(const char *text)
+{
+    uint8_t size;
+    if (syntax_get_vector_register_code(text, &size) == 0xFF) {
+        color_error("expected an xmm or ymm register, not '%s'", text);
+        fail();
+    }
+    return size;
+}
+
+/* Emit popcnt, lzcnt, tzcnt, bsf or bsr: reg, r/m of 16, 32 or 64 bits */
+static void emit_bit_count(EmitContext *ctx,
+                           InstructionType instrType,
+                           const char *dest,
+                           const char *src)
+{
+    static const uint8_t opcodes[][3] = {
+        [INSTR_POPCNT] = {0xF3, 0x0F, 0xB8},
+        [INSTR_LZCNT] = {0xF3, 0x0F, 0xBD},
+        [INSTR_TZCNT] = {0xF3, 0x0F, 0xBC},
+        [INSTR_BSF] = {0x0F, 0xBC},
+        [INSTR_BSR] = {0x0F, 0xBD},
+    };
+    const uint8_t *opcode = opcodes[instrType];
+    const size_t opcodeLen = opcode[0] == 0xF3 ? 3 : 2;
+
+    uint8_t regSize;
+    const uint8_t reg = expect_register(dest, &regSize);
+    RmOperand rm;
+    expect_rm_operand(src, &rm);
+    const uint8_t size = operand_size(&rm, regSize);
+    if (size == 1) {
+        color_error("%s has no 8-bit form", syntax_instruction_to_string(instrType));
+        fail();
+    }
+    emit_rm_instruction(ctx, size, opcode, opcodeLen, reg, size, &rm, 0);
+}
+
+/* Emit movbe reg, [mem] (0F 38 F0) or movbe [mem], reg (0F 38 F1), a load
+   or store that reverses the byte order */
+static void emit_movbe(EmitContext *ctx, const char *first, const char *second)
+{
+    const int store = syntax_is_memory_reference(first);
+    uint8_t regSize;
+    const uint8_t reg = expect_register(store ? second : first, &regSize);
+    RmOperand rm;
+    expect_rm_operand(store ? first : second, &rm);
+    if (!rm.inMemory) {
+        color_error("movbe moves between a register and memory, use bswap on registers");
+        fail();
+    }
+    const uint8_t size = operand_size(&rm, regSize);
+    if (size == 1) {
+        color_error("movbe has no 8-bit form");
+        fail();
+    }
+    const uint8_t opcode[] = {0x0F, 0x38, store ? 0xF1 : 0xF0};
+    emit_rm_instruction(ctx, size, opcode, sizeof(opcode), reg, size, &rm, 0);
+}
+
+/* Emit xchg, xadd or cmpxchg: r/m, reg with the register in the reg field.
+   xchg also takes its operands the other way around. */
+static void emit_exchange(EmitContext *ctx,
+                          InstructionType instrType,
+                          const char *first,
+                          const char *second)
+{
+    if (instrType == INSTR_XCHG && !syntax_is_memory_reference(first)
+        && syntax_is_memory_reference(second)) {
+        const char *tmp = first;
+        first = second;
+        second = tmp;
+    }
+
+    RmOperand rm;
+    expect_rm_operand(first, &rm);
+    uint8_t regSize;
+    const uint8_t reg = expect_register(second, &regSize);
+    const uint8_t size = operand_size(&rm, regSize);
+
+    /* xchg: 87 /r; xadd: 0F C1 /r; cmpxchg: 0F B1 /r, byte forms one below */
+    if (instrType == INSTR_XCHG) {
+        const uint8_t opcode[] = {sized_opcode(0x87, size)};
+        emit_rm_instruction(ctx, size, opcode, sizeof(opcode), reg, size, &rm, 0);
+        return;
+    }
+    const uint8_t opcode[] = {0x0F, sized_opcode(instrType == INSTR_XADD ? 0xC1 : 0xB1, size)};
+    emit_rm_instruction(ctx, size, opcode, sizeof(opcode), reg, size, &rm, 0);
+}
+
+/* Emit sub rsp, <bytes> (ext 5) or add rsp, <bytes> (ext 0) for a proc
+   frame: REX.W 83 /ext ib, or REX.W 81 /ext id */
+static void emit_stack_adjust(EmitContext *ctx, uint8_t ext, size_t bytes)
+{
+    const RmOperand rsp = {.inMemory = 0, .reg = 4, .size = 8};
+    const size_t immSize = bytes <= INT8_MAX ? 1 : 4;
+    const uint8_t opcode[] = {immSize == 1 ? 0x83 : 0x81};
+    emit_rm_instruction(ctx, 8, opcode, sizeof(opcode), ext, 0, &rsp, immSize);
+    encode_imm(ctx->codeBuf, bytes, immSize);
+}
+
+/* Emit push or pop of a 64- or 16-bit register or memory operand, or
+   push of an immediate */
+static void emit_push_pop(EmitContext *ctx, InstructionType instrType, const char *operand)
+{
+    CodeBuffer *codeBuf = ctx->codeBuf;
+    const int push = instrType == INSTR_PUSH;
+
+    if (push && syntax_is_numeric(operand)) {
+        /* push imm8: 6A ib, push imm32: 68 id, sign-extended to 64 bits */
+        const int64_t imm = immediate_value(operand, 8);
+        const size_t immSize = imm >= INT8_MIN && imm <= INT8_MAX ? 1 : 4;
+        encode_byte(codeBuf, immSize == 1 ? 0x6A : 0x68);
+        encode_imm(codeBuf, (uint64_t)imm, immSize);
+        return;
+    }
+
+    RmOperand rm;
+    expect_rm_operand(operand, &rm);
+    const uint8_t size = operand_size(&rm, 0);
+    if (size != 8 && size != 2) {
+        color_error("%s takes a 64- or 16-bit operand, not '%s'", push ? "push" : "pop", operand);
+        fail();
+    }
+
+    /* The stack operand size is 64 bits without REX.W */
+    if (!rm.inMemory) {
+        /* push r: 50+r, pop r: 58+r */
+        if (size == 2)
+            encode_byte(codeBuf, 0x66);
+        encode_rex(codeBuf, 0, 0, 0, rm.reg);
+        encode_byte(codeBuf, (push ? 0x50 : 0x58) | (rm.reg & 7));
+        return;
+    }
+    /* push r/m: FF /6, pop r/m: 8F /0 */
+    const uint8_t opcode[] = {push ? 0xFF : 0x8F};
+    emit_rm_instruction(ctx, size == 2 ? 2 : 4, opcode, sizeof(opcode), push ? 6 : 0, 0, &rm, 0);
+}
+
+/* Emit a prefetch or cache-line flush of the line holding a memory operand */
+static void emit_cache_hint(EmitContext *ctx, InstructionType instrType, const char *operand)
+{
+    /* prefetcht0-2: 0F 18 /1-/3, prefetchnta: 0F 18 /0, prefetchw: 0F 0D /1,
+       clflush: 0F AE /7, clflushopt: 66 0F AE /7, clwb: 66 0F AE /6 */
+    static const struct {
+        uint8_t prefix;
+        uint8_t opcode;
+        uint8_t ext;
+    } hints[] = {
+        [INSTR_PREFETCHT0] = {0x00, 0x18, 1},
+        [INSTR_PREFETCHT1] = {0x00, 0x18, 2},
+        [INSTR_PREFETCHT2] = {0x00, 0x18, 3},
+        [INSTR_PREFETCHNTA] = {0x00, 0x18, 0},
+        [INSTR_PREFETCHW] = {0x00, 0x0D, 1},
+        [INSTR_CLFLUSH] = {0x00, 0xAE, 7},
+        [INSTR_CLFLUSHOPT] = {0x66, 0xAE, 7},
+        [INSTR_CLWB] = {0x66, 0xAE, 6},
+    };
+
+    RmOperand rm;
+    expect_rm_operand(operand, &rm);
+    if (!rm.inMemory) {
+        color_error("%s needs a memory operand", syntax_instruction_to_string(instrType));
+        fail();
+    }
+    if (hints[instrType].prefix)
+        encode_byte(ctx->codeBuf, hints[instrType].prefix);
+    const uint8_t opcode[] = {0x0F, hints[instrType].opcode};
+    emit_rm_instruction(ctx, 4, opcode, sizeof(opcode), hints[instrType].ext, 0, &rm, 0);
+}
+
+/* Check whether the instruction after a lock prefix may take it: a
+   read-modify-write of its first operand, which must be in memory. xchg
+   swaps its operands, so its memory operand may also come second. */
+static int is_lockable(char *instruction)
+{
+    const InstructionType instrType = syntax_get_instruction_type(instruction);
+    switch (instrType) {
+        case INSTR_ADD:
+        case INSTR_SUB:
+        case INSTR_AND:
+        case INSTR_OR:
+        case INSTR_XOR:
+        case INSTR_NOT:
+        case INSTR_NEG:
+        case INSTR_INC:
+        case INSTR_DEC:
+        case INSTR_XCHG:
+        case INSTR_XADD:
+        case INSTR_CMPXCHG:
+        case INSTR_CMPXCHG8B:
+        case INSTR_CMPXCHG16B:
+            break;
+        default:
+            return 0;
+    }
+
+    char *p = instruction;
+    while (*p && !isspace((unsigned char)*p))
+        p++;
+    char *operands[3];
+    const int count = syntax_split_operands(p, operands, 3);
+    if (count > 0 && syntax_is_memory_reference(operands[0]))
+        return 1;
+    return instrType == INSTR_XCHG && count > 1 && syntax_is_memory_reference(operands[1]);
+}
+
+/* Exit unless the line may use `feature`: the --march target has it, or
+   an enclosing ifcpu checks for it */
+static void require_cpu_feature(EmitContext *ctx, const char *name, uint32_t feature)
+{
+    const Module *m = ctx->module;
+    if ((m->lineFeatures[ctx->line_number - 1] & feature) == feature)
+        return;
+    error_report(ctx->filename,
+                 ctx->line_number,
+                 0,
+                 ctx->line_content,
+                 ERROR_SEVERITY_FATAL,
+                 "'%s' needs %s, which %s does not have; use ifcpu",
+                 name,
+                 syntax_cpu_feature_to_string(feature & ~m->lineFeatures[ctx->line_number - 1]),
+                 m->march);
+    fail();
+}
 
-            /* Check if offset fits in 32 bits */
-            if (rel_addr < INT32_MIN || rel_addr > INT32_MAX) {
-                color_error("jump target too far");
-                exit(1);
+/* Parse a 32- or 64-bit register for a BMI instruction, or exit. Returns
+   its code. */
+static uint8_t expect_bmi_register(const char *text, const char *name, uint8_t *size)
+{
+    const uint8_t reg = expect_register(text, size);
+    if (*size != 4 && *size != 8) {
+        color_error("%s works on 32- and 64-bit registers", name);
+        fail();
+    }
+    return reg;
+}
+
+/* Emit a VEX-encoded BMI1/BMI2 instruction. All registers and the memory
+   operand have the same size, which selects VEX.W. */
+static void emit_bmi(EmitContext *ctx, const SyntaxBmiInstruction *bi, char *trimmed)
+{
+    require_cpu_feature(ctx, bi->name, bi->feature);
+    char *operands[3];
+    split_operands(trimmed, operands, bi->form == BMI_VM ? 2 : 3);
+
+    uint8_t size;
+    const uint8_t dest = expect_bmi_register(operands[0], bi->name, &size);
+    uint8_t reg = dest;
+    uint8_t vvvv = 0;
+    uint8_t otherSize = size;
+    RmOperand rm;
+    switch (bi->form) {
+        case BMI_RVM:
+            vvvv = expect_bmi_register(operands[1], bi->name, &otherSize);
+            expect_rm_operand(operands[2], &rm);
+            break;
+        case BMI_RMV:
+            expect_rm_operand(operands[1], &rm);
+            vvvv = expect_bmi_register(operands[2], bi->name, &otherSize);
+            break;
+        case BMI_VM:
+            reg = bi->ext;
+            vvvv = dest;
+            expect_rm_operand(operands[1], &rm);
+            break;
+        case BMI_RM_IMM:
+            expect_rm_operand(operands[1], &rm);
+            break;
+    }
+    if (otherSize != size) {
+        color_error("operand size mismatch: %u and %u bits", size * 8, otherSize * 8);
+        fail();
+    }
+    operand_size(&rm, size);
+
+    const size_t tail = bi->form == BMI_RM_IMM ? 1 : 0;
+    const uint8_t index = rm.inMemory && rm.mem.index != 0xFF ? rm.mem.index : 0;
+    const uint8_t base = !rm.inMemory ? rm.reg : rm.mem.base != 0xFF ? rm.mem.base : 0;
+    encode_vex(ctx->codeBuf, bi->prefix, bi->map, size == 8, 0, reg, vvvv, index, base);
+    encode_byte(ctx->codeBuf, bi->opcode);
+    emit_rm_operand(ctx, reg, &rm, tail);
+    if (tail)
+        encode_byte(ctx->codeBuf, expect_imm8(operands[2]));
+}
+
+/* Parse an xmm or ymm register of `size` bytes, or exit with an error.
+   Returns its code. */
+static uint8_t expect_vector_register(const char *text, uint8_t size)
+{
+    uint8_t actual;
+    uint8_t reg = syntax_get_vector_register_code(text, &actual);
+    if (reg == 0xFF || actual != size) {
+        color_error("expected %s register, not '%s'", size == 32 ? "a ymm" : "an xmm", text);
+        fail();
+    }
+    return reg;
+}
+
+/* Parse an xmm or ymm register of `size` bytes or a memory operand, or
+   exit with an error */
+static void expect_vector_operand(const char *text, RmOperand *rm, uint8_t size)
+{
+    if (syntax_is_memory_reference(text)) {
+        parse_memory_operand(text, &rm->mem);
+        rm->inMemory = 1;
+        rm->size = rm->mem.size;
+        return;
+    }
+    rm->inMemory = 0;
+    rm->reg = expect_vector_register(text, size);
+    rm->size = size;
+}
+
+/* Opcode and encoding of one vector instruction */
+typedef struct {
+    uint8_t prefix; /* Mandatory prefix: 0, 0x66, 0xF2 or 0xF3 */
+    uint8_t map;    /* Opcode map: 1 for 0F, 2 for 0F 38, 3 for 0F 3A */
+    uint8_t opcode;
+    int w;   /* REX.W or VEX.W */
+    int vex; /* VEX-encoded (AVX) rather than SSE */
+    int l;   /* VEX.L: 256-bit vectors */
+} VectorOpcode;
+
+/* Append the prefixes, opcode and ModR/M [SIB] [disp] of a vector
+   instruction: [prefix] [REX] 0F [38/3A] opcode for SSE, where the
+   mandatory prefix has to come before REX, or VEX opcode for AVX. `vvvv`
+   is the extra source register of the VEX form, 0 for none. */
+static void emit_vector_instruction(EmitContext *ctx,
+                                    const VectorOpcode *op,
+                                    uint8_t reg,
+                                    uint8_t vvvv,
+                                    const RmOperand *rm,
+                                    size_t tail)
+{
+    CodeBuffer *codeBuf = ctx->codeBuf;
+    const uint8_t index = rm->inMemory && rm->mem.index != 0xFF ? rm->mem.index : 0;
+    const uint8_t base = !rm->inMemory ? rm->reg : rm->mem.base != 0xFF ? rm->mem.base : 0;
+
+    if (op->vex) {
+        encode_vex(codeBuf, op->prefix, op->map, op->w, op->l, reg, vvvv, index, base);
+    } else {
+        if (op->prefix)
+            encode_byte(codeBuf, op->prefix);
+        encode_rex(codeBuf, op->w, reg, index, base);
+        encode_byte(codeBuf, 0x0F);
+        if (op->map == 2)
+            encode_byte(codeBuf, 0x38);
+        else if (op->map == 3)
+            encode_byte(codeBuf, 0x3A);
+    }
+    encode_byte(codeBuf, op->opcode);
+    emit_rm_operand(ctx, reg, rm, tail);
+}
+
+/* Emit a gather: dest, [base + vindex*scale], mask. The number of
+   elements in the destination, the index and the mask must agree, and the
+   three registers must differ. */
+static void emit_gather(EmitContext *ctx,
+                        const SyntaxVectorInstruction *vi,
+                        const char *name,
+                        VectorOpcode *op,
+                        char **operands)
+{
+    RmOperand rm;
+    const uint8_t size = vector_register_size(operands[0]);
+    const uint8_t reg = expect_vector_register(operands[0], size);
+    const uint8_t mask = expect_vector_register(operands[2], size);
+    if (!syntax_parse_memory_operand(operands[1], &rm.mem) || rm.mem.indexSize == 0) {
+        color_error("%s needs a memory operand with an xmm or ymm index, not '%s'",
+                    name,
+                    operands[1]);
+        fail();
+    }
+    rm.inMemory = 1;
+
+    const unsigned elementSize = vi->w ? 8 : 4;
+    const unsigned indexElementSize = vi->opcode & 1 ? 8 : 4;
+    if (size / elementSize != rm.mem.indexSize / indexElementSize) {
+        color_error("%s: %s does not match the index register", name, operands[0]);
+        fail();
+    }
+    if (reg == mask || reg == rm.mem.index || mask == rm.mem.index) {
+        color_error("%s needs different destination, index and mask registers", name);
+        fail();
+    }
+    op->l = size == 32 || rm.mem.indexSize == 32;
+    emit_vector_instruction(ctx, op, reg, mask, &rm, 0);
+}
+
+/* Emit a vector instruction of the given form, as SSE or as its VEX-encoded
+   AVX form. The AVX forms of VECTOR_RM(_IMM) and VECTOR_SHIFT_IMM take a
+   separate destination. */
+static void emit_vector(EmitContext *ctx,
+                        const SyntaxVectorInstruction *vi,
+                        int vex,
+                        char *trimmed)
+{
+    static const size_t operandCounts[] = {
+        [VECTOR_RM] = 2,
+        [VECTOR_RM_IMM] = 3,
+        [VECTOR_UNARY] = 2,
+        [VECTOR_UNARY_IMM] = 3,
+        [VECTOR_MOVE] = 2,
+        [VECTOR_STORE] = 2,
+        [VECTOR_LOAD] = 2,
+        [VECTOR_MOVE_SCALAR] = 2,
+        [VECTOR_SHIFT_IMM] = 2,
+        [VECTOR_MASK] = 2,
+        [VECTOR_MOVE_GPR] = 2,
+        [VECTOR_CVT_TO_GPR] = 2,
+        [VECTOR_CVT_FROM_GPR] = 2,
+        [VECTOR_WIDEN] = 2,
+        [VECTOR_INSERT] = 4,
+        [VECTOR_EXTRACT] = 3,
+        [VECTOR_GATHER] = 3,
+        [VECTOR_NONE] = 0,
+    };
+    /* The mnemonic as written, for messages */
+    char name[32];
+    snprintf(name, sizeof(name), "%s%s", vex && vi->name[0] != 'v' ? "v" : "", vi->name);
+
+    char *operands[4];
+    size_t expected = operandCounts[vi->form];
+    if (vex && (vi->form == VECTOR_RM || vi->form == VECTOR_RM_IMM
+                || vi->form == VECTOR_SHIFT_IMM || vi->form == VECTOR_CVT_FROM_GPR))
+        expected++;
+    size_t count = expected;
+    if (vex && vi->form == VECTOR_MOVE_SCALAR)
+        count = split_operand_range(trimmed, operands, 2, 3);
+    else if (expected > 0)
+        split_operands(trimmed, operands, expected);
+
+    /* The operand that gives the vector length: the destination, except for
+       stores, masks, extracts and gathers */
+    const int isStore =
+        (vi->form == VECTOR_MOVE || vi->form == VECTOR_MOVE_SCALAR)
+        && syntax_is_memory_reference(operands[0]);
+    const char *sizeOperand = expected > 0 ? operands[0] : NULL;
+    if (isStore || vi->form == VECTOR_STORE || vi->form == VECTOR_MASK
+        || vi->form == VECTOR_EXTRACT)
+        sizeOperand = operands[1];
+    uint8_t size = 16;
+    if (vi->form == VECTOR_NONE)
+        size = vi->width ? vi->width : 16;
+    else if (vex && vi->form != VECTOR_MOVE_GPR && vi->form != VECTOR_GATHER
+             && vi->form != VECTOR_CVT_TO_GPR)
+        size = vector_register_size(sizeOperand);
+    if (vi->width && size != vi->width) {
+        color_error("%s needs %s registers", name, vi->width == 32 ? "ymm" : "xmm");
+        fail();
+    }
+
+    /* The VEX form of an SSE instruction is AVX, and AVX2 when it works on
+       integers in ymm registers */
+    uint32_t feature = vi->feature;
+    if (vex && !(feature & (CPU_AVX | CPU_AVX2 | CPU_FMA))) {
+        const int integer = (vi->name[0] == 'p' && strcmp(vi->name, "ptest") != 0)
+                            || strcmp(vi->name, "movntdqa") == 0;
+        feature = size == 32 && integer ? CPU_AVX2 : CPU_AVX;
+    }
+    require_cpu_feature(ctx, name, feature);
+
+    VectorOpcode op = {vi->prefix, vi->map, vi->opcode, vi->w, vex, size == 32};
+    RmOperand rm;
+    switch (vi->form) {
+        case VECTOR_RM:
+        case VECTOR_RM_IMM: {
+            /* xmm, [xmm,] xmm/m [, imm8] */
+            const uint8_t reg = expect_vector_register(operands[0], size);
+            const uint8_t vvvv = vex ? expect_vector_register(operands[1], size) : 0;
+            expect_vector_operand(operands[1 + vex], &rm, size);
+            const size_t tail = vi->form == VECTOR_RM_IMM ? 1 : 0;
+            emit_vector_instruction(ctx, &op, reg, vvvv, &rm, tail);
+            if (tail)
+                encode_byte(ctx->codeBuf, expect_imm8(operands[2 + vex]));
+            break;
+        }
+        case VECTOR_UNARY:
+        case VECTOR_UNARY_IMM: {
+            /* xmm, xmm/m [, imm8] */
+            const uint8_t reg = expect_vector_register(operands[0], size);
+            expect_vector_operand(operands[1], &rm, size);
+            const size_t tail = vi->form == VECTOR_UNARY_IMM ? 1 : 0;
+            emit_vector_instruction(ctx, &op, reg, 0, &rm, tail);
+            if (tail)
+                encode_byte(ctx->codeBuf, expect_imm8(operands[2]));
+            break;
+        }
+        case VECTOR_MOVE: {
+            /* Load with the opcode, store with the one in ext */
+            if (syntax_is_memory_reference(operands[0])) {
+                expect_vector_operand(operands[0], &rm, size);
+                const uint8_t reg = expect_vector_register(operands[1], size);
+                op.opcode = vi->ext;
+                emit_vector_instruction(ctx, &op, reg, 0, &rm, 0);
+            } else {
+                const uint8_t reg = expect_vector_register(operands[0], size);
+                expect_vector_operand(operands[1], &rm, size);
+                emit_vector_instruction(ctx, &op, reg, 0, &rm, 0);
+            }
+            break;
+        }
+        case VECTOR_STORE:
+        case VECTOR_LOAD: {
+            /* m, xmm or xmm, m: non-temporal moves have no register form */
+            const int store = vi->form == VECTOR_STORE;
+            expect_vector_operand(operands[!store], &rm, size);
+            if (!rm.inMemory) {
+                color_error("%s needs a memory operand, not '%s'", name, operands[!store]);
+                fail();
+            }
+            const uint8_t reg = expect_vector_register(operands[store], size);
+            emit_vector_instruction(ctx, &op, reg, 0, &rm, 0);
+            break;
+        }
+        case VECTOR_MOVE_SCALAR: {
+            /* Like VECTOR_MOVE. The AVX form between registers takes the
+               upper elements from a second source: xmm, xmm, xmm. */
+            if (count == 3) {
+                const uint8_t reg = expect_vector_register(operands[0], size);
+                const uint8_t vvvv = expect_vector_register(operands[1], size);
+                rm.inMemory = 0;
+                rm.reg = expect_vector_register(operands[2], size);
+                emit_vector_instruction(ctx, &op, reg, vvvv, &rm, 0);
+                break;
+            }
+            if (vex && !isStore && !syntax_is_memory_reference(operands[1])) {
+                color_error("%s between registers takes three operands", name);
+                fail();
+            }
+            const uint8_t reg = expect_vector_register(operands[isStore], size);
+            expect_vector_operand(operands[!isStore], &rm, size);
+            if (isStore)
+                op.opcode = vi->ext;
+            emit_vector_instruction(ctx, &op, reg, 0, &rm, 0);
+            break;
+        }
+        case VECTOR_SHIFT_IMM: {
+            /* xmm, [xmm,] imm8 with the extension in the reg field. The AVX
+               form has the destination in vvvv. */
+            const uint8_t vvvv = vex ? expect_vector_register(operands[0], size) : 0;
+            rm.inMemory = 0;
+            rm.reg = expect_vector_register(operands[vex], size);
+            emit_vector_instruction(ctx, &op, vi->ext, vvvv, &rm, 1);
+            encode_byte(ctx->codeBuf, expect_imm8(operands[1 + vex]));
+            break;
+        }
+        case VECTOR_MASK: {
+            /* r32, xmm: the destination is the reg field */
+            uint8_t regSize;
+            const uint8_t reg = expect_register(operands[0], &regSize);
+            if (regSize != 4 && regSize != 8) {
+                color_error("%s writes a 32- or 64-bit register", name);
+                fail();
+            }
+            rm.inMemory = 0;
+            rm.reg = expect_vector_register(operands[1], size);
+            emit_vector_instruction(ctx, &op, reg, 0, &rm, 0);
+            break;
+        }
+        case VECTOR_MOVE_GPR: {
+            /* movd/movq xmm, r/m32/64 and r/m32/64, xmm. movq between xmm
+               registers, or loading and storing their low half, has its
+               own encodings: F3 0F 7E and 66 0F D6. */
+            uint8_t otherSize;
+            const int toVector = syntax_get_vector_register_code(operands[0], &otherSize) != 0xFF;
+            const char *vector = operands[toVector ? 0 : 1];
+            const char *other = operands[toVector ? 1 : 0];
+            const uint8_t reg = expect_vector_register(vector, 16);
+            const uint8_t gprSize = vi->w ? 8 : 4;
+
+            if (syntax_get_vector_register_code(other, &otherSize) != 0xFF
+                || (vi->w && syntax_is_memory_reference(other))) {
+                if (!vi->w) {
+                    color_error("%s moves between xmm and 32-bit registers or memory", name);
+                    fail();
+                }
+                expect_vector_operand(other, &rm, 16);
+                const VectorOpcode move = toVector ? (VectorOpcode){0xF3, 1, 0x7E, 0, vex, 0}
+                                                   : (VectorOpcode){0x66, 1, 0xD6, 0, vex, 0};
+                emit_vector_instruction(ctx, &move, reg, 0, &rm, 0);
+                break;
             }
 
-            /* Emit conditional jump instruction based on type */
-            codeBuf->bytes[codeBuf->size++] = 0x0F;
+            expect_rm_operand(other, &rm);
+            if (rm.size != gprSize && !(rm.inMemory && rm.size == 0)) {
+                color_error("%s needs a %u-bit register or memory operand", name, gprSize * 8);
+                fail();
+            }
+            op.opcode = toVector ? vi->opcode : vi->ext;
+            emit_vector_instruction(ctx, &op, reg, 0, &rm, 0);
+            break;
+        }
+        case VECTOR_CVT_TO_GPR: {
+            /* r32/64, xmm/m: the integer size selects W */
+            uint8_t regSize;
+            const uint8_t reg = expect_register(operands[0], &regSize);
+            if (regSize != 4 && regSize != 8) {
+                color_error("%s converts to a 32- or 64-bit register", name);
+                fail();
+            }
+            expect_vector_operand(operands[1], &rm, 16);
+            op.w = regSize == 8;
+            emit_vector_instruction(ctx, &op, reg, 0, &rm, 0);
+            break;
+        }
+        case VECTOR_CVT_FROM_GPR: {
+            /* xmm, [xmm,] r/m32/64: the integer size selects W, memory
+               without a size qualifier is 64-bit */
+            const uint8_t reg = expect_vector_register(operands[0], 16);
+            const uint8_t vvvv = vex ? expect_vector_register(operands[1], 16) : 0;
+            expect_rm_operand(operands[1 + vex], &rm);
+            const uint8_t intSize = operand_size(&rm, 0);
+            if (intSize != 4 && intSize != 8) {
+                color_error("%s converts from a 32- or 64-bit integer", name);
+                fail();
+            }
+            op.w = intSize == 8;
+            emit_vector_instruction(ctx, &op, reg, vvvv, &rm, 0);
+            break;
+        }
+        case VECTOR_WIDEN: {
+            /* ymm, xmm/m: the source fits in an xmm register */
+            const uint8_t reg = expect_vector_register(operands[0], size);
+            expect_vector_operand(operands[1], &rm, 16);
+            emit_vector_instruction(ctx, &op, reg, 0, &rm, 0);
+            break;
+        }
+        case VECTOR_INSERT: {
+            /* ymm, ymm, xmm/m128, imm8 */
+            const uint8_t reg = expect_vector_register(operands[0], 32);
+            const uint8_t vvvv = expect_vector_register(operands[1], 32);
+            expect_vector_operand(operands[2], &rm, 16);
+            emit_vector_instruction(ctx, &op, reg, vvvv, &rm, 1);
+            encode_byte(ctx->codeBuf, expect_imm8(operands[3]));
+            break;
+        }
+        case VECTOR_EXTRACT: {
+            /* xmm/m128, ymm, imm8: the source is the reg field */
+            expect_vector_operand(operands[0], &rm, 16);
+            const uint8_t reg = expect_vector_register(operands[1], 32);
+            emit_vector_instruction(ctx, &op, reg, 0, &rm, 1);
+            encode_byte(ctx->codeBuf, expect_imm8(operands[2]));
+            break;
+        }
+        case VECTOR_GATHER:
+            emit_gather(ctx, vi, name, &op, operands);
+            break;
+        case VECTOR_NONE: {
+            /* Anything after the mnemonic would be an operand */
+            char *rest = trimmed + strlen(vi->name);
+            while (isspace((unsigned char)*rest))
+                rest++;
+            if (*rest != '\0' && *rest != syntax_comment_char) {
+                color_error("%s takes no operands", name);
+                fail();
+            }
+            encode_vex(ctx->codeBuf, op.prefix, op.map, op.w, op.l, 0, 0, 0, 0);
+            encode_byte(ctx->codeBuf, op.opcode);
+            break;
+        }
+    }
+}
+
+/* The runtime check at an ifcpu line. The first check reached calls
+   __jasm_cpu_init, below the red zone so that leaf code keeps the 128
+   bytes under rsp; then any missing feature jumps to the else branch.
+   Clobbers the flags. */
+static void emit_cpu_dispatch(EmitContext *ctx, const char *trimmed)
+{
+    CodeBuffer *codeBuf = ctx->codeBuf;
+    const size_t line = (size_t)ctx->line_number;
+    char text[MAX_LINE_LEN];
+
+    snprintf(text, sizeof(text), "cmp dword [__jasm_cpu + %d], 0", 4 * CPUID_WORDS);
+    emit_instruction_line_ctx(ctx, text);
+    ensure_code_buffer_capacity(codeBuf, 2);
+    const size_t skip = codeBuf->size;
+    encode_byte(codeBuf, 0x75); /* jne rel8 over the call */
+    encode_byte(codeBuf, 0);
+    emit_instruction_line_ctx(ctx, "lea rsp, [rsp - 128]");
+    emit_instruction_line_ctx(ctx, "call __jasm_cpu_init");
+    emit_instruction_line_ctx(ctx, "lea rsp, [rsp + 128]");
+    codeBuf->bytes[skip + 1] = (uint8_t)(codeBuf->size - skip - 2);
+
+    /* The words hold inverted CPUID bits: jne if any feature is missing */
+    uint32_t masks[CPUID_WORDS];
+    cpuid_masks(parse_ifcpu_directive(ctx->filename, line, trimmed), masks);
+    char label[IFCPU_LABEL_SIZE];
+    ifcpu_label(label, sizeof(label), "else", line);
+    for (int w = 0; w < CPUID_WORDS; w++) {
+        if (!masks[w])
+            continue;
+        if (w)
+            snprintf(text, sizeof(text), "test dword [__jasm_cpu + %d], 0x%x", 4 * w, masks[w]);
+        else
+            snprintf(text, sizeof(text), "test dword [__jasm_cpu], 0x%x", masks[w]);
+        emit_instruction_line_ctx(ctx, text);
+        ensure_code_buffer_capacity(codeBuf, 6);
+        encode_byte(codeBuf, 0x0F); /* jne rel32 */
+        encode_byte(codeBuf, 0x85);
+        emit_symbol_rel32(ctx, label, 0, 0, R_X86_64_PLT32);
+    }
+}
 
-            switch (instrType) {
-                case INSTR_JUMPLT:
-                    codeBuf->bytes[codeBuf->size++] = 0x8C; /* jl */
+/* Emit a string instruction such as "movsb" or "stosq", after an optional
+   rep prefix. `prefix` is 0, or F3 for rep/repe and F2 for repne. */
+static void emit_string_instruction(EmitContext *ctx, const char *text, uint8_t prefix)
+{
+    CodeBuffer *codeBuf = ctx->codeBuf;
+    uint8_t size;
+    const uint8_t opcode = syntax_get_string_opcode(text, &size);
+    if (opcode == 0) {
+        color_error("expected a string instruction, not '%s'", text);
+        fail();
+    }
+
+    /* Anything after the mnemonic would be an operand, of which they have none */
+    const char *p = text;
+    while (*p && !isspace((unsigned char)*p))
+        p++;
+    while (isspace((unsigned char)*p))
+        p++;
+    if (*p != '\0' && *p != syntax_comment_char) {
+        color_error("string instructions take no operands, rsi, rdi and rcx are implied");
+        fail();
+    }
+
+    if (prefix)
+        encode_byte(codeBuf, prefix);
+    if (size == 2)
+        encode_byte(codeBuf, 0x66);
+    encode_rex(codeBuf, size == 8, 0, 0, 0);
+    encode_byte(codeBuf, sized_opcode(opcode + 1, size));
+}
+
+static void emit_instruction_line_ctx(EmitContext *ctx, const char *line)
+{
+    CodeBuffer *codeBuf = ctx->codeBuf;
+    const char *filename = ctx->filename;
+    int line_number = ctx->line_number;
+    const char *line_content = ctx->line_content;
+    char buf[MAX_LINE_LEN];
+    strncpy(buf, line, MAX_LINE_LEN - 1);
+    buf[MAX_LINE_LEN - 1] = '\0';
+    char *trimmed = syntax_trim(buf);
+
+    if (is_directive_line(trimmed))
+        return; /* skip comments and directives */
+    if (syntax_is_label(trimmed))
+        return; /* skip label definitions */
+    if (syntax_is_proc_directive(trimmed)) {
+        /* Reserve the proc's frame */
+        const size_t frame = ctx->module->lineFrame[line_number - 1];
+        if (frame)
+            emit_stack_adjust(ctx, 5, frame);
+        return;
+    }
+    if (syntax_is_ifcpu_directive(trimmed)) {
+        /* Nothing to check when --march has the features */
+        if (ctx->module->lineBlock[line_number - 1])
+            emit_cpu_dispatch(ctx, trimmed);
+        return;
+    }
+    if (syntax_is_else_directive(trimmed)) {
+        /* The then branch ends with a jump over the else branch */
+        const size_t block = ctx->module->lineBlock[line_number - 1];
+        if (block) {
+            char label[IFCPU_LABEL_SIZE];
+            ifcpu_label(label, sizeof(label), "endif", block);
+            const uint8_t long_opcode[] = {0xE9};
+            emit_branch(ctx, label, 0xEB, long_opcode, sizeof(long_opcode));
+        }
+        return;
+    }
+
+    InstructionType instrType = syntax_get_instruction_type(trimmed);
+
+    /* Instructions outside the vector and BMI tables that need a CPU
+       feature */
+    static const uint32_t instructionFeatures[INSTR_UNKNOWN] = {
+        [INSTR_POPCNT] = CPU_POPCNT,
+        [INSTR_LZCNT] = CPU_LZCNT,
+        [INSTR_TZCNT] = CPU_BMI1,
+        [INSTR_MOVBE] = CPU_MOVBE,
+        [INSTR_CMPXCHG16B] = CPU_CX16,
+        [INSTR_RDRAND] = CPU_RDRAND,
+        [INSTR_RDTSCP] = CPU_RDTSCP,
+        [INSTR_CLFLUSHOPT] = CPU_CLFLUSHOPT,
+        [INSTR_CLWB] = CPU_CLWB,
+        [INSTR_PREFETCHW] = CPU_PREFETCHW,
+    };
+    if (instrType < INSTR_UNKNOWN && instructionFeatures[instrType]) {
+        char name[32];
+        sscanf(trimmed, "%31s", name);
+        require_cpu_feature(ctx, name, instructionFeatures[instrType]);
+    }
+
+    switch (instrType) {
+        case INSTR_MOVE: {
+            /* Format:
+               move <register>, <immediate>
+               move <register>, <register>
+               move <register>, [<memory>]  ; load from memory
+               move [<memory>], <register>  ; store to memory
+               move [<memory>], <immediate> ; store an immediate
+               move <register>, <symbol>    ; address of the symbol
+               Registers of any size may be used, memory operands can be
+               sized with byte, word, dword or qword (the default).
+            */
+            char *operands[2];
+            split_operands(trimmed, operands, 2);
+            const char *dest = operands[0];
+            const char *token = operands[1]; /* source */
+            uint8_t size;
+
+            if (syntax_is_memory_reference(dest)) {
+                RmOperand mem;
+                expect_rm_operand(dest, &mem);
+
+                if (syntax_is_numeric(token)) {
+                    /* Store immediate: C6 /0 ib, C7 /0 iw/id */
+                    size = operand_size(&mem, 0);
+                    const int64_t imm = immediate_value(token, size);
+                    const size_t immSize = immediate_size(size);
+                    const uint8_t opcode[] = {sized_opcode(0xC7, size)};
+                    emit_rm_instruction(ctx, size, opcode, sizeof(opcode), 0, 0, &mem, immSize);
+                    encode_imm(codeBuf, (uint64_t)imm, immSize);
                     break;
-                case INSTR_JUMPGT:
-                    codeBuf->bytes[codeBuf->size++] = 0x8F; /* jg */
+                }
+
+                /* Store to memory: mov r/m, r */
+                uint8_t regSize;
+                const uint8_t reg = expect_register(token, &regSize);
+                size = operand_size(&mem, regSize);
+                const uint8_t opcode[] = {sized_opcode(0x89, size)};
+                emit_rm_instruction(ctx, size, opcode, sizeof(opcode), reg, size, &mem, 0);
+            } else if (syntax_is_memory_reference(token)) {
+                /* Load from memory: mov r, r/m */
+                const uint8_t reg = expect_register(dest, &size);
+                RmOperand mem;
+                expect_rm_operand(token, &mem);
+                size = operand_size(&mem, size);
+                const uint8_t opcode[] = {sized_opcode(0x8B, size)};
+                emit_rm_instruction(ctx, size, opcode, sizeof(opcode), reg, size, &mem, 0);
+            } else if (syntax_is_numeric(token)) {
+                /* Move immediate to register */
+                uint64_t val = strtoull(token, NULL, 0);
+                const uint8_t reg = expect_register(dest, &size);
+
+                if (size < 8) {
+                    /* B0+r ib, B8+r iw/id */
+                    const int64_t imm = immediate_value(token, size);
+                    if (size == 2)
+                        encode_byte(codeBuf, 0x66);
+                    encode_rex_forced(codeBuf, size == 1 && reg >= 4, 0, 0, 0, reg);
+                    encode_byte(codeBuf, (size == 1 ? 0xB0 : 0xB8) + (reg & 7));
+                    encode_imm(codeBuf, (uint64_t)imm, size);
                     break;
-                case INSTR_JUMPEQ:
-                    codeBuf->bytes[codeBuf->size++] = 0x84; /* je */
+                }
+
+                /* Pick the shortest encoding for the value. mov leaves the
+                   flags alone, so 0 is not turned into xor r32, r32 */
+                if (val <= 0xffffffffULL) {
+                    /* mov r32, imm32 zero-extends to 64 bits */
+                    encode_rex(codeBuf, 0, 0, 0, reg);
+                    encode_byte(codeBuf, 0xB8 + (reg & 7));
+                    encode_imm(codeBuf, val, 4);
+                } else if ((int64_t)val < 0 && (int64_t)val >= INT32_MIN) {
+                    /* Negative values: mov r/m64, imm32 sign-extends */
+                    const uint8_t opcode[] = {0xC7};
+                    encode_reg_reg(codeBuf, 1, opcode, sizeof(opcode), 0, reg);
+                    encode_imm(codeBuf, val, 4);
+                } else {
+                    /* For large values, use movabs r64, imm64 */
+                    encode_rex(codeBuf, 1, 0, 0, reg);
+                    encode_byte(codeBuf, 0xB8 + (reg & 7));
+                    encode_imm(codeBuf, val, 8);
+                }
+            } else {
+                const uint8_t reg = expect_register(dest, &size);
+
+                RmOperand dst = {.reg = reg, .size = size};
+                uint8_t srcSize;
+                uint8_t src = syntax_get_sized_register_code(token, &srcSize);
+                if (src != 0xFF) {
+                    /* Register to register: mov r/m, r */
+                    size = operand_size(&dst, srcSize);
+                    const uint8_t opcode[] = {sized_opcode(0x89, size)};
+                    emit_rm_instruction(ctx, size, opcode, sizeof(opcode), src, size, &dst, 0);
                     break;
+                }
+                if (size != 8) {
+                    color_error("the address of '%s' needs a 64-bit register", token);
+                    fail();
+                }
+
+                /* Move symbol address to register, using lea */
+                encode_rex(codeBuf, 1, reg, 0, 0);
+                encode_byte(codeBuf, 0x8D);                    /* lea r64, m */
+                encode_byte(codeBuf, ((reg & 7) << 3) | 0x05); /* ModR/M: RIP-relative */
+                ensure_code_buffer_capacity(codeBuf, 4);
+                emit_symbol_rel32(ctx, token, 0, 0, R_X86_64_PC32);
+            }
+            break;
+        }
+
+        case INSTR_CALL: {
+            ensure_code_buffer_capacity(codeBuf, 6);  // Need up to 6 bytes
+
+            /* Without an operand, call is a syscall, as in older programs */
+            char *operands[1];
+            if (split_operand_range(trimmed, operands, 0, 1) == 0) {
+                /* syscall opcode */
+                codeBuf->bytes[codeBuf->size++] = 0x0F;
+                codeBuf->bytes[codeBuf->size++] = 0x05;
+                break;
+            }
+            const char *target = operands[0];
+
+            RmOperand rm;
+            if (parse_rm_operand(target, &rm)) {
+                /* call r/m64: FF /2, through a function pointer */
+                if (operand_size(&rm, 0) != 8) {
+                    color_error("call needs a 64-bit register or memory operand");
+                    fail();
+                }
+                const uint8_t opcode[] = {0xFF};
+                emit_rm_instruction(ctx, 4, opcode, sizeof(opcode), 2, 0, &rm, 0);
+                break;
+            }
+
+            const Symbol *sym = find_symbol(ctx->module, target);
+            if (sym && sym->external) {
+                /* call [rip + GOT slot] */
+                codeBuf->bytes[codeBuf->size++] = 0xFF;
+                codeBuf->bytes[codeBuf->size++] = 0x15; /* ModR/M: /2, RIP-relative */
+                emit_symbol_got32(ctx, sym);
+            } else {
+                /* call rel32 */
+                codeBuf->bytes[codeBuf->size++] = 0xE8;
+                emit_symbol_rel32(ctx, target, 0, 0, R_X86_64_PLT32);
+            }
+            break;
+        }
+
+        case INSTR_JUMPCC: {
+            /* Get the condition from the mnemonic and the label name */
+            uint8_t condition = syntax_get_condition_code(trimmed, "jmp");
+            if (condition == 0xFF)
+                condition = syntax_get_condition_code(trimmed, "j");
+            char *operands[1];
+            split_operands(trimmed, operands, 1);
+
+            /* Emit conditional jump instruction: 7x rel8, or 0F 8x rel32 */
+            const uint8_t long_opcode[] = {0x0F, 0x80 | condition};
+            emit_branch(ctx, operands[0], 0x70 | condition, long_opcode, sizeof(long_opcode));
+            break;
+        }
+
+        case INSTR_CMOVCC: {
+            /* Format: cmov<cc> <reg>, <reg/memory> */
+            const uint8_t condition = syntax_get_condition_code(trimmed, "cmov");
+            char *operands[2];
+            split_operands(trimmed, operands, 2);
+
+            uint8_t size;
+            const uint8_t reg = expect_register(operands[0], &size);
+            RmOperand src;
+            if (!parse_rm_operand(operands[1], &src)) {
+                color_error("cmov needs a register or memory source, not '%s'", operands[1]);
+                fail();
+            }
+            size = operand_size(&src, size);
+            if (size == 1) {
+                color_error("cmov has no 8-bit form");
+                fail();
+            }
+
+            /* cmovcc r, r/m */
+            const uint8_t opcode[] = {0x0F, 0x40 | condition};
+            emit_rm_instruction(ctx, size, opcode, sizeof(opcode), reg, size, &src, 0);
+            break;
+        }
+
+        case INSTR_SETCC: {
+            /* Format: set<cc> <reg8/memory> */
+            const uint8_t condition = syntax_get_condition_code(trimmed, "set");
+            char *operands[1];
+            split_operands(trimmed, operands, 1);
+
+            RmOperand dst;
+            if (!parse_rm_operand(operands[0], &dst) || (dst.size != 0 && dst.size != 1)) {
+                color_error("set needs an 8-bit register such as al, not '%s'", operands[0]);
+                fail();
             }
 
-            /* 32-bit relative offset */
-            for (int i = 0; i < 4; i++)
-                codeBuf->bytes[codeBuf->size++] = (uint8_t)((rel_addr >> (8 * i)) & 0xff);
+            /* setcc r/m8: 0F 9x /0 */
+            const uint8_t opcode[] = {0x0F, 0x90 | condition};
+            emit_rm_instruction(ctx, 1, opcode, sizeof(opcode), 0, 0, &dst, 0);
             break;
         }
 
         case INSTR_JUMP: {
-            ensure_code_buffer_capacity(codeBuf, 5);  // Need 5 bytes
+            ensure_code_buffer_capacity(codeBuf, 6);  // Need up to 6 bytes
 
-            /* Get label name */
-            char *label = strtok(trimmed + 4, " \t");
-            if (!label) {
+            /* Format: jmp <label>, jmp <reg64>, jmp [<memory>] */
+            char *operands[1];
+            if (split_operand_range(trimmed, operands, 0, 1) == 0) {
                 color_error("jump instruction requires a label");
-                exit(1);
+                fail();
+            }
+            char *label = operands[0];
+
+            RmOperand rm;
+            if (parse_rm_operand(label, &rm)) {
+                /* Indirect jump to the address in r/m64: FF /4, as in
+                   jmp [table + rax*8] over a jumptable */
+                if (operand_size(&rm, 0) != 8) {
+                    color_error("jmp needs a 64-bit register or memory operand");
+                    fail();
+                }
+                const uint8_t opcode[] = {0xFF};
+                emit_rm_instruction(ctx, 4, opcode, sizeof(opcode), 4, 0, &rm, 0);
+                break;
             }
-            label = syntax_trim(label);
-
-            /* Look up label address */
-            const uint64_t target = lookup_symbol(label, filename, line_number, line_content);
-
-            /* Calculate relative offset from next instruction */
-            const int64_t rel_addr = target - (BASE_ADDR + CODE_OFFSET + codeBuf->size + 5);
 
-            /* Check if offset fits in 32 bits */
-            if (rel_addr < INT32_MIN || rel_addr > INT32_MAX) {
-                color_error("jump target too far");
-                exit(1);
+            const Symbol *sym = find_symbol(ctx->module, label);
+            if (sym && sym->external) {
+                /* Tail call to an extern function: jmp [rip + GOT slot] */
+                codeBuf->bytes[codeBuf->size++] = 0xFF;
+                codeBuf->bytes[codeBuf->size++] = 0x25; /* ModR/M: /4, RIP-relative */
+                emit_symbol_got32(ctx, sym);
+                break;
             }
 
-            /* Emit jump instruction:
-               0xE9 <32-bit relative offset>
-            */
-            codeBuf->bytes[codeBuf->size++] = 0xE9;
-            for (int i = 0; i < 4; i++)
-                codeBuf->bytes[codeBuf->size++] = (uint8_t)((rel_addr >> (8 * i)) & 0xff);
+            /* Emit jump instruction: EB rel8, or E9 rel32 */
+            const uint8_t long_opcode[] = {0xE9};
+            emit_branch(ctx, label, 0xEB, long_opcode, sizeof(long_opcode));
             break;
         }
 
@@ -679,177 +2559,380 @@ static void emit_instruction_line_ctx(EmitContext *ctx, const char *line)
         case INSTR_OR:
         case INSTR_XOR:
         case INSTR_SHL:
-        case INSTR_SHR: {
-            /* Format: <instr> <reg>, <reg/immediate> */
-            char *token = strtok(trimmed, " ,\t");
-            if (!token) {
-                color_error("expected instruction");
-                exit(1);
+        case INSTR_SHR:
+        case INSTR_SAR:
+        case INSTR_ROL:
+        case INSTR_ROR:
+        case INSTR_RCL:
+        case INSTR_RCR: {
+            /* Format: <instr> <reg>, <reg/immediate/memory>
+                       <instr> [<memory>], <reg/immediate>
+                       imul <reg>, <reg/memory>, <immediate> */
+            char *operands[3];
+            const size_t count =
+                split_operand_range(trimmed, operands, 2, instrType == INSTR_MUL ? 3 : 2);
+            const char *first = operands[0];
+            const char *second = operands[1];
+
+            switch (instrType) {
+                case INSTR_MUL:
+                    if (count == 3)
+                        emit_imul_immediate(ctx, first, second, operands[2]);
+                    else if (syntax_is_numeric(second))
+                        emit_imul_immediate(ctx, first, first, second);
+                    else
+                        emit_imul(ctx, first, second);
+                    break;
+                case INSTR_DIV:
+                case INSTR_MOD:
+                    emit_divide(ctx, first, second);
+                    break;
+                case INSTR_SHL:
+                case INSTR_SHR:
+                case INSTR_SAR:
+                case INSTR_ROL:
+                case INSTR_ROR:
+                case INSTR_RCL:
+                case INSTR_RCR:
+                    emit_shift(ctx, (uint8_t)shift_extension(instrType), first, second);
+                    break;
+                default:
+                    emit_alu(ctx, (uint8_t)group1_extension(instrType), first, second);
+                    break;
             }
+            break;
+        }
+
+        case INSTR_NOT:
+        case INSTR_NEG:
+        case INSTR_INC:
+        case INSTR_DEC: {
+            /* Format: <instr> <reg/memory> */
+            char *operands[1];
+            split_operands(trimmed, operands, 1);
 
-            char *first = strtok(NULL, " ,\t"); /* first operand */
-            if (!first) {
-                color_error("expected first operand");
-                exit(1);
+            /* not, neg: F7 /2, F7 /3; inc, dec: FF /0, FF /1 */
+            uint8_t ext;
+            switch (instrType) {
+                case INSTR_NOT:
+                    ext = 2;
+                    break;
+                case INSTR_NEG:
+                    ext = 3;
+                    break;
+                case INSTR_INC:
+                    ext = 0;
+                    break;
+                default:
+                    ext = 1; /* dec */
+                    break;
             }
 
-            char *second = strtok(NULL, " ,\t"); /* second operand */
-            if (!second) {
-                color_error("expected second operand");
-                exit(1);
+            RmOperand dst;
+            expect_rm_operand(operands[0], &dst);
+            const uint8_t size = operand_size(&dst, 0);
+            const uint8_t opcode[] = {sized_opcode(ext >= 2 ? 0xF7 : 0xFF, size)};
+            emit_rm_instruction(ctx, size, opcode, sizeof(opcode), ext, 0, &dst, 0);
+            break;
+        }
+
+        case INSTR_LEA: {
+            /* Format: lea <reg>, [<memory>] */
+            char *operands[2];
+            split_operands(trimmed, operands, 2);
+
+            uint8_t size;
+            const uint8_t reg = expect_register(operands[0], &size);
+            if (size == 1) {
+                color_error("lea has no 8-bit form");
+                fail();
+            }
+            if (!syntax_is_memory_reference(operands[1])) {
+                color_error("lea needs a memory operand, not '%s'", operands[1]);
+                fail();
             }
+            RmOperand mem;
+            expect_rm_operand(operands[1], &mem);
+            const uint8_t opcode[] = {0x8D}; /* lea r, m */
+            emit_rm_instruction(ctx, size, opcode, sizeof(opcode), reg, size, &mem, 0);
+            break;
+        }
+
+        case INSTR_TEST: {
+            /* Format: test <reg/memory>, <reg/immediate> */
+            char *operands[2];
+            split_operands(trimmed, operands, 2);
+            emit_test(ctx, operands[0], operands[1]);
+            break;
+        }
+
+        case INSTR_MOVZX:
+        case INSTR_MOVSX: {
+            /* Format: movzx/movsx <reg>, <reg/memory>, the source being
+               smaller than the destination */
+            char *operands[2];
+            split_operands(trimmed, operands, 2);
+            emit_extend(ctx, instrType == INSTR_MOVSX, operands[0], operands[1]);
+            break;
+        }
+
+        case INSTR_POPCNT:
+        case INSTR_LZCNT:
+        case INSTR_TZCNT:
+        case INSTR_BSF:
+        case INSTR_BSR: {
+            /* Format: <instr> <reg>, <reg/memory> */
+            char *operands[2];
+            split_operands(trimmed, operands, 2);
+            emit_bit_count(ctx, instrType, operands[0], operands[1]);
+            break;
+        }
+
+        case INSTR_MOVBE: {
+            /* Format: movbe <reg>, <memory> or movbe <memory>, <reg> */
+            char *operands[2];
+            split_operands(trimmed, operands, 2);
+            emit_movbe(ctx, operands[0], operands[1]);
+            break;
+        }
 
-            uint8_t reg = syntax_get_register_code(first);
-            if (reg == 0xFF) {
-                color_error("unknown register '%s'", first);
-                exit(1);
+        case INSTR_BSWAP: {
+            /* Format: bswap <reg32/64>, encoded as 0F C8+r */
+            char *operands[1];
+            split_operands(trimmed, operands, 1);
+            uint8_t size;
+            const uint8_t reg = expect_register(operands[0], &size);
+            if (size != 4 && size != 8) {
+                color_error("bswap works on 32- and 64-bit registers, use rol for 16 bits");
+                fail();
             }
+            encode_rex(codeBuf, size == 8, 0, 0, reg);
+            encode_byte(codeBuf, 0x0F);
+            encode_byte(codeBuf, 0xC8 + (reg & 7));
+            break;
+        }
 
-            if (syntax_is_numeric(second)) {
-                ensure_code_buffer_capacity(codeBuf, 7);  // Need up to 7 bytes
-
-                uint64_t val = strtoull(second, NULL, 0);
-
-                codeBuf->bytes[codeBuf->size++] = 0x48; /* REX.W */
-                codeBuf->bytes[codeBuf->size++] = 0x81; /* op r/m64, imm32 */
-
-                /* Set the appropriate opcode based on instruction type */
-                switch (instrType) {
-                    case INSTR_COMP:
-                        codeBuf->bytes[codeBuf->size++] = 0xF8 | reg; /* cmp */
-                        break;
-                    case INSTR_ADD:
-                        codeBuf->bytes[codeBuf->size++] = 0xC0 | reg; /* add */
-                        break;
-                    case INSTR_SUB:
-                        codeBuf->bytes[codeBuf->size++] = 0xE8 | reg; /* sub */
-                        break;
-                    case INSTR_MUL:
-                        codeBuf->bytes[codeBuf->size++] = 0xE8 | reg; /* imul */
-                        break;
-                    case INSTR_DIV:
-                        codeBuf->bytes[codeBuf->size++] = 0xF8 | reg; /* idiv */
-                        break;
-                    case INSTR_MOD:
-                        codeBuf->bytes[codeBuf->size++] = 0xF8 | reg; /* idiv */
-                        break;
-                    case INSTR_AND:
-                        codeBuf->bytes[codeBuf->size++] = 0xE0 | reg; /* and */
-                        break;
-                    case INSTR_OR:
-                        codeBuf->bytes[codeBuf->size++] = 0xC8 | reg; /* or */
-                        break;
-                    case INSTR_XOR:
-                        codeBuf->bytes[codeBuf->size++] = 0xF0 | reg; /* xor */
-                        break;
-                    case INSTR_SHL:
-                        codeBuf->bytes[codeBuf->size++] = 0xE0 | reg; /* shl */
-                        break;
-                    case INSTR_SHR:
-                        codeBuf->bytes[codeBuf->size++] = 0xE8 | reg; /* shr */
-                        break;
-                    default:
-                        color_error("internal error: unknown instruction type");
-                        exit(1);
-                }
+        case INSTR_BMI:
+            emit_bmi(ctx, syntax_get_bmi_instruction(trimmed), trimmed);
+            break;
 
-                /* 32-bit immediate */
-                for (int i = 0; i < 4; i++)
-                    codeBuf->bytes[codeBuf->size++] = (uint8_t)((val >> (8 * i)) & 0xff);
-            } else {
-                ensure_code_buffer_capacity(codeBuf, 3);  // Need 3 bytes
+        case INSTR_VECTOR: {
+            bool vex;
+            const SyntaxVectorInstruction *vi = syntax_get_vector_instruction(trimmed, &vex);
+            emit_vector(ctx, vi, vex, trimmed);
+            break;
+        }
 
-                /* Register-register operation */
-                uint8_t reg2 = syntax_get_register_code(second);
-                if (reg2 == 0xFF) {
-                    color_error("unknown register '%s'", second);
-                    exit(1);
-                }
+        case INSTR_STRING: {
+            /* Format: movs/cmps/stos/lods/scas with a b/w/d/q size suffix */
+            emit_string_instruction(ctx, trimmed, 0);
+            break;
+        }
 
-                codeBuf->bytes[codeBuf->size++] = 0x48; /* REX.W */
-
-                /* Set the appropriate opcode based on instruction type */
-                switch (instrType) {
-                    case INSTR_COMP:
-                        codeBuf->bytes[codeBuf->size++] = 0x39; /* cmp r/m64, r64 */
-                        codeBuf->bytes[codeBuf->size++] = 0xC0 | (reg2 << 3) | reg; /* ModR/M */
-                        break;
-                    case INSTR_ADD:
-                        codeBuf->bytes[codeBuf->size++] = 0x01; /* add r/m64, r64 */
-                        codeBuf->bytes[codeBuf->size++] = 0xC0 | (reg2 << 3) | reg; /* ModR/M */
-                        break;
-                    case INSTR_SUB:
-                        codeBuf->bytes[codeBuf->size++] = 0x29; /* sub r/m64, r64 */
-                        codeBuf->bytes[codeBuf->size++] = 0xC0 | (reg2 << 3) | reg; /* ModR/M */
-                        break;
-                    case INSTR_MUL:
-                        codeBuf->bytes[codeBuf->size++] = 0x0F; /* imul r64, r/m64 */
-                        codeBuf->bytes[codeBuf->size++] = 0xAF; /* imul */
-                        codeBuf->bytes[codeBuf->size++] = 0xC0 | (reg << 3) | reg2; /* ModR/M */
-                        break;
-                    case INSTR_DIV:
-                        codeBuf->bytes[codeBuf->size++] = 0x48;        /* REX.W */
-                        codeBuf->bytes[codeBuf->size++] = 0xF7;        /* idiv r/m64 */
-                        codeBuf->bytes[codeBuf->size++] = 0xF8 | reg2; /* ModR/M */
-                        break;
-                    case INSTR_MOD:
-                        codeBuf->bytes[codeBuf->size++] = 0x48;        /* REX.W */
-                        codeBuf->bytes[codeBuf->size++] = 0xF7;        /* idiv r/m64 */
-                        codeBuf->bytes[codeBuf->size++] = 0xF8 | reg2; /* ModR/M */
-                        break;
-                    case INSTR_AND:
-                        codeBuf->bytes[codeBuf->size++] = 0x21; /* and r/m64, r64 */
-                        codeBuf->bytes[codeBuf->size++] = 0xC0 | (reg2 << 3) | reg; /* ModR/M */
-                        break;
-                    case INSTR_OR:
-                        codeBuf->bytes[codeBuf->size++] = 0x09; /* or r/m64, r64 */
-                        codeBuf->bytes[codeBuf->size++] = 0xC0 | (reg2 << 3) | reg; /* ModR/M */
-                        break;
-                    case INSTR_XOR:
-                        codeBuf->bytes[codeBuf->size++] = 0x31; /* xor r/m64, r64 */
-                        codeBuf->bytes[codeBuf->size++] = 0xC0 | (reg2 << 3) | reg; /* ModR/M */
-                        break;
-                    case INSTR_SHL:
-                        codeBuf->bytes[codeBuf->size++] = 0xD3;       /* shl r/m64, cl */
-                        codeBuf->bytes[codeBuf->size++] = 0xE0 | reg; /* ModR/M */
-                        break;
-                    case INSTR_SHR:
-                        codeBuf->bytes[codeBuf->size++] = 0xD3;       /* shr r/m64, cl */
-                        codeBuf->bytes[codeBuf->size++] = 0xE8 | reg; /* ModR/M */
-                        break;
-                    default:
-                        color_error("internal error: unknown instruction type");
-                        exit(1);
-                }
+        case INSTR_REP: {
+            /* Format: rep <movs/stos/lods>, repe/repz or repne/repnz <cmps/scas>.
+               rep and repe are the same F3 prefix, repne is F2. */
+            char *p = trimmed;
+            while (*p && !isspace((unsigned char)*p))
+                p++;
+            const size_t prefixLen = (size_t)(p - trimmed);
+            const int repne = strncmp(trimmed, "repn", 4) == 0;
+            const int conditional = prefixLen > strlen("rep");
+            while (isspace((unsigned char)*p))
+                p++;
+
+            uint8_t size;
+            const uint8_t opcode = syntax_get_string_opcode(p, &size);
+            const int compares = opcode == 0xA6 || opcode == 0xAE; /* cmps, scas */
+            if (opcode != 0 && compares != conditional) {
+                color_error(compares ? "cmps and scas need repe or repne, not '%.*s'"
+                                     : "'%.*s' only goes with cmps and scas, use rep",
+                            (int)prefixLen,
+                            trimmed);
+                fail();
+            }
+            emit_string_instruction(ctx, p, repne ? 0xF2 : 0xF3);
+            break;
+        }
+
+        case INSTR_LOCK: {
+            /* Format: lock <instruction>, F0 in front of a read-modify-write
+               on memory */
+            char *p = trimmed + strlen("lock");
+            while (isspace((unsigned char)*p))
+                p++;
+            char instruction[MAX_LINE_LEN];
+            strcpy(instruction, p);
+            if (!is_lockable(instruction)) {
+                color_error("lock needs add, sub, and, or, xor, not, neg, inc, dec, xchg, xadd "
+                            "or cmpxchg with a memory destination as the first operand "
+                            "(either operand for xchg)");
+                fail();
             }
+            encode_byte(codeBuf, 0xF0);
+            emit_instruction_line_ctx(ctx, p);
+            break;
+        }
+
+        case INSTR_XCHG:
+        case INSTR_XADD:
+        case INSTR_CMPXCHG: {
+            /* Format: <instr> <reg/memory>, <reg> */
+            char *operands[2];
+            split_operands(trimmed, operands, 2);
+            emit_exchange(ctx, instrType, operands[0], operands[1]);
             break;
         }
 
-        case INSTR_NOT: {
-            /* Format: not <reg> */
-            char *token = strtok(trimmed, " ,\t"); /* "not" */
-            if (!token) {
-                color_error("expected 'not' instruction");
-                exit(1);
+        case INSTR_CMPXCHG8B:
+        case INSTR_CMPXCHG16B: {
+            /* Format: cmpxchg8b/cmpxchg16b <memory>: 0F C7 /1, with REX.W for
+               16 bytes, which must be 16-byte aligned */
+            char *operands[1];
+            split_operands(trimmed, operands, 1);
+            RmOperand rm;
+            expect_rm_operand(operands[0], &rm);
+            if (!rm.inMemory) {
+                color_error("%s needs a memory operand", syntax_instruction_to_string(instrType));
+                fail();
             }
-            char *reg = strtok(NULL, " ,\t"); /* register */
-            if (!reg) {
-                color_error("expected register after 'not'");
-                exit(1);
+            const uint8_t opcode[] = {0x0F, 0xC7};
+            const uint8_t size = instrType == INSTR_CMPXCHG16B ? 8 : 4;
+            emit_rm_instruction(ctx, size, opcode, sizeof(opcode), 1, 0, &rm, 0);
+            break;
+        }
+
+        case INSTR_MFENCE:
+        case INSTR_LFENCE:
+        case INSTR_SFENCE: {
+            /* 0F AE with a register ModR/M: mfence /6, lfence /5, sfence /7 */
+            encode_byte(codeBuf, 0x0F);
+            encode_byte(codeBuf, 0xAE);
+            encode_byte(codeBuf,
+                        instrType == INSTR_MFENCE   ? 0xF0
+                        : instrType == INSTR_LFENCE ? 0xE8
+                                                    : 0xF8);
+            break;
+        }
+
+        case INSTR_PAUSE: {
+            encode_byte(codeBuf, 0xF3); /* pause: rep nop, a spin-wait hint */
+            encode_byte(codeBuf, 0x90);
+            break;
+        }
+
+        case INSTR_RDTSC:
+        case INSTR_RDPMC:
+        case INSTR_CPUID: {
+            /* rdtsc: 0F 31 and rdpmc: 0F 33 read a counter into edx:eax,
+               cpuid: 0F A2 reads leaf eax, subleaf ecx into eax..edx */
+            encode_byte(codeBuf, 0x0F);
+            encode_byte(codeBuf,
+                        instrType == INSTR_RDTSC   ? 0x31
+                        : instrType == INSTR_RDPMC ? 0x33
+                                                   : 0xA2);
+            break;
+        }
+
+        case INSTR_RDTSCP: {
+            /* 0F 01 F9: rdtsc that waits for earlier instructions and puts
+               the processor ID in ecx */
+            encode_byte(codeBuf, 0x0F);
+            encode_byte(codeBuf, 0x01);
+            encode_byte(codeBuf, 0xF9);
+            break;
+        }
+
+        case INSTR_XGETBV: {
+            /* 0F 01 D0: read extended control register ecx into edx:eax,
+               XCR0 tells which register state the OS saves */
+            encode_byte(codeBuf, 0x0F);
+            encode_byte(codeBuf, 0x01);
+            encode_byte(codeBuf, 0xD0);
+            break;
+        }
+
+        case INSTR_RDRAND: {
+            /* Format: rdrand <reg16/32/64>: 0F C7 /6, sets CF if the value is
+               valid */
+            char *operands[1];
+            split_operands(trimmed, operands, 1);
+            RmOperand rm;
+            expect_rm_operand(operands[0], &rm);
+            if (rm.inMemory || rm.size == 1) {
+                color_error("rdrand needs a 16-, 32- or 64-bit register");
+                fail();
             }
+            const uint8_t opcode[] = {0x0F, 0xC7};
+            emit_rm_instruction(ctx, rm.size, opcode, sizeof(opcode), 6, 0, &rm, 0);
+            break;
+        }
 
-            uint8_t reg_code = syntax_get_register_code(reg);
-            if (reg_code == 0xFF) {
-                color_error("unknown register '%s'", reg);
-                exit(1);
+        case INSTR_PREFETCHT0:
+        case INSTR_PREFETCHT1:
+        case INSTR_PREFETCHT2:
+        case INSTR_PREFETCHNTA:
+        case INSTR_PREFETCHW:
+        case INSTR_CLFLUSH:
+        case INSTR_CLFLUSHOPT:
+        case INSTR_CLWB: {
+            /* Format: <instr> <memory> */
+            char *operands[1];
+            split_operands(trimmed, operands, 1);
+            emit_cache_hint(ctx, instrType, operands[0]);
+            break;
+        }
+
+        case INSTR_MOVNTI: {
+            /* Format: movnti <memory>, <reg32/64>: 0F C3, a store that
+               bypasses the caches */
+            char *operands[2];
+            split_operands(trimmed, operands, 2);
+            RmOperand rm;
+            expect_rm_operand(operands[0], &rm);
+            uint8_t regSize;
+            const uint8_t reg = expect_register(operands[1], &regSize);
+            const uint8_t size = operand_size(&rm, regSize);
+            if (!rm.inMemory || (size != 4 && size != 8)) {
+                color_error("movnti stores a 32- or 64-bit register to memory");
+                fail();
             }
+            const uint8_t opcode[] = {0x0F, 0xC3};
+            emit_rm_instruction(ctx, size, opcode, sizeof(opcode), reg, size, &rm, 0);
+            break;
+        }
+
+        case INSTR_CLD: {
+            encode_byte(codeBuf, 0xFC); /* cld: string instructions count up */
+            break;
+        }
 
-            ensure_code_buffer_capacity(codeBuf, 3);  // Need 3 bytes
+        case INSTR_STD: {
+            encode_byte(codeBuf, 0xFD); /* std: string instructions count down */
+            break;
+        }
+
+        case INSTR_SYSCALL: {
+            encode_byte(codeBuf, 0x0F); /* syscall */
+            encode_byte(codeBuf, 0x05);
+            break;
+        }
+
+        case INSTR_PUSH:
+        case INSTR_POP: {
+            /* Format: push/pop <reg/memory>, push <immediate> */
+            char *operands[1];
+            split_operands(trimmed, operands, 1);
+            emit_push_pop(ctx, instrType, operands[0]);
+            break;
+        }
 
-            /* not r64 */
-            codeBuf->bytes[codeBuf->size++] = 0x48;            /* REX.W */
-            codeBuf->bytes[codeBuf->size++] = 0xF7;            /* not r/m64 */
-            codeBuf->bytes[codeBuf->size++] = 0xD0 | reg_code; /* ModR/M: register direct */
+        case INSTR_RET: {
+            /* Inside a proc, release its frame first */
+            const size_t frame = ctx->module->lineFrame[line_number - 1];
+            if (frame)
+                emit_stack_adjust(ctx, 0, frame);
+            encode_byte(codeBuf, 0xC3); /* ret */
             break;
         }
 
@@ -889,18 +2972,34 @@ static void emit_instruction_line_ctx(EmitContext *ctx, const char *line)
                     color_printf(COLOR_BOLD COLOR_BRIGHT_RED, "~");
                 color_printf(COLOR_RESET, "\n");
             }
-            exit(1);
+            fail();
         }
     }
 }
 
-/* Process data directives and copy data to the data buffer */
-static void process_data_buffer(DataBuffer *dataBuf, uint64_t dataBase)
+/* Process data directives and copy data to the data buffer.
+   Zero-initialised buffers are placed after all initialised data so they can
+   form a .bss that takes no space in the output file. Symbol values are
+   offsets into the module's .data or .bss.
+*/
+static void process_data_buffer(Module *m)
 {
+    DataBuffer *dataBuf = &m->dataBuf;
+    const SyntaxDataDirective *dataDirectives = m->dataDirectives;
+
     /* Process collected data directives: assign symbol addresses and emit data */
-    for (size_t i = 0; i < dataDirCount; i++) {
-        uint64_t addr = dataBase + dataBuf->size;
-        add_symbol(dataDirectives[i].label, addr);
+    for (size_t i = 0; i < m->dataDirCount; i++) {
+        if (dataDirectives[i].type == DATA_BUFFER)
+            continue; /* laid out below, after the initialised data */
+
+        if (dataDirectives[i].type == DATA_JUMPTABLE) {
+            /* Keep the 8-byte entries aligned */
+            const size_t padding = (8 - dataBuf->size % 8) % 8;
+            ensure_data_buffer_capacity(dataBuf, padding);
+            memset(dataBuf->bytes + dataBuf->size, 0, padding);
+            dataBuf->size += padding;
+        }
+        add_symbol(m, dataDirectives[i].label, dataBuf->size, SECTION_DATA);
 
         switch (dataDirectives[i].type) {
             case DATA_STRING: {
@@ -915,23 +3014,12 @@ static void process_data_buffer(DataBuffer *dataBuf, uint64_t dataBase)
                 break;
             }
 
-            case DATA_BUFFER: {
-                size_t size = dataDirectives[i].data.size;
-
-                ensure_data_buffer_capacity(dataBuf, size);
-
-                /* Zero-initialize the buffer */
-                memset(dataBuf->bytes + dataBuf->size, 0, size);
-                dataBuf->size += size;
-                break;
-            }
-
             case DATA_FILE: {
                 /* Read file contents */
                 FILE *fp = fopen(dataDirectives[i].data.filename, "rb");
                 if (!fp) {
                     color_error("cannot open file '%s'", dataDirectives[i].data.filename);
-                    exit(1);
+                    fail();
                 }
 
                 /* Get file size */
@@ -945,15 +3033,20 @@ static void process_data_buffer(DataBuffer *dataBuf, uint64_t dataBase)
                 if (fread(dataBuf->bytes + dataBuf->size, 1, fileSize, fp) != fileSize) {
                     color_error("failed to read file '%s'", dataDirectives[i].data.filename);
                     fclose(fp);
-                    exit(1);
+                    fail();
                 }
                 fclose(fp);
                 dataBuf->size += fileSize;
                 break;
             }
 
-            case DATA_RAW: {
-                size_t size = sizeof(dataDirectives[i].data.value);
+            case DATA_RAW:
+            case DATA_F32:
+            case DATA_F64: {
+                /* The low bytes of the value: four for f32, eight otherwise */
+                size_t size = dataDirectives[i].type == DATA_F32
+                                  ? sizeof(uint32_t)
+                                  : sizeof(dataDirectives[i].data.value);
 
                 ensure_data_buffer_capacity(dataBuf, size);
 
@@ -962,11 +3055,412 @@ static void process_data_buffer(DataBuffer *dataBuf, uint64_t dataBase)
                 break;
             }
 
+            case DATA_JUMPTABLE: {
+                /* One 64-bit address per label, filled in by the link step */
+                char targets[MAX_LINE_LEN];
+                strncpy(targets, dataDirectives[i].data.literal, MAX_LINE_LEN - 1);
+                targets[MAX_LINE_LEN - 1] = '\0';
+                char *entries[MAX_LINE_LEN];
+                const size_t count = syntax_split_operands(targets, entries, MAX_LINE_LEN);
+
+                ensure_data_buffer_capacity(dataBuf, 8 * count);
+                for (size_t j = 0; j < count; j++) {
+                    if (!*entries[j]) {
+                        color_error("empty entry in jump table '%s'", dataDirectives[i].label);
+                        fail();
+                    }
+                    const Symbol *sym = reference_symbol(m, entries[j]);
+                    add_relocation(m,
+                                   SECTION_DATA,
+                                   dataBuf->size,
+                                   (size_t)(sym - m->symbols),
+                                   R_X86_64_64,
+                                   0,
+                                   m->dataDirLine[i]);
+                    memset(dataBuf->bytes + dataBuf->size, 0, 8);
+                    dataBuf->size += 8;
+                }
+                break;
+            }
+
             default:
                 color_error("internal error: unknown data directive type");
-                exit(1);
+                fail();
+        }
+    }
+
+    /* Zero-initialised buffers only reserve space */
+    for (size_t i = 0; i < m->dataDirCount; i++) {
+        if (dataDirectives[i].type != DATA_BUFFER)
+            continue;
+
+        add_symbol(m, dataDirectives[i].label, dataBuf->bss_size, SECTION_BSS);
+        dataBuf->bss_size += dataDirectives[i].data.size;
+    }
+}
+
+/* Assemble a single module: read its source, lay out its labels, build its
+   data and encode its code. Only touches the module itself, so several
+   modules can be assembled concurrently. */
+static void assemble_module(Module *m)
+{
+    /* Read all lines from input. */
+    read_all_lines(m);
+    init_code_buffer(&m->scratchBuf, 32);
+
+    /* First pass: simulate code emission and collect data directives */
+    m->simulatedCodeSize = first_pass(m);
+
+    /* Initialize dynamically allocated buffers */
+    free_code_buffer(&m->scratchBuf);
+    init_code_buffer(&m->codeBuf, m->simulatedCodeSize > 0 ? m->simulatedCodeSize : 1024);
+    init_data_buffer(&m->dataBuf, 1024);  // Start with a reasonable default size
+
+    /* Process data directives and fill data buffer */
+    process_data_buffer(m);
+
+    apply_global_directives(m);
+
+    /* Second pass: emit instructions (ignore data directives) */
+    for (size_t i = 0; i < m->lineCount; i++) {
+        /* Alignment padding in front of the line */
+        if (m->codeBuf.size > m->lineOffset[i]) {
+            color_error("internal error: %s:%zu encoded past its layout", m->filename, i + 1);
+            fail();
+        }
+        encode_nops(&m->codeBuf, m->lineOffset[i] - m->codeBuf.size);
+
+        char *trimmed = syntax_trim(m->lines[i]);
+        if (m->lineDead[i] || is_directive_line(trimmed))
+            continue;
+        EmitContext ctx = {m, &m->codeBuf, m->filename, (int)i + 1, m->lines[i], 0};
+        emit_instruction_line_ctx(&ctx, trimmed);
+    }
+}
+
+/* Thread entry point for assemble_module() */
+static void *assemble_module_thread(void *arg)
+{
+    assemble_module((Module *)arg);
+    return NULL;
+}
+
+/* ---- Linking ---- */
+
+/* The combined output of all modules */
+typedef struct {
+    CodeBuffer codeBuf;
+    DataBuffer dataBuf;
+    LinkSymbol *symbols;
+    size_t symbolCount;
+    Relocation *relocations;
+    size_t relocationCount;
+    const char **imports; /* Extern functions, in GOT slot order */
+    size_t importCount;
+    uint64_t gotOffset; /* Offset of the GOT within .data */
+    size_t textAlign;   /* Largest alignment the code relies on */
+} LinkedImage;
+
+/* Where a module's sections start within the combined sections */
+typedef struct {
+    uint64_t text;
+    uint64_t data;
+    uint64_t bss;
+} ModuleLayout;
+
+static uint64_t align_up(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+/* Append a symbol to the linked symbol table and return its index */
+static size_t add_link_symbol(
+    LinkedImage *image, const char *name, SectionType section, uint64_t offset, int global)
+{
+    LinkSymbol *sym = &image->symbols[image->symbolCount];
+    sym->name = name;
+    sym->section = section;
+    sym->offset = offset;
+    sym->global = global;
+    return image->symbolCount++;
+}
+
+/* Find an exported (or, when undefined is set, an imported) symbol by name
+   in the linked symbol table. Returns the symbol count if there is none. */
+static size_t find_link_symbol(const LinkedImage *image, const char *name, int undefined)
+{
+    for (size_t i = 0; i < image->symbolCount; i++) {
+        const LinkSymbol *sym = &image->symbols[i];
+        if (sym->global && (sym->section == SECTION_UNDEF) == (undefined != 0)
+            && strcmp(sym->name, name) == 0)
+            return i;
+    }
+    return image->symbolCount;
+}
+
+/* Lay out the code and data of all modules one after another, merge their
+   symbol tables and resolve every recorded relocation: imports are matched
+   against the exports of the other modules, and references are patched for
+   an image whose code starts at text_addr and whose data starts at the
+   next multiple of data_align after the code. Extern functions get a GOT slot
+   at the end of .data for the dynamic loader to fill. For relocatable output
+   the relocations are kept, and imports nobody exports stay undefined.
+   Returns the number of unresolved symbols.
+*/
+static int link_modules(Module **modules,
+                        size_t count,
+                        int relocatable,
+                        uint64_t text_addr,
+                        uint64_t data_align,
+                        LinkedImage *image)
+{
+    int errors = 0;
+    size_t totalSymbols = 0;
+    size_t totalRelocations = 0;
+    size_t *symbolMap = NULL;
+    size_t *gotSlot = NULL;
+    ModuleLayout *layout = calloc(count, sizeof(ModuleLayout));
+    if (!layout) {
+        perror("calloc for module layout");
+        return 1;
+    }
+
+    /* Place each module's sections after those of the previous modules. Code
+       is aligned as its 'align' directives require, relative to where the
+       section ends up (the start of .text in relocatable output). */
+    const uint64_t textBase = relocatable ? 0 : text_addr;
+    size_t codeSize = 0, dataSize = 0, bssSize = 0;
+    image->textAlign = 1;
+    for (size_t i = 0; i < count; i++) {
+        const size_t textAlign = modules[i]->textAlign > 1 ? modules[i]->textAlign : 1;
+        if (textAlign > image->textAlign)
+            image->textAlign = textAlign;
+        codeSize = align_up(textBase + codeSize, textAlign) - textBase;
+        dataSize = align_up(dataSize, 8);
+        bssSize = align_up(bssSize, 8);
+        layout[i].text = codeSize;
+        layout[i].data = dataSize;
+        layout[i].bss = bssSize;
+        codeSize += modules[i]->codeBuf.size;
+        dataSize += modules[i]->dataBuf.size;
+        bssSize += modules[i]->dataBuf.bss_size;
+        totalSymbols += modules[i]->symbolCount;
+        totalRelocations += modules[i]->relocationCount;
+    }
+
+    init_code_buffer(&image->codeBuf, codeSize > 0 ? codeSize : 1);
+    init_data_buffer(&image->dataBuf, dataSize > 0 ? dataSize : 1);
+    memset(image->dataBuf.bytes, 0, dataSize);
+    image->codeBuf.size = 0;
+    for (size_t i = 0; i < count; i++) {
+        encode_nops(&image->codeBuf, layout[i].text - image->codeBuf.size);
+        memcpy(image->codeBuf.bytes + layout[i].text,
+               modules[i]->codeBuf.bytes,
+               modules[i]->codeBuf.size);
+        image->codeBuf.size += modules[i]->codeBuf.size;
+        memcpy(image->dataBuf.bytes + layout[i].data,
+               modules[i]->dataBuf.bytes,
+               modules[i]->dataBuf.size);
+    }
+    image->codeBuf.size = codeSize;
+    image->dataBuf.size = dataSize;
+    image->dataBuf.bss_size = bssSize;
+
+    image->symbols = calloc(totalSymbols ? totalSymbols : 1, sizeof(LinkSymbol));
+    image->relocations = calloc(totalRelocations ? totalRelocations : 1, sizeof(Relocation));
+    symbolMap = calloc(totalSymbols ? totalSymbols : 1, sizeof(size_t));
+    if (!image->symbols || !image->relocations || !symbolMap) {
+        perror("calloc for link tables");
+        errors++;
+        goto done;
+    }
+    image->symbolCount = 0;
+    image->relocationCount = 0;
+
+    /* Defined symbols, rebased onto the combined sections */
+    size_t mapBase = 0;
+    for (size_t i = 0; i < count; i++) {
+        Module *m = modules[i];
+        for (size_t j = 0; j < m->symbolCount; j++) {
+            const Symbol *sym = &m->symbols[j];
+            uint64_t offset = sym->value;
+            switch (sym->section) {
+                case SECTION_TEXT:
+                    offset += layout[i].text;
+                    break;
+                case SECTION_DATA:
+                    offset += layout[i].data;
+                    break;
+                case SECTION_BSS:
+                    offset += layout[i].bss;
+                    break;
+                case SECTION_UNDEF:
+                    continue; /* imports are resolved below */
+            }
+            if (sym->global && find_link_symbol(image, sym->name, 0) < image->symbolCount) {
+                error_report_simple(ERROR_SEVERITY_ERROR,
+                                    "%s: symbol '%s' is already exported by another module",
+                                    m->filename,
+                                    sym->name);
+                errors++;
+            }
+            symbolMap[mapBase + j] =
+                add_link_symbol(image, sym->name, sym->section, offset, sym->global);
+        }
+        mapBase += m->symbolCount;
+    }
+
+    /* Imports, matched against the exports of all modules */
+    mapBase = 0;
+    for (size_t i = 0; i < count; i++) {
+        Module *m = modules[i];
+        for (size_t j = 0; j < m->symbolCount; j++) {
+            const Symbol *sym = &m->symbols[j];
+            if (sym->section != SECTION_UNDEF)
+                continue;
+            /* Extern functions come from shared libraries, not other modules */
+            size_t index =
+                sym->external ? image->symbolCount : find_link_symbol(image, sym->name, 0);
+            if (index == image->symbolCount && (relocatable || sym->external)) {
+                index = find_link_symbol(image, sym->name, 1);
+                if (index == image->symbolCount)
+                    index = add_link_symbol(image, sym->name, SECTION_UNDEF, 0, 1);
+            }
+            symbolMap[mapBase + j] = index < image->symbolCount ? index : SIZE_MAX;
+        }
+        mapBase += m->symbolCount;
+    }
+
+    /* One GOT slot per extern function, after the modules' data */
+    gotSlot = calloc(image->symbolCount ? image->symbolCount : 1, sizeof(size_t));
+    image->imports = calloc(image->symbolCount ? image->symbolCount : 1, sizeof(const char *));
+    if (!gotSlot || !image->imports) {
+        perror("calloc for GOT");
+        errors++;
+        goto done;
+    }
+    image->importCount = 0;
+    image->gotOffset = 0;
+    if (!relocatable) {
+        for (size_t i = 0; i < image->symbolCount; i++) {
+            if (image->symbols[i].section != SECTION_UNDEF)
+                continue;
+            gotSlot[i] = image->importCount;
+            image->imports[image->importCount++] = image->symbols[i].name;
         }
     }
+    if (image->importCount > 0) {
+        image->gotOffset = align_up(dataSize, 8);
+        size_t gotEnd = image->gotOffset + 8 * image->importCount;
+        ensure_buffer_capacity(&image->dataBuf, gotEnd - dataSize);
+        memset(image->dataBuf.bytes + dataSize, 0, gotEnd - dataSize);
+        dataSize = gotEnd;
+        image->dataBuf.size = dataSize;
+    }
+
+    /* Section addresses for fully linked output */
+    const uint64_t dataAddr = align_up(text_addr + codeSize, data_align);
+    const uint64_t sectionAddr[] = {
+        [SECTION_UNDEF] = 0,
+        [SECTION_TEXT] = text_addr,
+        [SECTION_DATA] = dataAddr,
+        [SECTION_BSS] = dataAddr + dataSize,
+    };
+
+    mapBase = 0;
+    for (size_t i = 0; i < count; i++) {
+        Module *m = modules[i];
+        for (size_t j = 0; j < m->relocationCount; j++) {
+            const ModuleRelocation *mr = &m->relocations[j];
+            size_t index = symbolMap[mapBase + mr->reloc.symbol];
+            if (index == SIZE_MAX) {
+                error_report(m->filename,
+                             mr->line_number,
+                             0,
+                             m->lines[mr->line_number - 1],
+                             ERROR_SEVERITY_ERROR,
+                             "unknown symbol '%s'",
+                             m->symbols[mr->reloc.symbol].name);
+                errors++;
+                continue;
+            }
+
+            Relocation reloc = mr->reloc;
+            reloc.offset += reloc.section == SECTION_DATA ? layout[i].data : layout[i].text;
+            reloc.symbol = index;
+            if (relocatable) {
+                if (reloc.type == R_X86_64_32S) {
+                    /* Nothing else tells the user until a default PIE link fails */
+                    error_report(m->filename,
+                                 mr->line_number,
+                                 0,
+                                 m->lines[mr->line_number - 1],
+                                 ERROR_SEVERITY_WARNING,
+                                 "'%s' with an index register is a 32-bit absolute address, "
+                                 "which needs a -no-pie link; load it with lea for PIE",
+                                 image->symbols[index].name);
+                }
+                image->relocations[image->relocationCount++] = reloc;
+                continue;
+            }
+
+            /* Resolve S + A - P in place, where S is the GOT slot for
+               R_X86_64_GOTPCREL, S + A for R_X86_64_32S, and the 64-bit
+               S + A of a jump table entry for R_X86_64_64 */
+            const LinkSymbol *target = &image->symbols[index];
+            uint64_t symbolAddr = sectionAddr[target->section] + target->offset;
+            if (reloc.type == R_X86_64_GOTPCREL) {
+                symbolAddr = sectionAddr[SECTION_DATA] + image->gotOffset + 8 * gotSlot[index];
+            } else if (target->section == SECTION_UNDEF) {
+                error_report(m->filename,
+                             mr->line_number,
+                             0,
+                             m->lines[mr->line_number - 1],
+                             ERROR_SEVERITY_ERROR,
+                             "extern function '%s' can only be called or jumped to",
+                             target->name);
+                errors++;
+                continue;
+            }
+            int64_t value = (int64_t)symbolAddr + reloc.addend;
+            if (reloc.type == R_X86_64_64) {
+                memcpy(image->dataBuf.bytes + reloc.offset, &value, sizeof(value));
+                continue;
+            }
+            if (reloc.type != R_X86_64_32S)
+                value -= (int64_t)(text_addr + reloc.offset);
+            if (value < INT32_MIN || value > INT32_MAX) {
+                error_report(m->filename,
+                             mr->line_number,
+                             0,
+                             m->lines[mr->line_number - 1],
+                             ERROR_SEVERITY_ERROR,
+                             "symbol '%s' out of range",
+                             target->name);
+                errors++;
+                continue;
+            }
+            for (int k = 0; k < 4; k++)
+                image->codeBuf.bytes[reloc.offset + k] = (uint8_t)((value >> (8 * k)) & 0xff);
+        }
+        mapBase += m->symbolCount;
+    }
+
+done:
+    free(gotSlot);
+    free(symbolMap);
+    free(layout);
+    return errors;
+}
+
+static void free_linked_image(LinkedImage *image)
+{
+    free_code_buffer(&image->codeBuf);
+    free_data_buffer(&image->dataBuf);
+    free(image->symbols);
+    free(image->relocations);
+    free(image->imports);
+    memset(image, 0, sizeof(*image));
 }
 
 /* ---- Main Assembly Function ---- */
@@ -974,92 +3468,159 @@ static void process_data_buffer(DataBuffer *dataBuf, uint64_t dataBase)
 /* Convenience wrapper for ELF output */
 int assemble_to_elf(const char *input_filename, const char *output_filename)
 {
-    const AssemblerOptions options = {.input_filename = input_filename,
+    const char *input_filenames[] = {input_filename};
+    const AssemblerOptions options = {.input_filenames = input_filenames,
+                                      .input_count = 1,
                                       .output_filename = output_filename,
                                       .writer = write_elf_file,
-                                      .verbose = 0};
+                                      .verbose = 0,
+                                      .relocatable = 0};
     return assemble(&options);
 }
 
-/* The main assembly function that processes the input assembly file,
-   generates code and data, and calls the binary writer function. */
+/* Print what was found in a module */
+static void report_module(const Module *m, int verbose)
+{
+    size_t imports = 0, exports = 0;
+    for (size_t i = 0; i < m->symbolCount; i++) {
+        if (m->symbols[i].section == SECTION_UNDEF)
+            imports++;
+        else if (m->symbols[i].global)
+            exports++;
+    }
+
+    color_section(m->filename);
+    color_info("Read %zu lines from input file", m->lineCount);
+    color_info("Estimated code size: %zu bytes", m->simulatedCodeSize);
+    color_info("Actual code size: %zu bytes", m->codeBuf.size);
+    color_info("Found %zu data directives", m->dataDirCount);
+    color_info("Data size: %zu bytes, .bss size: %zu bytes", m->dataBuf.size, m->dataBuf.bss_size);
+    color_info("Found %zu symbols (%zu exported, %zu imported)", m->symbolCount, exports, imports);
+    color_info("Recorded %zu relocations", m->relocationCount);
+
+    /* Display collected symbols if very verbose */
+    if (verbose > 1) {
+        static const char *sectionNames[] = {"undef", ".text", ".data", ".bss"};
+        for (size_t i = 0; i < m->symbolCount; i++) {
+            color_printf(COLOR_MAGENTA, "  %-20s", m->symbols[i].name);
+            color_printf(COLOR_RESET, " = ");
+            color_printf(COLOR_YELLOW,
+                         "%s+0x%lx\n",
+                         sectionNames[m->symbols[i].section],
+                         m->symbols[i].value);
+        }
+    }
+}
+
+/* The main assembly function. Every input file is assembled as a separate
+   module, in parallel when there are several, then the modules are linked
+   and the result is handed to the binary writer function. */
 int assemble(const AssemblerOptions *options)
 {
-    /* Reset global state for multiple invocations */
-    symbolCount = 0;
-    dataDirCount = 0;
+    const size_t count = options->input_count;
 
     /* Initialize the syntax module */
     syntax_init();
 
-    if (options->verbose) {
-        color_section("Assembly Process");
-        color_info("Assembling file: %s", options->input_filename);
+    uint32_t cpuFeatures = 0;
+    if (options->march && !syntax_get_cpu_target(options->march, &cpuFeatures)) {
+        color_error("unknown --march target '%s', use x86-64-v1 to x86-64-v4 or native",
+                    options->march);
+        fail();
     }
 
-    /* Read all lines from input. */
-    size_t lineCount = read_all_lines(options->input_filename);
-
     if (options->verbose) {
-        color_info("Read %zu lines from input file", lineCount);
+        color_section("Assembly Process");
+        for (size_t i = 0; i < count; i++)
+            color_info("Assembling file: %s", options->input_filenames[i]);
     }
 
-    /* First pass: simulate code emission and collect data directives */
-    size_t simulatedCodeSize = first_pass(lineCount);
-
-    if (options->verbose) {
-        color_section("First Pass Results");
-        color_info("Estimated code size: %zu bytes", simulatedCodeSize);
-        color_info("Found %zu data directives", dataDirCount);
-        color_info("Found %zu symbols", symbolCount);
-
-        /* Display collected symbols if very verbose */
-        if (options->verbose > 1) {
-            color_section("Symbol Table");
-            for (size_t i = 0; i < symbolCount; i++) {
-                color_printf(COLOR_MAGENTA, "  %-20s", symbols[i].name);
-                color_printf(COLOR_RESET, " = ");
-                color_printf(COLOR_YELLOW, "0x%016lx\n", symbols[i].value);
-            }
+    Module **modules = calloc(count, sizeof(Module *));
+    pthread_t *threads = calloc(count, sizeof(pthread_t));
+    int *started = calloc(count, sizeof(int));
+    if (!modules || !threads || !started) {
+        perror("calloc for modules");
+        fail();
+    }
+    for (size_t i = 0; i < count; i++) {
+        modules[i] = calloc(1, sizeof(Module));
+        if (!modules[i]) {
+            perror("calloc for module");
+            fail();
         }
+        modules[i]->filename = options->input_filenames[i];
+        modules[i]->loopAlign = options->loop_align;
+        modules[i]->march = options->march;
+        modules[i]->cpuFeatures = cpuFeatures;
     }
 
-    /* Data section begins after code section */
-    uint64_t dataBase = BASE_ADDR + CODE_OFFSET + simulatedCodeSize;
-    uint64_t entry_point = BASE_ADDR + CODE_OFFSET;
-
-    /* Initialize dynamically allocated buffers */
-    CodeBuffer codeBuf;
-    DataBuffer dataBuf;
-    init_code_buffer(&codeBuf, simulatedCodeSize > 0 ? simulatedCodeSize : 1024);
-    init_data_buffer(&dataBuf, 1024);  // Start with a reasonable default size
-
-    /* Process data directives and fill data buffer */
-    process_data_buffer(&dataBuf, dataBase);
+    /* Modules share no state, so each one gets its own thread. If a thread
+       cannot be created the module is assembled on this one instead. */
+    if (count == 1) {
+        assemble_module(modules[0]);
+    } else {
+        for (size_t i = 0; i < count; i++)
+            started[i] = pthread_create(&threads[i], NULL, assemble_module_thread, modules[i]) == 0;
+        for (size_t i = 0; i < count; i++) {
+            if (started[i])
+                pthread_join(threads[i], NULL);
+            else
+                assemble_module(modules[i]);
+        }
+    }
 
     if (options->verbose) {
-        color_section("Data Processing");
-        color_info("Processed data directives. Total data size: %zu bytes", dataBuf.size);
+        for (size_t i = 0; i < count; i++)
+            report_module(modules[i], options->verbose);
     }
 
-    /* Second pass: emit instructions (ignore data directives) */
-    for (size_t i = 0; i < lineCount; i++) {
-        char *trimmed = syntax_trim(lines[i]);
-        if (trimmed[0] == '\0' || syntax_is_comment(trimmed) || syntax_is_data_directive(trimmed))
-            continue;
-        EmitContext ctx = {&codeBuf, options->input_filename, (int)i + 1, lines[i]};
-        emit_instruction_line_ctx(&ctx, trimmed);
+    /* Executables that import extern functions are dynamically linked and
+       carry more program headers in front of the code */
+    int dynamic = 0;
+    for (size_t i = 0; i < count && !options->relocatable; i++) {
+        for (size_t j = 0; j < modules[i]->symbolCount; j++)
+            dynamic |= modules[i]->symbols[j].external;
     }
 
-    if (options->verbose) {
-        color_section("Second Pass Results");
-        color_info("Actual code size: %zu bytes", codeBuf.size);
-        color_info("Total binary size: %zu bytes", codeBuf.size + dataBuf.size);
-        color_info("Writing output to: %s", options->output_filename);
-    }
+    /* Link: lay out all modules and resolve cross-module references */
+    const uint64_t entry_point = BASE_ADDR + (dynamic ? DYNAMIC_CODE_OFFSET : CODE_OFFSET);
+    LinkedImage image;
+    int result = 0;
+    if (link_modules(modules, count, options->relocatable, entry_point, 1, &image) > 0) {
+        result = 1;
+    } else {
+        if (options->verbose) {
+            color_section("Link Results");
+            color_info("Code size: %zu bytes", image.codeBuf.size);
+            color_info("Data size: %zu bytes, .bss size: %zu bytes",
+                       image.dataBuf.size,
+                       image.dataBuf.bss_size);
+            if (options->relocatable)
+                color_info("Relocations kept for the linker: %zu", image.relocationCount);
+            if (image.importCount > 0)
+                color_info("Functions imported from libc: %zu", image.importCount);
+            if (options->run_argv)
+                color_info("Running in memory: %s", options->run_argv[0]);
+            else
+                color_info("Writing output to: %s", options->output_filename);
+        }
 
-    /* Call the binary writer function */
-    int result = options->writer(options->output_filename, &codeBuf, &dataBuf, entry_point);
+        /* Call the binary writer function */
+        const LinkInfo link = {.symbols = image.symbols,
+                               .symbol_count = image.symbolCount,
+                               .relocations = image.relocations,
+                               .relocation_count = image.relocationCount,
+                               .imports = image.imports,
+                               .import_count = image.importCount,
+                               .got_offset = image.gotOffset,
+                               .text_align = image.textAlign};
+        if (options->run_argv)
+            result = run_elf_image(
+                &image.codeBuf, &image.dataBuf, entry_point, &link, options->run_argv);
+        else
+            result = options->writer(
+                options->output_filename, &image.codeBuf, &image.dataBuf, entry_point, &link);
+    }
 
     if (options->verbose) {
         if (result == 0) {
@@ -1070,8 +3631,144 @@ int assemble(const AssemblerOptions *options)
     }
 
     /* Clean up */
-    free_code_buffer(&codeBuf);
-    free_data_buffer(&dataBuf);
+    free_linked_image(&image);
+    for (size_t i = 0; i < count; i++) {
+        free_code_buffer(&modules[i]->codeBuf);
+        free_data_buffer(&modules[i]->dataBuf);
+        free(modules[i]);
+    }
+    free(modules);
+    free(threads);
+    free(started);
 
     return result;
 }
+
+/* ---- In-process JIT ---- */
+
+/* Size of the mapping for a linked image: code pages first, then data and
+   .bss on the following pages */
+static size_t jit_image_size(const LinkedImage *image, size_t page_size)
+{
+    const size_t codeSize = align_up(image->codeBuf.size, page_size);
+    return align_up(codeSize + image->dataBuf.size + image->dataBuf.bss_size, page_size);
+}
+
+/* Copy an image linked for `memory` into that mapping. Extern functions are
+   looked up among the libraries already loaded, and the code pages end up
+   read-only and executable. Returns the entry address, or NULL on failure.
+*/
+static void *load_jit_image(const LinkedImage *image,
+                            size_t page_size,
+                            uint8_t *memory,
+                            size_t totalSize,
+                            JitCode *code)
+{
+    const size_t codeSize = align_up(image->codeBuf.size, page_size);
+    memcpy(memory, image->codeBuf.bytes, image->codeBuf.size);
+    memcpy(memory + codeSize, image->dataBuf.bytes, image->dataBuf.size);
+
+    /* Fill the GOT with the runtime addresses of extern functions */
+    for (size_t i = 0; i < image->importCount; i++) {
+        void *address = dlsym(RTLD_DEFAULT, image->imports[i]);
+        if (!address) {
+            error_report_simple(
+                ERROR_SEVERITY_ERROR, "extern function '%s' not found", image->imports[i]);
+            return NULL;
+        }
+        memcpy(memory + codeSize + image->gotOffset + 8 * i, &address, sizeof(address));
+    }
+
+    if (mprotect(memory, codeSize, PROT_READ | PROT_EXEC) != 0) {
+        perror("mprotect");
+        return NULL;
+    }
+
+    code->memory = memory;
+    code->size = totalSize;
+    code->entry = memory;
+    return memory;
+}
+
+/* Assemble source code straight into executable memory of this process */
+void *jit_assemble(const char *source, size_t length, JitCode *code)
+{
+    memset(code, 0, sizeof(*code));
+    syntax_init();
+
+    Module *m = calloc(1, sizeof(Module));
+    LinkedImage *image = calloc(1, sizeof(LinkedImage));
+    if (!m || !image) {
+        perror("calloc for module");
+        free(m);
+        free(image);
+        return NULL;
+    }
+    m->filename = "<jit>";
+    m->source = source;
+    m->sourceLength = length;
+
+    /* Errors in the source come back here, with what was allocated for
+       the code still in the module and the image */
+    uint8_t *volatile memory = NULL;
+    volatile size_t totalSize = 0;
+    void *volatile entry = NULL;
+    jmp_buf failure;
+    if (setjmp(failure) == 0) {
+        failureJump = &failure;
+        assemble_module(m);
+
+        /* Link once to learn the size of the image, then again for the
+           address it is mapped at. Absolute addresses in indexed memory
+           operands are sign-extended 32-bit values, so such code is mapped
+           into the low 2GB. */
+        const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        int mapFlags = MAP_PRIVATE | MAP_ANONYMOUS;
+        for (size_t i = 0; i < m->relocationCount; i++) {
+            if (m->relocations[i].reloc.type == R_X86_64_32S)
+                mapFlags |= MAP_32BIT;
+        }
+
+        if (link_modules(&m, 1, 0, 0, page_size, image) == 0) {
+            totalSize = jit_image_size(image, page_size);
+            if (image->codeBuf.size == 0) {
+                error_report_simple(ERROR_SEVERITY_ERROR, "no code to run");
+            } else {
+                uint8_t *mapping = mmap(NULL, totalSize, PROT_READ | PROT_WRITE, mapFlags, -1, 0);
+                if (mapping == MAP_FAILED && (mapFlags & MAP_32BIT))
+                    error_report_simple(ERROR_SEVERITY_ERROR,
+                                        "no room in the low 2GB for code that uses "
+                                        "[symbol + index] operands: %s",
+                                        strerror(errno));
+                else if (mapping == MAP_FAILED)
+                    perror("mmap");
+                else
+                    memory = mapping;
+            }
+            if (memory) {
+                free_linked_image(image);
+                if (link_modules(&m, 1, 0, (uint64_t)(uintptr_t)memory, page_size, image) == 0)
+                    entry = load_jit_image(image, page_size, memory, totalSize, code);
+            }
+        }
+    }
+    failureJump = NULL;
+    if (memory && !entry)
+        munmap(memory, totalSize);
+
+    free_linked_image(image);
+    free(image);
+    free_code_buffer(&m->codeBuf);
+    free_code_buffer(&m->scratchBuf);
+    free_data_buffer(&m->dataBuf);
+    free(m);
+    return entry;
+}
+
+/* Release the memory of a program returned by jit_assemble() */
+void jit_free(JitCode *code)
+{
+    if (code->memory)
+        munmap(code->memory, code->size);
+    memset(code, 0, sizeof(*code));
+}
@@ -24,6 +24,7 @@ void init_data_buffer(DataBuffer *buffer, size_t initial_capacity)
     }
     buffer->size = 0;
     buffer->capacity = initial_capacity;
+    buffer->bss_size = 0;
 }
 
 /* Free allocated memory in code buffer */
@@ -46,6 +47,7 @@ void free_data_buffer(DataBuffer *buffer)
     }
     buffer->size = 0;
     buffer->capacity = 0;
+    buffer->bss_size = 0;
 }
 
 /* Ensure there's enough space in a buffer for additional bytes */
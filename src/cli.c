@@ -1,5 +1,6 @@
 #include "cli.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "color_utils.h"
 
@@ -14,6 +15,8 @@ void print_usage(const char *program_name)
 
     color_printf(COLOR_BOLD, "USAGE:\n");
     color_printf(COLOR_BRIGHT_WHITE, "  %s [options] <input.jasm> [output]\n", program_name);
+    color_printf(COLOR_BRIGHT_WHITE, "  %s [options] <a.jasm> <b.jasm>... -o <output>\n", program_name);
+    color_printf(COLOR_BRIGHT_WHITE, "  %s --run <input.jasm>... [-- args...]\n", program_name);
 
     printf("\n");
     color_printf(COLOR_BOLD, "OPTIONS:\n");
@@ -27,7 +30,21 @@ void print_usage(const char *program_name)
     printf("Display version information and exit\n");
 
     color_printf(COLOR_BRIGHT_GREEN, "  -f, --format <format> ");
-    printf("Specify output format (elf, bin)\n");
+    printf("Specify output format (elf, bin, obj)\n");
+
+    color_printf(COLOR_BRIGHT_GREEN, "  -o, --output <file>   ");
+    printf("Write output to <file> (default: a.out)\n");
+
+    color_printf(COLOR_BRIGHT_GREEN, "  -r, --run             ");
+    printf("Execute the program from memory instead of writing a file;\n");
+    printf("                        arguments after -- are passed to it\n");
+
+    color_printf(COLOR_BRIGHT_GREEN, "  --align-loops=<n>     ");
+    printf("Pad loop heads to <n>-byte boundaries with NOPs\n");
+
+    color_printf(COLOR_BRIGHT_GREEN, "  --march=<cpu>         ");
+    printf("Only allow instructions of <cpu> outside ifcpu blocks:\n");
+    printf("                        x86-64-v1 to x86-64-v4, or native\n");
 
     printf("\n");
     color_printf(COLOR_BOLD, "FORMATS:\n");
@@ -37,6 +54,9 @@ void print_usage(const char *program_name)
     color_printf(COLOR_BRIGHT_YELLOW, "  bin                   ");
     printf("Raw binary file\n");
 
+    color_printf(COLOR_BRIGHT_YELLOW, "  obj                   ");
+    printf("ELF relocatable object, for linking with ld or cc\n");
+
     printf("\n");
     color_printf(COLOR_BOLD, "EXAMPLES:\n");
     color_printf(COLOR_BRIGHT_CYAN, "  %s program.jasm                  ", program_name);
@@ -45,6 +65,15 @@ void print_usage(const char *program_name)
     color_printf(COLOR_BRIGHT_CYAN, "  %s -f bin program.jasm prog.bin  ", program_name);
     printf("Assemble to raw binary\n");
 
+    color_printf(COLOR_BRIGHT_CYAN, "  %s -f obj kernel.jasm kernel.o   ", program_name);
+    printf("Assemble to an object file\n");
+
+    color_printf(COLOR_BRIGHT_CYAN, "  %s main.jasm util.jasm -o prog   ", program_name);
+    printf("Assemble and link several modules\n");
+
+    color_printf(COLOR_BRIGHT_CYAN, "  %s --run program.jasm -- a b    ", program_name);
+    printf("Assemble and run with arguments a and b\n");
+
     color_printf(COLOR_BRIGHT_CYAN, "  %s -v program.jasm prog          ", program_name);
     printf("Assemble with verbose output\n");
 
@@ -68,19 +97,40 @@ OutputFormat parse_format(const char *format_str)
         return FORMAT_ELF;
     else if (strcmp(format_str, "bin") == 0)
         return FORMAT_BINARY;
+    else if (strcmp(format_str, "obj") == 0)
+        return FORMAT_OBJECT;
     else
         return FORMAT_UNKNOWN;
 }
 
-/* Process command line arguments */
+/* Check whether a file name has the .jasm extension */
+static int has_jasm_extension(const char *filename)
+{
+    size_t len = strlen(filename);
+    return len >= 5 && strcmp(filename + len - 5, ".jasm") == 0;
+}
+
+/* Process command line arguments.
+   Positional arguments are input files. Without -o, a trailing argument that
+   is not a .jasm file names the output, as in "jasm input.jasm output".
+   input_files must have room for argc entries. With --run, everything
+   after "--" is returned in program_args for the assembled program.
+*/
 int process_arguments(int argc,
                       char **argv,
-                      const char **input_file,
+                      const char **input_files,
+                      size_t *input_count,
                       const char **output_file,
                       OutputFormat *output_format,
-                      int *verbose)
+                      int *verbose,
+                      int *run,
+                      char ***program_args,
+                      int *program_argc,
+                      size_t *loop_align,
+                      const char **march)
 {
     const char *format_str = NULL;
+    int explicit_output = 0;
 
     /* Parse command line arguments */
     for (int i = 1; i < argc; i++) {
@@ -99,21 +149,53 @@ int process_arguments(int argc,
                 color_error("--format requires an argument");
                 return 1;
             }
+        } else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) {
+            if (i + 1 < argc) {
+                *output_file = argv[++i];
+                explicit_output = 1;
+            } else {
+                color_error("--output requires an argument");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--run") == 0) {
+            *run = 1;
+        } else if (strncmp(argv[i], "--align-loops=", 14) == 0) {
+            char *end = NULL;
+            unsigned long value = strtoul(argv[i] + 14, &end, 0);
+            if (!argv[i][14] || *end || value == 0 || value > 4096 || (value & (value - 1))) {
+                color_error("--align-loops needs a power of two up to 4096");
+                return 1;
+            }
+            *loop_align = value;
+        } else if (strncmp(argv[i], "--march=", 8) == 0) {
+            if (!argv[i][8]) {
+                color_error("--march needs a target such as x86-64-v3 or native");
+                return 1;
+            }
+            *march = argv[i] + 8;
+        } else if (strcmp(argv[i], "--") == 0) {
+            *program_args = argv + i + 1;
+            *program_argc = argc - i - 1;
+            break;
         } else if (argv[i][0] == '-') {
             color_error("Unknown option '%s'", argv[i]);
             return 1;
-        } else if (!*input_file) {
-            *input_file = argv[i];
-        } else if (!*output_file) {
-            *output_file = argv[i];
         } else {
-            color_error("Too many arguments");
-            return 1;
+            input_files[(*input_count)++] = argv[i];
         }
     }
 
+    if (*program_args && !*run) {
+        color_error("Program arguments after -- require --run");
+        return 1;
+    }
+
+    /* Legacy form: jasm <input> <output> */
+    if (!*run && !explicit_output && *input_count == 2 && !has_jasm_extension(input_files[1]))
+        *output_file = input_files[--(*input_count)];
+
     /* Check if input file was provided */
-    if (!*input_file) {
+    if (*input_count == 0) {
         color_error("No input file specified");
         print_usage(argv[0]);
         return 1;
@@ -128,22 +210,35 @@ int process_arguments(int argc,
         }
     }
 
+    /* Running needs an executable and has no output file */
+    if (*run && (*output_format != FORMAT_ELF || explicit_output)) {
+        color_error("--run cannot be combined with --output or a non-ELF format");
+        return 1;
+    }
+
     return 0;
 }
 
 /* Print assembly information if verbose mode is enabled */
-void print_assembly_info(const char *input_file,
+void print_assembly_info(const char *const *input_files,
+                         size_t input_count,
                          const char *output_file,
                          OutputFormat output_format)
 {
     printf("\n");
     color_printf(COLOR_BOLD COLOR_BRIGHT_BLUE, "JASM Assembler v%s\n", VERSION);
     color_printf(COLOR_BRIGHT_CYAN, "----------------------------------------\n");
-    color_printf(COLOR_RESET, "Input file:  ");
-    color_printf(COLOR_BRIGHT_WHITE, "%s\n", input_file);
+    for (size_t i = 0; i < input_count; i++) {
+        color_printf(COLOR_RESET, i == 0 ? "Input file:  " : "             ");
+        color_printf(COLOR_BRIGHT_WHITE, "%s\n", input_files[i]);
+    }
     color_printf(COLOR_RESET, "Output file: ");
     color_printf(COLOR_BRIGHT_WHITE, "%s\n", output_file);
     color_printf(COLOR_RESET, "Format:      ");
-    color_printf(COLOR_BRIGHT_YELLOW, "%s\n", output_format == FORMAT_ELF ? "ELF" : "Binary");
+    color_printf(COLOR_BRIGHT_YELLOW,
+                 "%s\n",
+                 output_format == FORMAT_ELF      ? "ELF"
+                 : output_format == FORMAT_OBJECT ? "ELF object"
+                                                  : "Binary");
     printf("\n");
 }
\ No newline at end of file
@@ -1,47 +1,256 @@
+#define _GNU_SOURCE /* memfd_create */
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "binary_writer.h"
 
+extern char **environ;
+
 /* ELF file related constants. */
 #define ELF_HEADER_SIZE     64
 #define PROGRAM_HEADER_SIZE 56
 #define CODE_OFFSET         (ELF_HEADER_SIZE + PROGRAM_HEADER_SIZE)
+#define DYNAMIC_CODE_OFFSET (ELF_HEADER_SIZE + 4 * PROGRAM_HEADER_SIZE)
 #define BASE_ADDR           0x400000
+#define PAGE_SIZE           0x1000
 
-/* Write the assembled code and data as an ELF executable file */
-int write_elf_file(const char *output_filename,
-                   const CodeBuffer *codeBuf,
-                   const DataBuffer *dataBuf,
-                   uint64_t entry_point)
+/* Program header types */
+#define PT_LOAD    1
+#define PT_DYNAMIC 2
+#define PT_INTERP  3
+
+/* Dynamic section tags */
+#define DT_NULL     0
+#define DT_NEEDED   1
+#define DT_HASH     4
+#define DT_STRTAB   5
+#define DT_SYMTAB   6
+#define DT_RELA     7
+#define DT_RELASZ   8
+#define DT_RELAENT  9
+#define DT_STRSZ    10
+#define DT_SYMENT   11
+#define DT_DEBUG    21
+#define DT_FLAGS    30
+#define DT_FLAGS_1  0x6ffffffb
+#define DF_BIND_NOW 0x8
+#define DF_1_NOW    0x1
+
+#define R_X86_64_GLOB_DAT 6
+
+static const char interpreter[] = "/lib64/ld-linux-x86-64.so.2";
+static const char needed_library[] = "libc.so.6";
+
+typedef struct {
+    uint8_t e_ident[16];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint64_t e_entry;
+    uint64_t e_phoff;
+    uint64_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} Elf64_Ehdr;
+
+typedef struct {
+    uint32_t p_type;
+    uint32_t p_flags;
+    uint64_t p_offset;
+    uint64_t p_vaddr;
+    uint64_t p_paddr;
+    uint64_t p_filesz;
+    uint64_t p_memsz;
+    uint64_t p_align;
+} Elf64_Phdr;
+
+typedef struct {
+    uint32_t st_name;
+    uint8_t st_info;
+    uint8_t st_other;
+    uint16_t st_shndx;
+    uint64_t st_value;
+    uint64_t st_size;
+} Elf64_Sym;
+
+typedef struct {
+    uint64_t r_offset;
+    uint64_t r_info;
+    int64_t r_addend;
+} Elf64_Rela;
+
+typedef struct {
+    int64_t d_tag;
+    uint64_t d_val;
+} Elf64_Dyn;
+
+static size_t align_to(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static Elf64_Phdr make_segment(uint32_t type,
+                               uint32_t flags,
+                               uint64_t offset,
+                               uint64_t vaddr,
+                               uint64_t size,
+                               uint64_t align)
+{
+    Elf64_Phdr ph = {0};
+    ph.p_type = type;
+    ph.p_flags = flags;
+    ph.p_offset = offset;
+    ph.p_vaddr = vaddr;
+    ph.p_paddr = vaddr;
+    ph.p_filesz = size;
+    ph.p_memsz = size;
+    ph.p_align = align;
+    return ph;
+}
+
+/* Everything the dynamic loader needs to bind the GOT of an executable that
+   imports functions from libc. It lives in its own read-write segment after
+   the image, so the layout of code and data does not change.
+*/
+typedef struct {
+    size_t interp; /* Offsets within the segment */
+    size_t dynsym;
+    size_t rela;
+    size_t hash;
+    size_t dynamic;
+    size_t dynstr;
+    size_t dynstr_size;
+    size_t dynamic_size;
+    size_t size;
+} DynamicLayout;
+
+static DynamicLayout layout_dynamic_segment(const LinkInfo *link)
+{
+    const size_t n = link->import_count;
+    DynamicLayout l = {0};
+
+    size_t dynstr_size = 1 + sizeof(needed_library);
+    for (size_t i = 0; i < n; i++)
+        dynstr_size += strlen(link->imports[i]) + 1;
+
+    l.interp = 0;
+    l.dynsym = align_to(sizeof(interpreter), 8);
+    l.rela = l.dynsym + (n + 1) * sizeof(Elf64_Sym);
+    l.hash = l.rela + n * sizeof(Elf64_Rela);
+    l.dynamic = align_to(l.hash + (3 + n + 1) * sizeof(uint32_t), 8);
+    l.dynamic_size = 13 * sizeof(Elf64_Dyn);
+    l.dynstr = l.dynamic + l.dynamic_size;
+    l.dynstr_size = dynstr_size;
+    l.size = l.dynstr + dynstr_size;
+    return l;
+}
+
+/* Fill in the dynamic segment at seg, which is loaded at seg_addr */
+static void build_dynamic_segment(uint8_t *seg,
+                                  const DynamicLayout *l,
+                                  uint64_t seg_addr,
+                                  uint64_t got_addr,
+                                  const LinkInfo *link)
+{
+    const size_t n = link->import_count;
+
+    memcpy(seg + l->interp, interpreter, sizeof(interpreter));
+
+    /* .dynstr: the needed library, then one name per import */
+    char *strtab = (char *)(seg + l->dynstr);
+    size_t str_pos = 1;
+    memcpy(strtab + str_pos, needed_library, sizeof(needed_library));
+    const size_t needed_name = str_pos;
+    str_pos += sizeof(needed_library);
+
+    for (size_t i = 0; i < n; i++) {
+        /* .dynsym: undefined global functions, index 0 is the null symbol */
+        Elf64_Sym sym = {0};
+        sym.st_name = (uint32_t)str_pos;
+        sym.st_info = (1 << 4) | 2; /* STB_GLOBAL, STT_FUNC */
+        memcpy(seg + l->dynsym + (i + 1) * sizeof(Elf64_Sym), &sym, sizeof(sym));
+
+        size_t len = strlen(link->imports[i]) + 1;
+        memcpy(strtab + str_pos, link->imports[i], len);
+        str_pos += len;
+
+        /* .rela.dyn: the loader stores the address of import i in GOT slot i */
+        Elf64_Rela rela = {0};
+        rela.r_offset = got_addr + 8 * i;
+        rela.r_info = ((uint64_t)(i + 1) << 32) | R_X86_64_GLOB_DAT;
+        memcpy(seg + l->rela + i * sizeof(Elf64_Rela), &rela, sizeof(rela));
+    }
+
+    /* .hash with a single bucket chaining every symbol */
+    uint32_t *hash = (uint32_t *)(seg + l->hash);
+    hash[0] = 1;               /* nbucket */
+    hash[1] = (uint32_t)n + 1; /* nchain */
+    hash[2] = n > 0 ? 1 : 0;   /* bucket[0] */
+    for (size_t i = 0; i <= n; i++)
+        hash[3 + i] = (i > 0 && i < n) ? (uint32_t)i + 1 : 0;
+
+    const Elf64_Dyn dynamic[] = {
+        {DT_NEEDED, needed_name},
+        {DT_HASH, seg_addr + l->hash},
+        {DT_STRTAB, seg_addr + l->dynstr},
+        {DT_SYMTAB, seg_addr + l->dynsym},
+        {DT_STRSZ, l->dynstr_size},
+        {DT_SYMENT, sizeof(Elf64_Sym)},
+        {DT_RELA, seg_addr + l->rela},
+        {DT_RELASZ, n * sizeof(Elf64_Rela)},
+        {DT_RELAENT, sizeof(Elf64_Rela)},
+        {DT_FLAGS, DF_BIND_NOW},
+        {DT_FLAGS_1, DF_1_NOW},
+        {DT_DEBUG, 0},
+        {DT_NULL, 0},
+    };
+    memcpy(seg + l->dynamic, dynamic, sizeof(dynamic));
+}
+
+/* Build the ELF executable image in memory. When the program imports
+   functions it becomes a dynamically linked executable: PT_INTERP names the
+   dynamic loader, and PT_DYNAMIC asks it to load libc and fill the GOT
+   before jumping to the entry point. Returns NULL on allocation failure.
+*/
+static uint8_t *build_elf_image(const CodeBuffer *codeBuf,
+                                const DataBuffer *dataBuf,
+                                uint64_t entry_point,
+                                const LinkInfo *link,
+                                size_t *size)
 {
-    const size_t file_size = CODE_OFFSET + codeBuf->size + dataBuf->size;
+    const int dynamic = link && link->import_count > 0;
+    const size_t code_offset = dynamic ? DYNAMIC_CODE_OFFSET : CODE_OFFSET;
+    const size_t image_size = code_offset + codeBuf->size + dataBuf->size;
+
+    /* The dynamic segment starts on the first page after the image and .bss,
+       at the same page offset as in the file */
+    DynamicLayout dyn = {0};
+    size_t dyn_offset = image_size;
+    uint64_t dyn_addr = 0;
+    if (dynamic) {
+        dyn = layout_dynamic_segment(link);
+        dyn_offset = align_to(image_size, 8);
+        dyn_addr = align_to(BASE_ADDR + image_size + dataBuf->bss_size, PAGE_SIZE) +
+                   dyn_offset % PAGE_SIZE;
+    }
+
+    const size_t file_size = dyn_offset + dyn.size;
     uint8_t *file_buf = calloc(1, file_size);
     if (!file_buf) {
         perror("calloc");
-        return 1;
+        return NULL;
     }
     uint8_t *p = file_buf;
 
     /* Construct ELF header */
-    typedef struct {
-        uint8_t e_ident[16];
-        uint16_t e_type;
-        uint16_t e_machine;
-        uint32_t e_version;
-        uint64_t e_entry;
-        uint64_t e_phoff;
-        uint64_t e_shoff;
-        uint32_t e_flags;
-        uint16_t e_ehsize;
-        uint16_t e_phentsize;
-        uint16_t e_phnum;
-        uint16_t e_shentsize;
-        uint16_t e_shnum;
-        uint16_t e_shstrndx;
-    } Elf64_Ehdr;
-
     Elf64_Ehdr eh = {0};
     memcpy(eh.e_ident, "\177ELF\2\1\1\0", 8);
     eh.e_type = 2;       /* EXEC */
@@ -53,39 +262,73 @@ int write_elf_file(const char *output_filename,
     eh.e_flags = 0;
     eh.e_ehsize = ELF_HEADER_SIZE;
     eh.e_phentsize = PROGRAM_HEADER_SIZE;
-    eh.e_phnum = 1;
+    eh.e_phnum = dynamic ? 4 : 1;
     memcpy(p, &eh, ELF_HEADER_SIZE);
 
     p = file_buf + ELF_HEADER_SIZE;
 
-    /* Construct Program Header */
-    typedef struct {
-        uint32_t p_type;
-        uint32_t p_flags;
-        uint64_t p_offset;
-        uint64_t p_vaddr;
-        uint64_t p_paddr;
-        uint64_t p_filesz;
-        uint64_t p_memsz;
-        uint64_t p_align;
-    } Elf64_Phdr;
-
+    /* Construct Program Headers: PT_INTERP has to come before the loadable
+       segments, which have to be sorted by address */
     Elf64_Phdr ph = {0};
-    ph.p_type = 1;                           /* PT_LOAD */
-    ph.p_flags = 7; /* PF_R | PF_W | PF_X */ /* Make segment readable, writable
-                                                and executable */
-    ph.p_offset = 0;
-    ph.p_vaddr = BASE_ADDR;
-    ph.p_paddr = BASE_ADDR;
-    ph.p_filesz = file_size;
-    ph.p_memsz = file_size;
-    ph.p_align = 0x1000;
+    if (dynamic) {
+        ph = make_segment(PT_INTERP,
+                          4, /* PF_R */
+                          dyn_offset + dyn.interp,
+                          dyn_addr + dyn.interp,
+                          sizeof(interpreter),
+                          1);
+        memcpy(p, &ph, PROGRAM_HEADER_SIZE);
+        p += PROGRAM_HEADER_SIZE;
+    }
+
+    ph = make_segment(PT_LOAD,
+                      7, /* PF_R | PF_W | PF_X */ /* Make segment readable, writable
+                                                     and executable */
+                      0,
+                      BASE_ADDR,
+                      image_size,
+                      PAGE_SIZE);
+    ph.p_memsz = image_size + dataBuf->bss_size; /* .bss is zero-filled by the loader */
     memcpy(p, &ph, PROGRAM_HEADER_SIZE);
+    p += PROGRAM_HEADER_SIZE;
+
+    if (dynamic) {
+        ph = make_segment(PT_LOAD, 6, dyn_offset, dyn_addr, dyn.size, PAGE_SIZE); /* PF_R | PF_W */
+        memcpy(p, &ph, PROGRAM_HEADER_SIZE);
+        p += PROGRAM_HEADER_SIZE;
+
+        ph = make_segment(PT_DYNAMIC,
+                          6, /* PF_R | PF_W */
+                          dyn_offset + dyn.dynamic,
+                          dyn_addr + dyn.dynamic,
+                          dyn.dynamic_size,
+                          8);
+        memcpy(p, &ph, PROGRAM_HEADER_SIZE);
+
+        const uint64_t got_addr = BASE_ADDR + code_offset + codeBuf->size + link->got_offset;
+        build_dynamic_segment(file_buf + dyn_offset, &dyn, dyn_addr, got_addr, link);
+    }
 
     /* Copy code section */
-    memcpy(file_buf + CODE_OFFSET, codeBuf->bytes, codeBuf->size);
+    memcpy(file_buf + code_offset, codeBuf->bytes, codeBuf->size);
     /* Append data section */
-    memcpy(file_buf + CODE_OFFSET + codeBuf->size, dataBuf->bytes, dataBuf->size);
+    memcpy(file_buf + code_offset + codeBuf->size, dataBuf->bytes, dataBuf->size);
+
+    *size = file_size;
+    return file_buf;
+}
+
+/* Write the assembled code and data as an ELF executable file */
+int write_elf_file(const char *output_filename,
+                   const CodeBuffer *codeBuf,
+                   const DataBuffer *dataBuf,
+                   uint64_t entry_point,
+                   const LinkInfo *link)
+{
+    size_t file_size = 0;
+    uint8_t *file_buf = build_elf_image(codeBuf, dataBuf, entry_point, link, &file_size);
+    if (!file_buf)
+        return 1;
 
     FILE *out = fopen(output_filename, "wb");
     if (!out) {
@@ -112,3 +355,49 @@ int write_elf_file(const char *output_filename,
 
     return 0;
 }
+
+/* Execute the assembled program without writing it to disk: the ELF image
+   goes into an anonymous memory file that is handed to fexecve. Only
+   returns if something went wrong.
+*/
+int run_elf_image(const CodeBuffer *codeBuf,
+                  const DataBuffer *dataBuf,
+                  uint64_t entry_point,
+                  const LinkInfo *link,
+                  char *const argv[])
+{
+    size_t file_size = 0;
+    uint8_t *file_buf = build_elf_image(codeBuf, dataBuf, entry_point, link, &file_size);
+    if (!file_buf)
+        return 1;
+
+    /* Close-on-exec keeps the descriptor out of the program's fd table */
+    int fd = memfd_create("jasm", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("memfd_create");
+        free(file_buf);
+        return 1;
+    }
+
+    size_t written = 0;
+    while (written < file_size) {
+        ssize_t n = write(fd, file_buf + written, file_size - written);
+        if (n < 0) {
+            perror("write");
+            close(fd);
+            free(file_buf);
+            return 1;
+        }
+        written += (size_t)n;
+    }
+    free(file_buf);
+
+    /* Anything still buffered would be lost by the exec */
+    fflush(stdout);
+    fflush(stderr);
+    fexecve(fd, argv, environ);
+
+    perror("fexecve");
+    close(fd);
+    return 1;
+}
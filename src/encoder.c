@@ -0,0 +1,101 @@
+#include "encoder.h"
+#include <string.h>
+
+/* Append a single byte, growing the buffer as needed */
+void encode_byte(CodeBuffer *buf, uint8_t byte)
+{
+    ensure_buffer_capacity(buf, 1);
+    buf->bytes[buf->size++] = byte;
+}
+
+/* Append the low `size` bytes of value, little-endian */
+void encode_imm(CodeBuffer *buf, uint64_t value, size_t size)
+{
+    ensure_buffer_capacity(buf, size);
+    for (size_t i = 0; i < size; i++)
+        buf->bytes[buf->size++] = (uint8_t)((value >> (8 * i)) & 0xff);
+}
+
+/* Append a REX prefix (0100WRXB) if any of its bits is needed */
+void encode_rex(CodeBuffer *buf, int w, uint8_t reg, uint8_t index, uint8_t base)
+{
+    encode_rex_forced(buf, 0, w, reg, index, base);
+}
+
+/* Append a REX prefix if any of its bits is needed or `force` is set */
+void encode_rex_forced(
+    CodeBuffer *buf, int force, int w, uint8_t reg, uint8_t index, uint8_t base)
+{
+    uint8_t rex = 0x40;
+    if (w)
+        rex |= 0x08; /* REX.W: 64-bit operand size */
+    if (reg & 8)
+        rex |= 0x04; /* REX.R: extends ModR/M reg */
+    if (index & 8)
+        rex |= 0x02; /* REX.X: extends SIB index */
+    if (base & 8)
+        rex |= 0x01; /* REX.B: extends ModR/M rm or SIB base */
+    if (rex != 0x40 || force)
+        encode_byte(buf, rex);
+}
+
+/* Append a two-byte (C5) or three-byte (C4) VEX prefix. R, X, B and vvvv
+   are stored inverted. */
+void encode_vex(CodeBuffer *buf,
+                uint8_t prefix,
+                uint8_t map,
+                int w,
+                int l,
+                uint8_t reg,
+                uint8_t vvvv,
+                uint8_t index,
+                uint8_t base)
+{
+    const uint8_t pp = prefix == 0x66 ? 1 : prefix == 0xF3 ? 2 : prefix == 0xF2 ? 3 : 0;
+    const uint8_t last = (uint8_t)((w ? 0x80 : 0) | ((~vvvv & 15) << 3) | (l ? 0x04 : 0) | pp);
+    const uint8_t r = reg & 8 ? 0 : 0x80;
+
+    if (map == 1 && !w && !(index & 8) && !(base & 8)) {
+        encode_byte(buf, 0xC5);
+        encode_byte(buf, (uint8_t)(r | (last & 0x7F)));
+        return;
+    }
+    encode_byte(buf, 0xC4);
+    encode_byte(buf, (uint8_t)(r | (index & 8 ? 0 : 0x40) | (base & 8 ? 0 : 0x20) | map));
+    encode_byte(buf, last);
+}
+
+/* Append [REX] opcode ModR/M with both operands in registers */
+void encode_reg_reg(
+    CodeBuffer *buf, int w, const uint8_t *opcode, size_t opcode_len, uint8_t reg, uint8_t rm)
+{
+    encode_rex(buf, w, reg, 0, rm);
+    for (size_t i = 0; i < opcode_len; i++)
+        encode_byte(buf, opcode[i]);
+    encode_byte(buf, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* Pad with the recommended multi-byte NOPs (0F 1F /0 forms), longest first,
+   so that the padding decodes as few instructions as possible */
+void encode_nops(CodeBuffer *buf, size_t count)
+{
+    static const uint8_t nops[9][9] = {
+        {0x90},
+        {0x66, 0x90},
+        {0x0F, 0x1F, 0x00},
+        {0x0F, 0x1F, 0x40, 0x00},
+        {0x0F, 0x1F, 0x44, 0x00, 0x00},
+        {0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00},
+        {0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00},
+        {0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+        {0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    };
+
+    ensure_buffer_capacity(buf, count);
+    while (count > 0) {
+        size_t n = count > 9 ? 9 : count;
+        memcpy(buf->bytes + buf->size, nops[n - 1], n);
+        buf->size += n;
+        count -= n;
+    }
+}
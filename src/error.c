@@ -1,4 +1,5 @@
 #include "error.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,6 +8,9 @@
 static int error_count = 0;
 static int fatal_error_count = 0;
 
+// Modules are assembled on several threads, keep their reports from interleaving
+static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void error_init(void)
 {
     error_count = 0;
@@ -55,6 +59,7 @@ void error_report(const char *filename,
 {
     va_list args;
     va_start(args, format);
+    pthread_mutex_lock(&error_lock);
 
     // Update error counts
     if (severity == ERROR_SEVERITY_FATAL) {
@@ -89,6 +94,7 @@ void error_report(const char *filename,
         }
     }
 
+    pthread_mutex_unlock(&error_lock);
     va_end(args);
 }
 
@@ -96,6 +102,7 @@ void error_report_simple(ErrorSeverity severity, const char *format, ...)
 {
     va_list args;
     va_start(args, format);
+    pthread_mutex_lock(&error_lock);
 
     // Update error counts
     if (severity == ERROR_SEVERITY_FATAL) {
@@ -113,6 +120,7 @@ void error_report_simple(ErrorSeverity severity, const char *format, ...)
     vprintf(format, args);
     printf("\n");
 
+    pthread_mutex_unlock(&error_lock);
     va_end(args);
 }
 
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include "assembler.h"
 #include "binary_writer.h"
@@ -9,9 +10,15 @@
 
 int main(const int argc, char **argv)
 {
-    const char *input_file = NULL;
+    const char **input_files = calloc(argc, sizeof(const char *));
+    size_t input_count = 0;
     const char *output_file = NULL;
     int verbose = 0;
+    int run = 0;
+    char **program_args = NULL;
+    int program_argc = 0;
+    size_t loop_align = 0;
+    const char *march = NULL;
     OutputFormat output_format = FORMAT_ELF;
 
     /* Initialize color utilities */
@@ -24,10 +31,27 @@ int main(const int argc, char **argv)
     error_init();
 
     /* Process command line arguments */
-    int result = process_arguments(argc, argv, &input_file, &output_file, &output_format, &verbose);
-    if (result != 0)
+    if (!input_files) {
+        perror("calloc");
+        return 1;
+    }
+    int result = process_arguments(argc,
+                                   argv,
+                                   input_files,
+                                   &input_count,
+                                   &output_file,
+                                   &output_format,
+                                   &verbose,
+                                   &run,
+                                   &program_args,
+                                   &program_argc,
+                                   &loop_align,
+                                   &march);
+    if (result != 0) {
+        free(input_files);
         /* -1 indicates help/version was shown, exit with success */
         return result < 0 ? 0 : result;
+    }
 
     /* If no output file was specified, use the default */
     if (!output_file) {
@@ -35,22 +59,49 @@ int main(const int argc, char **argv)
         output_file = DEFAULT_OUTPUT;
     }
 
+    /* Pick the writer for the requested format */
+    binary_writer_fn writer = write_binary_file;
+    if (output_format == FORMAT_ELF)
+        writer = write_elf_file;
+    else if (output_format == FORMAT_OBJECT)
+        writer = write_object_file;
+
+    /* With --run the program is named after its first source file */
+    char **run_argv = NULL;
+    if (run) {
+        run_argv = calloc(program_argc + 2, sizeof(char *));
+        if (!run_argv) {
+            perror("calloc");
+            free(input_files);
+            return 1;
+        }
+        run_argv[0] = (char *)input_files[0];
+        for (int i = 0; i < program_argc; i++)
+            run_argv[i + 1] = program_args[i];
+    }
+
     /* Set up the assembler options */
-    const AssemblerOptions options = {
-        .input_filename = input_file,
-        .output_filename = output_file,
-        .writer = (output_format == FORMAT_ELF) ? write_elf_file : write_binary_file,
-        .verbose = verbose};
+    const AssemblerOptions options = {.input_filenames = input_files,
+                                      .input_count = input_count,
+                                      .output_filename = output_file,
+                                      .writer = writer,
+                                      .verbose = verbose,
+                                      .relocatable = output_format == FORMAT_OBJECT,
+                                      .run_argv = run_argv,
+                                      .loop_align = loop_align,
+                                      .march = march};
 
     /* Print a welcome banner if verbose */
-    if (verbose)
-        print_assembly_info(input_file, output_file, output_format);
+    if (verbose && !run)
+        print_assembly_info(input_files, input_count, output_file, output_format);
 
-    /* Assemble the file */
+    /* Assemble the file; with --run this only returns on failure */
     result = assemble(&options);
+    free(run_argv);
 
     /* Check for errors */
     if (error_has_errors()) {
+        free(input_files);
         if (error_has_fatal_errors()) {
             color_error("Assembly failed due to fatal errors");
             return 1;
@@ -63,9 +114,14 @@ int main(const int argc, char **argv)
     if (result == 0 && output_format == FORMAT_ELF) {
         chmod(output_file, 0755);
 
-        if (!options.verbose)
-            color_success("Assembled '%s' to '%s'", input_file, output_file);
+        if (!options.verbose) {
+            if (input_count == 1)
+                color_success("Assembled '%s' to '%s'", input_files[0], output_file);
+            else
+                color_success("Assembled %zu modules to '%s'", input_count, output_file);
+        }
     }
 
+    free(input_files);
     return result;
 }
\ No newline at end of file
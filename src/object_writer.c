@@ -0,0 +1,320 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "binary_writer.h"
+
+/* ELF relocatable object related constants. */
+#define ELF_HEADER_SIZE     64
+#define SECTION_HEADER_SIZE 64
+#define SYMBOL_ENTRY_SIZE   24
+#define RELA_ENTRY_SIZE     24
+
+/* Section header indices, in the order the sections are written */
+enum {
+    SHN_NULL_IDX,
+    SHN_TEXT_IDX,
+    SHN_DATA_IDX,
+    SHN_BSS_IDX,
+    SHN_SYMTAB_IDX,
+    SHN_STRTAB_IDX,
+    SHN_RELA_TEXT_IDX,
+    SHN_RELA_DATA_IDX,
+    SHN_NOTE_GNU_STACK_IDX,
+    SHN_SHSTRTAB_IDX,
+    SHN_COUNT
+};
+
+/* Names of the sections above, concatenated for .shstrtab */
+static const char shstrtab[] = "\0.text\0.data\0.bss\0.symtab\0.strtab\0.rela.text\0.rela.data"
+                               "\0.note.GNU-stack\0.shstrtab";
+
+typedef struct {
+    uint8_t e_ident[16];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint64_t e_entry;
+    uint64_t e_phoff;
+    uint64_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} Elf64_Ehdr;
+
+typedef struct {
+    uint32_t sh_name;
+    uint32_t sh_type;
+    uint64_t sh_flags;
+    uint64_t sh_addr;
+    uint64_t sh_offset;
+    uint64_t sh_size;
+    uint32_t sh_link;
+    uint32_t sh_info;
+    uint64_t sh_addralign;
+    uint64_t sh_entsize;
+} Elf64_Shdr;
+
+typedef struct {
+    uint32_t st_name;
+    uint8_t st_info;
+    uint8_t st_other;
+    uint16_t st_shndx;
+    uint64_t st_value;
+    uint64_t st_size;
+} Elf64_Sym;
+
+typedef struct {
+    uint64_t r_offset;
+    uint64_t r_info;
+    int64_t r_addend;
+} Elf64_Rela;
+
+/* Offset of a section name inside shstrtab */
+static uint32_t shstrtab_offset(const char *name)
+{
+    for (size_t i = 0; i < sizeof(shstrtab); i += strlen(shstrtab + i) + 1) {
+        if (strcmp(shstrtab + i, name) == 0)
+            return (uint32_t)i;
+    }
+    return 0;
+}
+
+static uint16_t section_index(SectionType section)
+{
+    switch (section) {
+        case SECTION_TEXT:
+            return SHN_TEXT_IDX;
+        case SECTION_DATA:
+            return SHN_DATA_IDX;
+        case SECTION_BSS:
+            return SHN_BSS_IDX;
+        default:
+            return 0; /* SHN_UNDEF */
+    }
+}
+
+static size_t align_up(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+/* Write the assembled code and data as an ELF relocatable object (ET_REL).
+   Code goes to .text, initialised data to .data and zero-initialised buffers
+   to .bss. References that the assembler could not resolve are emitted as
+   .rela.text entries, and addresses stored in data (jump tables) as
+   .rela.data entries, so the object can be linked with ld or a C compiler.
+   An empty .note.GNU-stack tells the linker the stack need not be
+   executable.
+*/
+int write_object_file(const char *output_filename,
+                      const CodeBuffer *codeBuf,
+                      const DataBuffer *dataBuf,
+                      uint64_t entry_point,
+                      const LinkInfo *link)
+{
+    (void)entry_point;
+
+    /* Symbol table layout: null symbol, one section symbol per allocated
+       section, all local symbols, then all global symbols. ELF requires the
+       locals to come first. */
+    const size_t section_symbols = 3;
+    size_t sym_count = 1 + section_symbols + link->symbol_count;
+    size_t *sym_index = calloc(link->symbol_count ? link->symbol_count : 1, sizeof(size_t));
+    if (!sym_index) {
+        perror("calloc");
+        return 1;
+    }
+
+    size_t next = 1 + section_symbols;
+    for (size_t i = 0; i < link->symbol_count; i++) {
+        if (!link->symbols[i].global)
+            sym_index[i] = next++;
+    }
+    const size_t first_global = next;
+    size_t strtab_size = 1;
+    for (size_t i = 0; i < link->symbol_count; i++) {
+        if (link->symbols[i].global)
+            sym_index[i] = next++;
+        strtab_size += strlen(link->symbols[i].name) + 1;
+    }
+
+    /* File layout */
+    const size_t text_off = ELF_HEADER_SIZE;
+    const size_t data_off = align_up(text_off + codeBuf->size, 8);
+    const size_t symtab_off = align_up(data_off + dataBuf->size, 8);
+    const size_t symtab_size = sym_count * SYMBOL_ENTRY_SIZE;
+    const size_t strtab_off = symtab_off + symtab_size;
+    size_t data_relocations = 0;
+    for (size_t i = 0; i < link->relocation_count; i++)
+        data_relocations += link->relocations[i].section == SECTION_DATA;
+    const size_t rela_off = align_up(strtab_off + strtab_size, 8);
+    const size_t rela_size = (link->relocation_count - data_relocations) * RELA_ENTRY_SIZE;
+    const size_t rela_data_off = rela_off + rela_size;
+    const size_t rela_data_size = data_relocations * RELA_ENTRY_SIZE;
+    const size_t shstrtab_off = rela_data_off + rela_data_size;
+    const size_t shdr_off = align_up(shstrtab_off + sizeof(shstrtab), 8);
+    const size_t file_size = shdr_off + SHN_COUNT * SECTION_HEADER_SIZE;
+
+    uint8_t *file_buf = calloc(1, file_size);
+    if (!file_buf) {
+        perror("calloc");
+        free(sym_index);
+        return 1;
+    }
+
+    /* ELF header */
+    Elf64_Ehdr eh = {0};
+    memcpy(eh.e_ident, "\177ELF\2\1\1\0", 8);
+    eh.e_type = 1;       /* REL */
+    eh.e_machine = 0x3E; /* AMD x86-64 */
+    eh.e_version = 1;
+    eh.e_shoff = shdr_off;
+    eh.e_ehsize = ELF_HEADER_SIZE;
+    eh.e_shentsize = SECTION_HEADER_SIZE;
+    eh.e_shnum = SHN_COUNT;
+    eh.e_shstrndx = SHN_SHSTRTAB_IDX;
+    memcpy(file_buf, &eh, ELF_HEADER_SIZE);
+
+    /* Section contents */
+    memcpy(file_buf + text_off, codeBuf->bytes, codeBuf->size);
+    memcpy(file_buf + data_off, dataBuf->bytes, dataBuf->size);
+
+    /* Symbols and their names */
+    Elf64_Sym *syms = (Elf64_Sym *)(file_buf + symtab_off);
+    char *strtab = (char *)(file_buf + strtab_off);
+    size_t str_pos = 1;
+    for (size_t i = 0; i < section_symbols; i++) {
+        syms[1 + i].st_info = 3; /* STB_LOCAL, STT_SECTION */
+        syms[1 + i].st_shndx = SHN_TEXT_IDX + i;
+    }
+    for (size_t i = 0; i < link->symbol_count; i++) {
+        const LinkSymbol *s = &link->symbols[i];
+        Elf64_Sym *sym = &syms[sym_index[i]];
+        size_t len = strlen(s->name) + 1;
+        memcpy(strtab + str_pos, s->name, len);
+        sym->st_name = (uint32_t)str_pos;
+        str_pos += len;
+
+        /* STT_FUNC for code, STT_OBJECT for data, STT_NOTYPE if undefined */
+        uint8_t type = s->section == SECTION_TEXT ? 2 : s->section == SECTION_UNDEF ? 0 : 1;
+        sym->st_info = (uint8_t)(((s->global ? 1 : 0) << 4) | type);
+        sym->st_shndx = section_index(s->section);
+        sym->st_value = s->offset;
+    }
+
+    /* Relocations against .text, then against .data */
+    Elf64_Rela *relas = (Elf64_Rela *)(file_buf + rela_off);
+    Elf64_Rela *data_relas = (Elf64_Rela *)(file_buf + rela_data_off);
+    for (size_t i = 0; i < link->relocation_count; i++) {
+        const Relocation *r = &link->relocations[i];
+        Elf64_Rela *rela = r->section == SECTION_DATA ? data_relas++ : relas++;
+        rela->r_offset = r->offset;
+        rela->r_info = ((uint64_t)sym_index[r->symbol] << 32) | r->type;
+        rela->r_addend = r->addend;
+    }
+
+    memcpy(file_buf + shstrtab_off, shstrtab, sizeof(shstrtab));
+
+    /* Section headers */
+    Elf64_Shdr *sh = (Elf64_Shdr *)(file_buf + shdr_off);
+
+    sh[SHN_TEXT_IDX].sh_name = shstrtab_offset(".text");
+    sh[SHN_TEXT_IDX].sh_type = 1;     /* PROGBITS */
+    sh[SHN_TEXT_IDX].sh_flags = 0x6;  /* ALLOC | EXECINSTR */
+    sh[SHN_TEXT_IDX].sh_offset = text_off;
+    sh[SHN_TEXT_IDX].sh_size = codeBuf->size;
+    sh[SHN_TEXT_IDX].sh_addralign = link->text_align > 16 ? link->text_align : 16;
+
+    sh[SHN_DATA_IDX].sh_name = shstrtab_offset(".data");
+    sh[SHN_DATA_IDX].sh_type = 1;    /* PROGBITS */
+    sh[SHN_DATA_IDX].sh_flags = 0x3; /* WRITE | ALLOC */
+    sh[SHN_DATA_IDX].sh_offset = data_off;
+    sh[SHN_DATA_IDX].sh_size = dataBuf->size;
+    sh[SHN_DATA_IDX].sh_addralign = 8;
+
+    sh[SHN_BSS_IDX].sh_name = shstrtab_offset(".bss");
+    sh[SHN_BSS_IDX].sh_type = 8;    /* NOBITS */
+    sh[SHN_BSS_IDX].sh_flags = 0x3; /* WRITE | ALLOC */
+    sh[SHN_BSS_IDX].sh_offset = symtab_off;
+    sh[SHN_BSS_IDX].sh_size = dataBuf->bss_size;
+    sh[SHN_BSS_IDX].sh_addralign = 8;
+
+    sh[SHN_SYMTAB_IDX].sh_name = shstrtab_offset(".symtab");
+    sh[SHN_SYMTAB_IDX].sh_type = 2; /* SYMTAB */
+    sh[SHN_SYMTAB_IDX].sh_offset = symtab_off;
+    sh[SHN_SYMTAB_IDX].sh_size = symtab_size;
+    sh[SHN_SYMTAB_IDX].sh_link = SHN_STRTAB_IDX;
+    sh[SHN_SYMTAB_IDX].sh_info = (uint32_t)first_global;
+    sh[SHN_SYMTAB_IDX].sh_addralign = 8;
+    sh[SHN_SYMTAB_IDX].sh_entsize = SYMBOL_ENTRY_SIZE;
+
+    sh[SHN_STRTAB_IDX].sh_name = shstrtab_offset(".strtab");
+    sh[SHN_STRTAB_IDX].sh_type = 3; /* STRTAB */
+    sh[SHN_STRTAB_IDX].sh_offset = strtab_off;
+    sh[SHN_STRTAB_IDX].sh_size = strtab_size;
+    sh[SHN_STRTAB_IDX].sh_addralign = 1;
+
+    sh[SHN_RELA_TEXT_IDX].sh_name = shstrtab_offset(".rela.text");
+    sh[SHN_RELA_TEXT_IDX].sh_type = 4;     /* RELA */
+    sh[SHN_RELA_TEXT_IDX].sh_flags = 0x40; /* INFO_LINK */
+    sh[SHN_RELA_TEXT_IDX].sh_offset = rela_off;
+    sh[SHN_RELA_TEXT_IDX].sh_size = rela_size;
+    sh[SHN_RELA_TEXT_IDX].sh_link = SHN_SYMTAB_IDX;
+    sh[SHN_RELA_TEXT_IDX].sh_info = SHN_TEXT_IDX;
+    sh[SHN_RELA_TEXT_IDX].sh_addralign = 8;
+    sh[SHN_RELA_TEXT_IDX].sh_entsize = RELA_ENTRY_SIZE;
+
+    sh[SHN_RELA_DATA_IDX].sh_name = shstrtab_offset(".rela.data");
+    sh[SHN_RELA_DATA_IDX].sh_type = 4;     /* RELA */
+    sh[SHN_RELA_DATA_IDX].sh_flags = 0x40; /* INFO_LINK */
+    sh[SHN_RELA_DATA_IDX].sh_offset = rela_data_off;
+    sh[SHN_RELA_DATA_IDX].sh_size = rela_data_size;
+    sh[SHN_RELA_DATA_IDX].sh_link = SHN_SYMTAB_IDX;
+    sh[SHN_RELA_DATA_IDX].sh_info = SHN_DATA_IDX;
+    sh[SHN_RELA_DATA_IDX].sh_addralign = 8;
+    sh[SHN_RELA_DATA_IDX].sh_entsize = RELA_ENTRY_SIZE;
+
+    /* Empty and without SHF_EXECINSTR: the code needs no executable stack */
+    sh[SHN_NOTE_GNU_STACK_IDX].sh_name = shstrtab_offset(".note.GNU-stack");
+    sh[SHN_NOTE_GNU_STACK_IDX].sh_type = 1; /* PROGBITS */
+    sh[SHN_NOTE_GNU_STACK_IDX].sh_offset = shstrtab_off;
+    sh[SHN_NOTE_GNU_STACK_IDX].sh_addralign = 1;
+
+    sh[SHN_SHSTRTAB_IDX].sh_name = shstrtab_offset(".shstrtab");
+    sh[SHN_SHSTRTAB_IDX].sh_type = 3; /* STRTAB */
+    sh[SHN_SHSTRTAB_IDX].sh_offset = shstrtab_off;
+    sh[SHN_SHSTRTAB_IDX].sh_size = sizeof(shstrtab);
+    sh[SHN_SHSTRTAB_IDX].sh_addralign = 1;
+
+    free(sym_index);
+
+    FILE *out = fopen(output_filename, "wb");
+    if (!out) {
+        perror("fopen");
+        free(file_buf);
+        return 1;
+    }
+
+    if (fwrite(file_buf, 1, file_size, out) != file_size) {
+        perror("fwrite");
+        fclose(out);
+        free(file_buf);
+        return 1;
+    }
+
+    fclose(out);
+    free(file_buf);
+
+    printf("Assembled %zu bytes of machine code and %zu bytes of data into ELF "
+           "object: %s\n",
+           codeBuf->size,
+           dataBuf->size,
+           output_filename);
+
+    return 0;
+}
@@ -10,16 +10,24 @@
 int write_binary_file(const char *output_filename,
                       const CodeBuffer *codeBuf,
                       const DataBuffer *dataBuf,
-                      const uint64_t entry_point)
+                      const uint64_t entry_point,
+                      const LinkInfo *link)
 {
     (void)entry_point;
 
+    /* Without a loader nobody could fill in the GOT */
+    if (link && link->import_count > 0) {
+        fprintf(stderr, "Error: extern functions require ELF output\n");
+        return 1;
+    }
+
     /* For raw binary format, we just write the code and data sections
-     * consecutively */
-    size_t total_size = codeBuf->size + dataBuf->size;
-    uint8_t *combined_buffer = malloc(total_size);
+     * consecutively. There is no loader to provide .bss, so it is written
+     * out as zeros. */
+    size_t total_size = codeBuf->size + dataBuf->size + dataBuf->bss_size;
+    uint8_t *combined_buffer = calloc(1, total_size);
     if (!combined_buffer) {
-        perror("malloc for combined buffer");
+        perror("calloc for combined buffer");
         return 1;
     }
 
@@ -1,4 +1,5 @@
 #include "syntax.h"
+#include <cpuid.h>
 #include <ctype.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -10,6 +11,17 @@ char syntax_comment_char = '#';
 const char *syntax_data_keyword = "data";
 const char *syntax_size_keyword = "size";
 const char *syntax_file_keyword = "file";
+const char *syntax_f32_keyword = "f32";
+const char *syntax_f64_keyword = "f64";
+const char *syntax_jumptable_keyword = "jumptable";
+const char *syntax_global_keyword = "global";
+const char *syntax_extern_keyword = "extern";
+const char *syntax_align_keyword = "align";
+const char *syntax_proc_keyword = "proc";
+const char *syntax_endp_keyword = "endp";
+const char *syntax_ifcpu_keyword = "ifcpu";
+const char *syntax_else_keyword = "else";
+const char *syntax_endif_keyword = "endif";
 const char *syntax_label_suffix = ":";
 
 /* Static lookup tables for instructions and registers */
@@ -27,13 +39,11 @@ typedef struct {
 static InstructionEntry instructions[] = {{"mov", INSTR_MOVE},
                                           {"call", INSTR_CALL},
                                           {"jmp", INSTR_JUMP},
-                                          {"jmplt", INSTR_JUMPLT},
-                                          {"jmpgt", INSTR_JUMPGT},
-                                          {"jmpeq", INSTR_JUMPEQ},
                                           {"cmp", INSTR_COMP},
                                           {"add", INSTR_ADD},
                                           {"sub", INSTR_SUB},
                                           {"mul", INSTR_MUL},
+                                          {"imul", INSTR_MUL},
                                           {"div", INSTR_DIV},
                                           {"mod", INSTR_MOD},
                                           {"and", INSTR_AND},
@@ -42,18 +52,522 @@ static InstructionEntry instructions[] = {{"mov", INSTR_MOVE},
                                           {"not", INSTR_NOT},
                                           {"shl", INSTR_SHL},
                                           {"shr", INSTR_SHR},
+                                          {"sal", INSTR_SHL},
+                                          {"sar", INSTR_SAR},
+                                          {"rol", INSTR_ROL},
+                                          {"ror", INSTR_ROR},
+                                          {"rcl", INSTR_RCL},
+                                          {"rcr", INSTR_RCR},
+                                          {"ret", INSTR_RET},
+                                          {"lea", INSTR_LEA},
+                                          {"inc", INSTR_INC},
+                                          {"dec", INSTR_DEC},
+                                          {"neg", INSTR_NEG},
+                                          {"test", INSTR_TEST},
+                                          {"movzx", INSTR_MOVZX},
+                                          {"movsx", INSTR_MOVSX},
+                                          {"movsxd", INSTR_MOVSX},
+                                          {"rep", INSTR_REP},
+                                          {"repe", INSTR_REP},
+                                          {"repz", INSTR_REP},
+                                          {"repne", INSTR_REP},
+                                          {"repnz", INSTR_REP},
+                                          {"cld", INSTR_CLD},
+                                          {"std", INSTR_STD},
+                                          {"popcnt", INSTR_POPCNT},
+                                          {"lzcnt", INSTR_LZCNT},
+                                          {"tzcnt", INSTR_TZCNT},
+                                          {"bsf", INSTR_BSF},
+                                          {"bsr", INSTR_BSR},
+                                          {"bswap", INSTR_BSWAP},
+                                          {"movbe", INSTR_MOVBE},
+                                          {"lock", INSTR_LOCK},
+                                          {"xchg", INSTR_XCHG},
+                                          {"xadd", INSTR_XADD},
+                                          {"cmpxchg", INSTR_CMPXCHG},
+                                          {"cmpxchg8b", INSTR_CMPXCHG8B},
+                                          {"cmpxchg16b", INSTR_CMPXCHG16B},
+                                          {"mfence", INSTR_MFENCE},
+                                          {"lfence", INSTR_LFENCE},
+                                          {"sfence", INSTR_SFENCE},
+                                          {"pause", INSTR_PAUSE},
+                                          {"prefetcht0", INSTR_PREFETCHT0},
+                                          {"prefetcht1", INSTR_PREFETCHT1},
+                                          {"prefetcht2", INSTR_PREFETCHT2},
+                                          {"prefetchnta", INSTR_PREFETCHNTA},
+                                          {"prefetchw", INSTR_PREFETCHW},
+                                          {"clflush", INSTR_CLFLUSH},
+                                          {"clflushopt", INSTR_CLFLUSHOPT},
+                                          {"clwb", INSTR_CLWB},
+                                          {"movnti", INSTR_MOVNTI},
+                                          {"rdtsc", INSTR_RDTSC},
+                                          {"rdtscp", INSTR_RDTSCP},
+                                          {"rdpmc", INSTR_RDPMC},
+                                          {"cpuid", INSTR_CPUID},
+                                          {"rdrand", INSTR_RDRAND},
+                                          {"syscall", INSTR_SYSCALL},
+                                          {"push", INSTR_PUSH},
+                                          {"pop", INSTR_POP},
+                                          {"xgetbv", INSTR_XGETBV},
                                           {NULL, INSTR_UNKNOWN}};
 
+typedef struct {
+    const char *suffix;
+    uint8_t code;
+} ConditionEntry;
+
+/* Condition suffixes of Jcc, cmovcc and setcc with their encoding,
+   the low nibble of the opcode. Signed comparisons use l/g, unsigned ones
+   b/a; lt, gt and eq are the original jasm spellings. */
+static ConditionEntry conditions[] = {{"o", 0x0},   {"no", 0x1},  {"b", 0x2},  {"c", 0x2},
+                                     {"nae", 0x2}, {"ae", 0x3},  {"nb", 0x3}, {"nc", 0x3},
+                                     {"e", 0x4},   {"eq", 0x4},  {"z", 0x4},  {"ne", 0x5},
+                                     {"nz", 0x5},  {"be", 0x6},  {"na", 0x6}, {"a", 0x7},
+                                     {"nbe", 0x7}, {"s", 0x8},   {"ns", 0x9}, {"p", 0xA},
+                                     {"pe", 0xA},  {"np", 0xB},  {"po", 0xB}, {"l", 0xC},
+                                     {"lt", 0xC},  {"nge", 0xC}, {"ge", 0xD}, {"nl", 0xD},
+                                     {"le", 0xE},  {"ng", 0xE},  {"g", 0xF},  {"gt", 0xF},
+                                     {"nle", 0xF}, {NULL, 0}};
+
+/* String instructions, named with a b/w/d/q size suffix, and the opcode of
+   their byte form. The larger forms use the next opcode. */
+static const struct {
+    const char *name;
+    uint8_t opcode;
+} string_instructions[] = {
+    {"movs", 0xA4}, {"cmps", 0xA6}, {"stos", 0xAA}, {"lods", 0xAC}, {"scas", 0xAE}, {NULL, 0}};
+
+/* SSE, SSE2, SSSE3 and SSE4.1/4.2 instructions, VEX-encoded as AVX/AVX2 with a
+   "v" in front of the name */
+static const SyntaxVectorInstruction vector_instructions[] = {
+    /* Moves */
+    {"movdqa", 0x66, 1, 0x6F, VECTOR_MOVE, 0x7F, 0, 0, 0},
+    {"movdqu", 0xF3, 1, 0x6F, VECTOR_MOVE, 0x7F, 0, 0, 0},
+    {"movaps", 0x00, 1, 0x28, VECTOR_MOVE, 0x29, 0, 0, 0},
+    {"movups", 0x00, 1, 0x10, VECTOR_MOVE, 0x11, 0, 0, 0},
+    {"movapd", 0x66, 1, 0x28, VECTOR_MOVE, 0x29, 0, 0, 0},
+    {"movupd", 0x66, 1, 0x10, VECTOR_MOVE, 0x11, 0, 0, 0},
+    {"movss", 0xF3, 1, 0x10, VECTOR_MOVE_SCALAR, 0x11, 0, 16, 0},
+    {"movsd", 0xF2, 1, 0x10, VECTOR_MOVE_SCALAR, 0x11, 0, 16, 0},
+    {"movd", 0x66, 1, 0x6E, VECTOR_MOVE_GPR, 0x7E, 0, 0, 0},
+    {"movq", 0x66, 1, 0x6E, VECTOR_MOVE_GPR, 0x7E, 1, 0, 0},
+    {"pmovmskb", 0x66, 1, 0xD7, VECTOR_MASK, 0, 0, 0, 0},
+    {"lddqu", 0xF2, 1, 0xF0, VECTOR_LOAD, 0, 0, 0, CPU_SSE3},
+    /* Non-temporal moves, which bypass the caches */
+    {"movntdq", 0x66, 1, 0xE7, VECTOR_STORE, 0, 0, 0, 0},
+    {"movntps", 0x00, 1, 0x2B, VECTOR_STORE, 0, 0, 0, 0},
+    {"movntpd", 0x66, 1, 0x2B, VECTOR_STORE, 0, 0, 0, 0},
+    {"movntdqa", 0x66, 2, 0x2A, VECTOR_LOAD, 0, 0, 0, CPU_SSE41},
+    /* Floating-point arithmetic, packed (ps, pd) and scalar (ss, sd) */
+    {"addps", 0x00, 1, 0x58, VECTOR_RM, 0, 0, 0, 0},
+    {"addpd", 0x66, 1, 0x58, VECTOR_RM, 0, 0, 0, 0},
+    {"addss", 0xF3, 1, 0x58, VECTOR_RM, 0, 0, 16, 0},
+    {"addsd", 0xF2, 1, 0x58, VECTOR_RM, 0, 0, 16, 0},
+    {"subps", 0x00, 1, 0x5C, VECTOR_RM, 0, 0, 0, 0},
+    {"subpd", 0x66, 1, 0x5C, VECTOR_RM, 0, 0, 0, 0},
+    {"subss", 0xF3, 1, 0x5C, VECTOR_RM, 0, 0, 16, 0},
+    {"subsd", 0xF2, 1, 0x5C, VECTOR_RM, 0, 0, 16, 0},
+    {"mulps", 0x00, 1, 0x59, VECTOR_RM, 0, 0, 0, 0},
+    {"mulpd", 0x66, 1, 0x59, VECTOR_RM, 0, 0, 0, 0},
+    {"mulss", 0xF3, 1, 0x59, VECTOR_RM, 0, 0, 16, 0},
+    {"mulsd", 0xF2, 1, 0x59, VECTOR_RM, 0, 0, 16, 0},
+    {"divps", 0x00, 1, 0x5E, VECTOR_RM, 0, 0, 0, 0},
+    {"divpd", 0x66, 1, 0x5E, VECTOR_RM, 0, 0, 0, 0},
+    {"divss", 0xF3, 1, 0x5E, VECTOR_RM, 0, 0, 16, 0},
+    {"divsd", 0xF2, 1, 0x5E, VECTOR_RM, 0, 0, 16, 0},
+    {"minps", 0x00, 1, 0x5D, VECTOR_RM, 0, 0, 0, 0},
+    {"minpd", 0x66, 1, 0x5D, VECTOR_RM, 0, 0, 0, 0},
+    {"minss", 0xF3, 1, 0x5D, VECTOR_RM, 0, 0, 16, 0},
+    {"minsd", 0xF2, 1, 0x5D, VECTOR_RM, 0, 0, 16, 0},
+    {"maxps", 0x00, 1, 0x5F, VECTOR_RM, 0, 0, 0, 0},
+    {"maxpd", 0x66, 1, 0x5F, VECTOR_RM, 0, 0, 0, 0},
+    {"maxss", 0xF3, 1, 0x5F, VECTOR_RM, 0, 0, 16, 0},
+    {"maxsd", 0xF2, 1, 0x5F, VECTOR_RM, 0, 0, 16, 0},
+    {"sqrtps", 0x00, 1, 0x51, VECTOR_UNARY, 0, 0, 0, 0},
+    {"sqrtpd", 0x66, 1, 0x51, VECTOR_UNARY, 0, 0, 0, 0},
+    {"sqrtss", 0xF3, 1, 0x51, VECTOR_RM, 0, 0, 16, 0},
+    {"sqrtsd", 0xF2, 1, 0x51, VECTOR_RM, 0, 0, 16, 0},
+    {"rcpps", 0x00, 1, 0x53, VECTOR_UNARY, 0, 0, 0, 0},
+    {"rsqrtps", 0x00, 1, 0x52, VECTOR_UNARY, 0, 0, 0, 0},
+    {"haddps", 0xF2, 1, 0x7C, VECTOR_RM, 0, 0, 0, CPU_SSE3},
+    {"haddpd", 0x66, 1, 0x7C, VECTOR_RM, 0, 0, 0, CPU_SSE3},
+    {"dpps", 0x66, 3, 0x40, VECTOR_RM_IMM, 0, 0, 0, CPU_SSE41},
+    {"roundps", 0x66, 3, 0x08, VECTOR_UNARY_IMM, 0, 0, 0, CPU_SSE41},
+    {"roundpd", 0x66, 3, 0x09, VECTOR_UNARY_IMM, 0, 0, 0, CPU_SSE41},
+    {"roundss", 0x66, 3, 0x0A, VECTOR_RM_IMM, 0, 0, 16, CPU_SSE41},
+    {"roundsd", 0x66, 3, 0x0B, VECTOR_RM_IMM, 0, 0, 16, CPU_SSE41},
+    /* Floating-point comparisons, the predicate is the immediate */
+    {"cmpps", 0x00, 1, 0xC2, VECTOR_RM_IMM, 0, 0, 0, 0},
+    {"cmppd", 0x66, 1, 0xC2, VECTOR_RM_IMM, 0, 0, 0, 0},
+    {"cmpss", 0xF3, 1, 0xC2, VECTOR_RM_IMM, 0, 0, 16, 0},
+    {"cmpsd", 0xF2, 1, 0xC2, VECTOR_RM_IMM, 0, 0, 16, 0},
+    {"comiss", 0x00, 1, 0x2F, VECTOR_UNARY, 0, 0, 16, 0},
+    {"comisd", 0x66, 1, 0x2F, VECTOR_UNARY, 0, 0, 16, 0},
+    {"ucomiss", 0x00, 1, 0x2E, VECTOR_UNARY, 0, 0, 16, 0},
+    {"ucomisd", 0x66, 1, 0x2E, VECTOR_UNARY, 0, 0, 16, 0},
+    {"movmskps", 0x00, 1, 0x50, VECTOR_MASK, 0, 0, 0, 0},
+    {"movmskpd", 0x66, 1, 0x50, VECTOR_MASK, 0, 0, 0, 0},
+    /* Conversions */
+    {"cvtsi2ss", 0xF3, 1, 0x2A, VECTOR_CVT_FROM_GPR, 0, 0, 16, 0},
+    {"cvtsi2sd", 0xF2, 1, 0x2A, VECTOR_CVT_FROM_GPR, 0, 0, 16, 0},
+    {"cvtss2si", 0xF3, 1, 0x2D, VECTOR_CVT_TO_GPR, 0, 0, 16, 0},
+    {"cvttss2si", 0xF3, 1, 0x2C, VECTOR_CVT_TO_GPR, 0, 0, 16, 0},
+    {"cvtsd2si", 0xF2, 1, 0x2D, VECTOR_CVT_TO_GPR, 0, 0, 16, 0},
+    {"cvttsd2si", 0xF2, 1, 0x2C, VECTOR_CVT_TO_GPR, 0, 0, 16, 0},
+    {"cvtss2sd", 0xF3, 1, 0x5A, VECTOR_RM, 0, 0, 16, 0},
+    {"cvtsd2ss", 0xF2, 1, 0x5A, VECTOR_RM, 0, 0, 16, 0},
+    {"cvtdq2ps", 0x00, 1, 0x5B, VECTOR_UNARY, 0, 0, 0, 0},
+    {"cvtps2dq", 0x66, 1, 0x5B, VECTOR_UNARY, 0, 0, 0, 0},
+    {"cvttps2dq", 0xF3, 1, 0x5B, VECTOR_UNARY, 0, 0, 0, 0},
+    {"cvtps2pd", 0x00, 1, 0x5A, VECTOR_WIDEN, 0, 0, 0, 0},
+    {"cvtdq2pd", 0xF3, 1, 0xE6, VECTOR_WIDEN, 0, 0, 0, 0},
+    /* Integer arithmetic */
+    {"paddb", 0x66, 1, 0xFC, VECTOR_RM, 0, 0, 0, 0},
+    {"paddw", 0x66, 1, 0xFD, VECTOR_RM, 0, 0, 0, 0},
+    {"paddd", 0x66, 1, 0xFE, VECTOR_RM, 0, 0, 0, 0},
+    {"paddq", 0x66, 1, 0xD4, VECTOR_RM, 0, 0, 0, 0},
+    {"paddusb", 0x66, 1, 0xDC, VECTOR_RM, 0, 0, 0, 0},
+    {"paddusw", 0x66, 1, 0xDD, VECTOR_RM, 0, 0, 0, 0},
+    {"psubb", 0x66, 1, 0xF8, VECTOR_RM, 0, 0, 0, 0},
+    {"psubw", 0x66, 1, 0xF9, VECTOR_RM, 0, 0, 0, 0},
+    {"psubd", 0x66, 1, 0xFA, VECTOR_RM, 0, 0, 0, 0},
+    {"psubq", 0x66, 1, 0xFB, VECTOR_RM, 0, 0, 0, 0},
+    {"psubusb", 0x66, 1, 0xD8, VECTOR_RM, 0, 0, 0, 0},
+    {"psubusw", 0x66, 1, 0xD9, VECTOR_RM, 0, 0, 0, 0},
+    {"pmullw", 0x66, 1, 0xD5, VECTOR_RM, 0, 0, 0, 0},
+    {"pmulld", 0x66, 2, 0x40, VECTOR_RM, 0, 0, 0, CPU_SSE41},
+    {"pmuludq", 0x66, 1, 0xF4, VECTOR_RM, 0, 0, 0, 0},
+    {"pmaddwd", 0x66, 1, 0xF5, VECTOR_RM, 0, 0, 0, 0},
+    {"pmaddubsw", 0x66, 2, 0x04, VECTOR_RM, 0, 0, 0, CPU_SSSE3},
+    {"psadbw", 0x66, 1, 0xF6, VECTOR_RM, 0, 0, 0, 0},
+    {"pavgb", 0x66, 1, 0xE0, VECTOR_RM, 0, 0, 0, 0},
+    {"pminub", 0x66, 1, 0xDA, VECTOR_RM, 0, 0, 0, 0},
+    {"pmaxub", 0x66, 1, 0xDE, VECTOR_RM, 0, 0, 0, 0},
+    {"pminsd", 0x66, 2, 0x39, VECTOR_RM, 0, 0, 0, CPU_SSE41},
+    {"pmaxsd", 0x66, 2, 0x3D, VECTOR_RM, 0, 0, 0, CPU_SSE41},
+    {"pminud", 0x66, 2, 0x3B, VECTOR_RM, 0, 0, 0, CPU_SSE41},
+    {"pmaxud", 0x66, 2, 0x3F, VECTOR_RM, 0, 0, 0, CPU_SSE41},
+    {"pabsb", 0x66, 2, 0x1C, VECTOR_UNARY, 0, 0, 0, CPU_SSSE3},
+    {"pabsw", 0x66, 2, 0x1D, VECTOR_UNARY, 0, 0, 0, CPU_SSSE3},
+    {"pabsd", 0x66, 2, 0x1E, VECTOR_UNARY, 0, 0, 0, CPU_SSSE3},
+    /* Logic */
+    {"pand", 0x66, 1, 0xDB, VECTOR_RM, 0, 0, 0, 0},
+    {"pandn", 0x66, 1, 0xDF, VECTOR_RM, 0, 0, 0, 0},
+    {"por", 0x66, 1, 0xEB, VECTOR_RM, 0, 0, 0, 0},
+    {"pxor", 0x66, 1, 0xEF, VECTOR_RM, 0, 0, 0, 0},
+    {"ptest", 0x66, 2, 0x17, VECTOR_UNARY, 0, 0, 0, CPU_SSE41},
+    {"andps", 0x00, 1, 0x54, VECTOR_RM, 0, 0, 0, 0},
+    {"andnps", 0x00, 1, 0x55, VECTOR_RM, 0, 0, 0, 0},
+    {"orps", 0x00, 1, 0x56, VECTOR_RM, 0, 0, 0, 0},
+    {"xorps", 0x00, 1, 0x57, VECTOR_RM, 0, 0, 0, 0},
+    {"andpd", 0x66, 1, 0x54, VECTOR_RM, 0, 0, 0, 0},
+    {"andnpd", 0x66, 1, 0x55, VECTOR_RM, 0, 0, 0, 0},
+    {"orpd", 0x66, 1, 0x56, VECTOR_RM, 0, 0, 0, 0},
+    {"xorpd", 0x66, 1, 0x57, VECTOR_RM, 0, 0, 0, 0},
+    /* Comparisons */
+    {"pcmpeqb", 0x66, 1, 0x74, VECTOR_RM, 0, 0, 0, 0},
+    {"pcmpeqw", 0x66, 1, 0x75, VECTOR_RM, 0, 0, 0, 0},
+    {"pcmpeqd", 0x66, 1, 0x76, VECTOR_RM, 0, 0, 0, 0},
+    {"pcmpeqq", 0x66, 2, 0x29, VECTOR_RM, 0, 0, 0, CPU_SSE41},
+    {"pcmpgtb", 0x66, 1, 0x64, VECTOR_RM, 0, 0, 0, 0},
+    {"pcmpgtw", 0x66, 1, 0x65, VECTOR_RM, 0, 0, 0, 0},
+    {"pcmpgtd", 0x66, 1, 0x66, VECTOR_RM, 0, 0, 0, 0},
+    {"pcmpgtq", 0x66, 2, 0x37, VECTOR_RM, 0, 0, 0, CPU_SSE42},
+    {"pcmpestri", 0x66, 3, 0x61, VECTOR_UNARY_IMM, 0, 0, 16, CPU_SSE42},
+    {"pcmpestrm", 0x66, 3, 0x60, VECTOR_UNARY_IMM, 0, 0, 16, CPU_SSE42},
+    {"pcmpistri", 0x66, 3, 0x63, VECTOR_UNARY_IMM, 0, 0, 16, CPU_SSE42},
+    {"pcmpistrm", 0x66, 3, 0x62, VECTOR_UNARY_IMM, 0, 0, 16, CPU_SSE42},
+    /* Shuffles and packing */
+    {"pshufb", 0x66, 2, 0x00, VECTOR_RM, 0, 0, 0, CPU_SSSE3},
+    {"pshufd", 0x66, 1, 0x70, VECTOR_UNARY_IMM, 0, 0, 0, 0},
+    {"palignr", 0x66, 3, 0x0F, VECTOR_RM_IMM, 0, 0, 0, CPU_SSSE3},
+    {"pblendw", 0x66, 3, 0x0E, VECTOR_RM_IMM, 0, 0, 0, CPU_SSE41},
+    {"blendps", 0x66, 3, 0x0C, VECTOR_RM_IMM, 0, 0, 0, CPU_SSE41},
+    {"shufps", 0x00, 1, 0xC6, VECTOR_RM_IMM, 0, 0, 0, 0},
+    {"shufpd", 0x66, 1, 0xC6, VECTOR_RM_IMM, 0, 0, 0, 0},
+    {"blendpd", 0x66, 3, 0x0D, VECTOR_RM_IMM, 0, 0, 0, CPU_SSE41},
+    {"unpcklps", 0x00, 1, 0x14, VECTOR_RM, 0, 0, 0, 0},
+    {"unpckhps", 0x00, 1, 0x15, VECTOR_RM, 0, 0, 0, 0},
+    {"unpcklpd", 0x66, 1, 0x14, VECTOR_RM, 0, 0, 0, 0},
+    {"unpckhpd", 0x66, 1, 0x15, VECTOR_RM, 0, 0, 0, 0},
+    {"punpcklbw", 0x66, 1, 0x60, VECTOR_RM, 0, 0, 0, 0},
+    {"punpckhbw", 0x66, 1, 0x68, VECTOR_RM, 0, 0, 0, 0},
+    {"punpcklwd", 0x66, 1, 0x61, VECTOR_RM, 0, 0, 0, 0},
+    {"punpckhwd", 0x66, 1, 0x69, VECTOR_RM, 0, 0, 0, 0},
+    {"punpckldq", 0x66, 1, 0x62, VECTOR_RM, 0, 0, 0, 0},
+    {"punpckhdq", 0x66, 1, 0x6A, VECTOR_RM, 0, 0, 0, 0},
+    {"punpcklqdq", 0x66, 1, 0x6C, VECTOR_RM, 0, 0, 0, 0},
+    {"punpckhqdq", 0x66, 1, 0x6D, VECTOR_RM, 0, 0, 0, 0},
+    {"packuswb", 0x66, 1, 0x67, VECTOR_RM, 0, 0, 0, 0},
+    {"packsswb", 0x66, 1, 0x63, VECTOR_RM, 0, 0, 0, 0},
+    {"packssdw", 0x66, 1, 0x6B, VECTOR_RM, 0, 0, 0, 0},
+    {"packusdw", 0x66, 2, 0x2B, VECTOR_RM, 0, 0, 0, CPU_SSE41},
+    /* Shifts by an immediate */
+    {"psllw", 0x66, 1, 0x71, VECTOR_SHIFT_IMM, 6, 0, 0, 0},
+    {"psrlw", 0x66, 1, 0x71, VECTOR_SHIFT_IMM, 2, 0, 0, 0},
+    {"psraw", 0x66, 1, 0x71, VECTOR_SHIFT_IMM, 4, 0, 0, 0},
+    {"pslld", 0x66, 1, 0x72, VECTOR_SHIFT_IMM, 6, 0, 0, 0},
+    {"psrld", 0x66, 1, 0x72, VECTOR_SHIFT_IMM, 2, 0, 0, 0},
+    {"psrad", 0x66, 1, 0x72, VECTOR_SHIFT_IMM, 4, 0, 0, 0},
+    {"psllq", 0x66, 1, 0x73, VECTOR_SHIFT_IMM, 6, 0, 0, 0},
+    {"psrlq", 0x66, 1, 0x73, VECTOR_SHIFT_IMM, 2, 0, 0, 0},
+    {"pslldq", 0x66, 1, 0x73, VECTOR_SHIFT_IMM, 7, 0, 0, 0},
+    {"psrldq", 0x66, 1, 0x73, VECTOR_SHIFT_IMM, 3, 0, 0, 0},
+    {NULL, 0, 0, 0, VECTOR_RM, 0, 0, 0, 0}};
+
+/* AVX, AVX2 and FMA instructions without an SSE form. The packed ones of
+   the above also take ymm registers in their VEX form. */
+static const SyntaxVectorInstruction avx_instructions[] = {
+    /* Broadcasts, permutes and 128-bit lanes */
+    {"vpbroadcastb", 0x66, 2, 0x78, VECTOR_WIDEN, 0, 0, 0, CPU_AVX2},
+    {"vpbroadcastw", 0x66, 2, 0x79, VECTOR_WIDEN, 0, 0, 0, CPU_AVX2},
+    {"vpbroadcastd", 0x66, 2, 0x58, VECTOR_WIDEN, 0, 0, 0, CPU_AVX2},
+    {"vpbroadcastq", 0x66, 2, 0x59, VECTOR_WIDEN, 0, 0, 0, CPU_AVX2},
+    {"vbroadcastss", 0x66, 2, 0x18, VECTOR_WIDEN, 0, 0, 0, CPU_AVX2},
+    {"vbroadcastsd", 0x66, 2, 0x19, VECTOR_WIDEN, 0, 0, 32, CPU_AVX2},
+    {"vpermd", 0x66, 2, 0x36, VECTOR_RM, 0, 0, 32, CPU_AVX2},
+    {"vpermps", 0x66, 2, 0x16, VECTOR_RM, 0, 0, 32, CPU_AVX2},
+    {"vpermq", 0x66, 3, 0x00, VECTOR_UNARY_IMM, 0, 1, 32, CPU_AVX2},
+    {"vpermpd", 0x66, 3, 0x01, VECTOR_UNARY_IMM, 0, 1, 32, CPU_AVX2},
+    {"vperm2i128", 0x66, 3, 0x46, VECTOR_RM_IMM, 0, 0, 32, CPU_AVX2},
+    {"vperm2f128", 0x66, 3, 0x06, VECTOR_RM_IMM, 0, 0, 32, CPU_AVX},
+    {"vinserti128", 0x66, 3, 0x38, VECTOR_INSERT, 0, 0, 32, CPU_AVX2},
+    {"vinsertf128", 0x66, 3, 0x18, VECTOR_INSERT, 0, 0, 32, CPU_AVX},
+    {"vextracti128", 0x66, 3, 0x39, VECTOR_EXTRACT, 0, 0, 32, CPU_AVX2},
+    {"vextractf128", 0x66, 3, 0x19, VECTOR_EXTRACT, 0, 0, 32, CPU_AVX},
+    {"vpblendd", 0x66, 3, 0x02, VECTOR_RM_IMM, 0, 0, 0, CPU_AVX2},
+    /* Shifts by a count per element */
+    {"vpsllvd", 0x66, 2, 0x47, VECTOR_RM, 0, 0, 0, CPU_AVX2},
+    {"vpsllvq", 0x66, 2, 0x47, VECTOR_RM, 0, 1, 0, CPU_AVX2},
+    {"vpsrlvd", 0x66, 2, 0x45, VECTOR_RM, 0, 0, 0, CPU_AVX2},
+    {"vpsrlvq", 0x66, 2, 0x45, VECTOR_RM, 0, 1, 0, CPU_AVX2},
+    {"vpsravd", 0x66, 2, 0x46, VECTOR_RM, 0, 0, 0, CPU_AVX2},
+    /* Gathers: the opcode is odd for qword indices, W is set for qword elements */
+    {"vpgatherdd", 0x66, 2, 0x90, VECTOR_GATHER, 0, 0, 0, CPU_AVX2},
+    {"vpgatherdq", 0x66, 2, 0x90, VECTOR_GATHER, 0, 1, 0, CPU_AVX2},
+    {"vpgatherqd", 0x66, 2, 0x91, VECTOR_GATHER, 0, 0, 0, CPU_AVX2},
+    {"vpgatherqq", 0x66, 2, 0x91, VECTOR_GATHER, 0, 1, 0, CPU_AVX2},
+    {"vgatherdps", 0x66, 2, 0x92, VECTOR_GATHER, 0, 0, 0, CPU_AVX2},
+    {"vgatherdpd", 0x66, 2, 0x92, VECTOR_GATHER, 0, 1, 0, CPU_AVX2},
+    {"vgatherqps", 0x66, 2, 0x93, VECTOR_GATHER, 0, 0, 0, CPU_AVX2},
+    {"vgatherqpd", 0x66, 2, 0x93, VECTOR_GATHER, 0, 1, 0, CPU_AVX2},
+    /* Fused multiply-add: 132, 213 and 231 name the operands that are
+       multiplied and added, as in vfmadd231pd a, b, c for a = b * c + a */
+    {"vfmadd132ps", 0x66, 2, 0x98, VECTOR_RM, 0, 0, 0, CPU_FMA},
+    {"vfmadd132pd", 0x66, 2, 0x98, VECTOR_RM, 0, 1, 0, CPU_FMA},
+    {"vfmadd132ss", 0x66, 2, 0x99, VECTOR_RM, 0, 0, 16, CPU_FMA},
+    {"vfmadd132sd", 0x66, 2, 0x99, VECTOR_RM, 0, 1, 16, CPU_FMA},
+    {"vfmadd213ps", 0x66, 2, 0xA8, VECTOR_RM, 0, 0, 0, CPU_FMA},
+    {"vfmadd213pd", 0x66, 2, 0xA8, VECTOR_RM, 0, 1, 0, CPU_FMA},
+    {"vfmadd213ss", 0x66, 2, 0xA9, VECTOR_RM, 0, 0, 16, CPU_FMA},
+    {"vfmadd213sd", 0x66, 2, 0xA9, VECTOR_RM, 0, 1, 16, CPU_FMA},
+    {"vfmadd231ps", 0x66, 2, 0xB8, VECTOR_RM, 0, 0, 0, CPU_FMA},
+    {"vfmadd231pd", 0x66, 2, 0xB8, VECTOR_RM, 0, 1, 0, CPU_FMA},
+    {"vfmadd231ss", 0x66, 2, 0xB9, VECTOR_RM, 0, 0, 16, CPU_FMA},
+    {"vfmadd231sd", 0x66, 2, 0xB9, VECTOR_RM, 0, 1, 16, CPU_FMA},
+    {"vfmsub132ps", 0x66, 2, 0x9A, VECTOR_RM, 0, 0, 0, CPU_FMA},
+    {"vfmsub132pd", 0x66, 2, 0x9A, VECTOR_RM, 0, 1, 0, CPU_FMA},
+    {"vfmsub132ss", 0x66, 2, 0x9B, VECTOR_RM, 0, 0, 16, CPU_FMA},
+    {"vfmsub132sd", 0x66, 2, 0x9B, VECTOR_RM, 0, 1, 16, CPU_FMA},
+    {"vfmsub213ps", 0x66, 2, 0xAA, VECTOR_RM, 0, 0, 0, CPU_FMA},
+    {"vfmsub213pd", 0x66, 2, 0xAA, VECTOR_RM, 0, 1, 0, CPU_FMA},
+    {"vfmsub213ss", 0x66, 2, 0xAB, VECTOR_RM, 0, 0, 16, CPU_FMA},
+    {"vfmsub213sd", 0x66, 2, 0xAB, VECTOR_RM, 0, 1, 16, CPU_FMA},
+    {"vfmsub231ps", 0x66, 2, 0xBA, VECTOR_RM, 0, 0, 0, CPU_FMA},
+    {"vfmsub231pd", 0x66, 2, 0xBA, VECTOR_RM, 0, 1, 0, CPU_FMA},
+    {"vfmsub231ss", 0x66, 2, 0xBB, VECTOR_RM, 0, 0, 16, CPU_FMA},
+    {"vfmsub231sd", 0x66, 2, 0xBB, VECTOR_RM, 0, 1, 16, CPU_FMA},
+    {"vfnmadd132ps", 0x66, 2, 0x9C, VECTOR_RM, 0, 0, 0, CPU_FMA},
+    {"vfnmadd132pd", 0x66, 2, 0x9C, VECTOR_RM, 0, 1, 0, CPU_FMA},
+    {"vfnmadd132ss", 0x66, 2, 0x9D, VECTOR_RM, 0, 0, 16, CPU_FMA},
+    {"vfnmadd132sd", 0x66, 2, 0x9D, VECTOR_RM, 0, 1, 16, CPU_FMA},
+    {"vfnmadd213ps", 0x66, 2, 0xAC, VECTOR_RM, 0, 0, 0, CPU_FMA},
+    {"vfnmadd213pd", 0x66, 2, 0xAC, VECTOR_RM, 0, 1, 0, CPU_FMA},
+    {"vfnmadd213ss", 0x66, 2, 0xAD, VECTOR_RM, 0, 0, 16, CPU_FMA},
+    {"vfnmadd213sd", 0x66, 2, 0xAD, VECTOR_RM, 0, 1, 16, CPU_FMA},
+    {"vfnmadd231ps", 0x66, 2, 0xBC, VECTOR_RM, 0, 0, 0, CPU_FMA},
+    {"vfnmadd231pd", 0x66, 2, 0xBC, VECTOR_RM, 0, 1, 0, CPU_FMA},
+    {"vfnmadd231ss", 0x66, 2, 0xBD, VECTOR_RM, 0, 0, 16, CPU_FMA},
+    {"vfnmadd231sd", 0x66, 2, 0xBD, VECTOR_RM, 0, 1, 16, CPU_FMA},
+    {"vfnmsub132ps", 0x66, 2, 0x9E, VECTOR_RM, 0, 0, 0, CPU_FMA},
+    {"vfnmsub132pd", 0x66, 2, 0x9E, VECTOR_RM, 0, 1, 0, CPU_FMA},
+    {"vfnmsub132ss", 0x66, 2, 0x9F, VECTOR_RM, 0, 0, 16, CPU_FMA},
+    {"vfnmsub132sd", 0x66, 2, 0x9F, VECTOR_RM, 0, 1, 16, CPU_FMA},
+    {"vfnmsub213ps", 0x66, 2, 0xAE, VECTOR_RM, 0, 0, 0, CPU_FMA},
+    {"vfnmsub213pd", 0x66, 2, 0xAE, VECTOR_RM, 0, 1, 0, CPU_FMA},
+    {"vfnmsub213ss", 0x66, 2, 0xAF, VECTOR_RM, 0, 0, 16, CPU_FMA},
+    {"vfnmsub213sd", 0x66, 2, 0xAF, VECTOR_RM, 0, 1, 16, CPU_FMA},
+    {"vfnmsub231ps", 0x66, 2, 0xBE, VECTOR_RM, 0, 0, 0, CPU_FMA},
+    {"vfnmsub231pd", 0x66, 2, 0xBE, VECTOR_RM, 0, 1, 0, CPU_FMA},
+    {"vfnmsub231ss", 0x66, 2, 0xBF, VECTOR_RM, 0, 0, 16, CPU_FMA},
+    {"vfnmsub231sd", 0x66, 2, 0xBF, VECTOR_RM, 0, 1, 16, CPU_FMA},
+    /* Clearing the upper halves before SSE code runs */
+    {"vzeroupper", 0x00, 1, 0x77, VECTOR_NONE, 0, 0, 0, CPU_AVX},
+    {"vzeroall", 0x00, 1, 0x77, VECTOR_NONE, 0, 0, 32, CPU_AVX},
+    {NULL, 0, 0, 0, VECTOR_RM, 0, 0, 0, 0}};
+
+/* CPU features by name, with the CPUID bit that reports them */
+static const struct {
+    const char *name;
+    uint32_t feature;
+    uint8_t word; /* CPUID_* */
+    uint8_t bit;
+} cpu_features[] = {{"sse3", CPU_SSE3, CPUID_1_ECX, 0},
+                    {"ssse3", CPU_SSSE3, CPUID_1_ECX, 9},
+                    {"sse4.1", CPU_SSE41, CPUID_1_ECX, 19},
+                    {"sse4.2", CPU_SSE42, CPUID_1_ECX, 20},
+                    {"popcnt", CPU_POPCNT, CPUID_1_ECX, 23},
+                    {"cx16", CPU_CX16, CPUID_1_ECX, 13},
+                    {"avx", CPU_AVX, CPUID_1_ECX, 28},
+                    {"avx2", CPU_AVX2, CPUID_7_EBX, 5},
+                    {"fma", CPU_FMA, CPUID_1_ECX, 12},
+                    {"bmi1", CPU_BMI1, CPUID_7_EBX, 3},
+                    {"bmi2", CPU_BMI2, CPUID_7_EBX, 8},
+                    {"lzcnt", CPU_LZCNT, CPUID_EXT_ECX, 5},
+                    {"movbe", CPU_MOVBE, CPUID_1_ECX, 22},
+                    {"avx512f", CPU_AVX512F, CPUID_7_EBX, 16},
+                    {"avx512bw", CPU_AVX512BW, CPUID_7_EBX, 30},
+                    {"avx512cd", CPU_AVX512CD, CPUID_7_EBX, 28},
+                    {"avx512dq", CPU_AVX512DQ, CPUID_7_EBX, 17},
+                    {"avx512vl", CPU_AVX512VL, CPUID_7_EBX, 31},
+                    {"rdrand", CPU_RDRAND, CPUID_1_ECX, 30},
+                    {"rdtscp", CPU_RDTSCP, CPUID_EXT_EDX, 27},
+                    {"prefetchw", CPU_PREFETCHW, CPUID_EXT_ECX, 8},
+                    {"clflushopt", CPU_CLFLUSHOPT, CPUID_7_EBX, 23},
+                    {"clwb", CPU_CLWB, CPUID_7_EBX, 24},
+                    {NULL, 0, 0, 0}};
+
+/* Features that every CPU with another feature has as well */
+static const struct {
+    uint32_t feature;
+    uint32_t implies;
+} cpu_implied_features[] = {{CPU_SSSE3, CPU_SSE3},
+                            {CPU_SSE41, CPU_SSSE3},
+                            {CPU_SSE42, CPU_SSE41},
+                            {CPU_AVX, CPU_SSE42},
+                            {CPU_AVX2, CPU_AVX},
+                            {CPU_FMA, CPU_AVX},
+                            {CPU_AVX512F, CPU_AVX2 | CPU_FMA},
+                            {CPU_AVX512BW, CPU_AVX512F},
+                            {CPU_AVX512CD, CPU_AVX512F},
+                            {CPU_AVX512DQ, CPU_AVX512F},
+                            {CPU_AVX512VL, CPU_AVX512F},
+                            {0, 0}};
+
+/* The x86-64 microarchitecture levels, each including the ones before */
+#define CPU_LEVEL_V2 (CPU_SSE3 | CPU_SSSE3 | CPU_SSE41 | CPU_SSE42 | CPU_POPCNT | CPU_CX16)
+#define CPU_LEVEL_V3                                                                        \
+    (CPU_LEVEL_V2 | CPU_AVX | CPU_AVX2 | CPU_FMA | CPU_BMI1 | CPU_BMI2 | CPU_LZCNT \
+     | CPU_MOVBE)
+#define CPU_LEVEL_V4                                                                     \
+    (CPU_LEVEL_V3 | CPU_AVX512F | CPU_AVX512BW | CPU_AVX512CD | CPU_AVX512DQ \
+     | CPU_AVX512VL)
+
+static const struct {
+    const char *name;
+    uint32_t features;
+} cpu_levels[] = {{"x86-64", 0},
+                  {"x86-64-v1", 0},
+                  {"x86-64-v2", CPU_LEVEL_V2},
+                  {"x86-64-v3", CPU_LEVEL_V3},
+                  {"x86-64-v4", CPU_LEVEL_V4},
+                  {NULL, 0}};
+
+/* BMI1 and BMI2 instructions */
+static const SyntaxBmiInstruction bmi_instructions[] = {
+    {"andn", 0x00, 2, 0xF2, BMI_RVM, 0, CPU_BMI1},
+    {"bextr", 0x00, 2, 0xF7, BMI_RMV, 0, CPU_BMI1},
+    {"blsi", 0x00, 2, 0xF3, BMI_VM, 3, CPU_BMI1},
+    {"blsmsk", 0x00, 2, 0xF3, BMI_VM, 2, CPU_BMI1},
+    {"blsr", 0x00, 2, 0xF3, BMI_VM, 1, CPU_BMI1},
+    {"bzhi", 0x00, 2, 0xF5, BMI_RMV, 0, CPU_BMI2},
+    {"pdep", 0xF2, 2, 0xF5, BMI_RVM, 0, CPU_BMI2},
+    {"pext", 0xF3, 2, 0xF5, BMI_RVM, 0, CPU_BMI2},
+    {"mulx", 0xF2, 2, 0xF6, BMI_RVM, 0, CPU_BMI2},
+    {"rorx", 0xF2, 3, 0xF0, BMI_RM_IMM, 0, CPU_BMI2},
+    {"sarx", 0xF3, 2, 0xF7, BMI_RMV, 0, CPU_BMI2},
+    {"shlx", 0x66, 2, 0xF7, BMI_RMV, 0, CPU_BMI2},
+    {"shrx", 0xF2, 2, 0xF7, BMI_RMV, 0, CPU_BMI2},
+    {NULL, 0, 0, 0, BMI_RVM, 0, 0}};
+
 static RegisterEntry registers[] = {{"rax", REG_RAX, 0x00},
                                     {"rcx", REG_RCX, 0x01},
                                     {"rdx", REG_RDX, 0x02},
                                     {"rbx", REG_RBX, 0x03},
                                     {"rsi", REG_RSI, 0x06},
                                     {"rdi", REG_RDI, 0x07},
+                                    {"rsp", REG_RSP, 0x04},
+                                    {"rbp", REG_RBP, 0x05},
+                                    {"r8", REG_R8, 0x08},
+                                    {"r9", REG_R9, 0x09},
+                                    {"r10", REG_R10, 0x0A},
+                                    {"r11", REG_R11, 0x0B},
+                                    {"r12", REG_R12, 0x0C},
+                                    {"r13", REG_R13, 0x0D},
+                                    {"r14", REG_R14, 0x0E},
+                                    {"r15", REG_R15, 0x0F},
                                     {NULL, REG_UNKNOWN, 0}};
 
-/* Buffer for extracted strings */
-static char syntax_buffer[SYNTAX_MAX_LINE_LEN];
+/* The low 32, 16 and 8 bits of the general-purpose registers, indexed by
+   register code. spl, bpl, sil and dil need a REX prefix, ah to bh are not
+   supported. */
+static const char *dword_registers[] = {"eax",
+                                        "ecx",
+                                        "edx",
+                                        "ebx",
+                                        "esp",
+                                        "ebp",
+                                        "esi",
+                                        "edi",
+                                        "r8d",
+                                        "r9d",
+                                        "r10d",
+                                        "r11d",
+                                        "r12d",
+                                        "r13d",
+                                        "r14d",
+                                        "r15d"};
+static const char *word_registers[] = {"ax",
+                                       "cx",
+                                       "dx",
+                                       "bx",
+                                       "sp",
+                                       "bp",
+                                       "si",
+                                       "di",
+                                       "r8w",
+                                       "r9w",
+                                       "r10w",
+                                       "r11w",
+                                       "r12w",
+                                       "r13w",
+                                       "r14w",
+                                       "r15w"};
+static const char *byte_registers[] = {"al",
+                                       "cl",
+                                       "dl",
+                                       "bl",
+                                       "spl",
+                                       "bpl",
+                                       "sil",
+                                       "dil",
+                                       "r8b",
+                                       "r9b",
+                                       "r10b",
+                                       "r11b",
+                                       "r12b",
+                                       "r13b",
+                                       "r14b",
+                                       "r15b"};
+
+/* Size qualifiers of memory operands, in bytes */
+static const struct {
+    const char *keyword;
+    uint8_t size;
+} size_qualifiers[] = {{"byte", 1}, {"word", 2}, {"dword", 4}, {"qword", 8}, {NULL, 0}};
+
+/* Buffer for extracted strings, per thread since modules are assembled in parallel */
+static _Thread_local char syntax_buffer[SYNTAX_MAX_LINE_LEN];
 
 /* Initialization function */
 void syntax_init(void)
@@ -132,6 +646,16 @@ bool syntax_is_instruction(const char *str)
     return false;
 }
 
+/* Check whether anything but a comment follows the mnemonic of `str` */
+static bool has_operands(const char *str)
+{
+    while (*str && !isspace((unsigned char)*str))
+        str++;
+    while (isspace((unsigned char)*str))
+        str++;
+    return *str != '\0' && *str != syntax_comment_char;
+}
+
 /* Get instruction type from string */
 InstructionType syntax_get_instruction_type(const char *str)
 {
@@ -151,9 +675,251 @@ InstructionType syntax_get_instruction_type(const char *str)
         }
     }
 
+    if (syntax_get_condition_code(str, "jmp") != 0xFF
+        || syntax_get_condition_code(str, "j") != 0xFF)
+        return INSTR_JUMPCC;
+    /* movsd and cmpsd are string instructions without operands and SSE
+       instructions with them */
+    uint8_t size;
+    bool vex;
+    const bool isString = syntax_get_string_opcode(str, &size) != 0;
+    if (syntax_get_vector_instruction(str, &vex) != NULL && !(isString && !has_operands(str)))
+        return INSTR_VECTOR;
+    if (isString)
+        return INSTR_STRING;
+    if (syntax_get_bmi_instruction(str) != NULL)
+        return INSTR_BMI;
+    if (syntax_get_condition_code(str, "cmov") != 0xFF)
+        return INSTR_CMOVCC;
+    if (syntax_get_condition_code(str, "set") != 0xFF)
+        return INSTR_SETCC;
+
     return INSTR_UNKNOWN;
 }
 
+/* Find the vector instruction a mnemonic names in `table`, or NULL */
+static const SyntaxVectorInstruction *find_vector_instruction(
+    const SyntaxVectorInstruction *table, const char *str)
+{
+    for (int i = 0; table[i].name != NULL; i++) {
+        size_t len = strlen(table[i].name);
+        if (strncmp(str, table[i].name, len) == 0
+            && (str[len] == '\0' || isspace((unsigned char)str[len])))
+            return &table[i];
+    }
+    return NULL;
+}
+
+/* Find the vector instruction a line starts with, or NULL. `vex` is set
+   for the AVX forms, which are VEX-encoded. */
+const SyntaxVectorInstruction *syntax_get_vector_instruction(const char *str, bool *vex)
+{
+    if (!str)
+        return NULL;
+
+    /* Skip leading whitespace */
+    while (*str && isspace((unsigned char)*str))
+        str++;
+
+    const SyntaxVectorInstruction *vi = find_vector_instruction(avx_instructions, str);
+    *vex = true;
+    if (!vi && str[0] == 'v')
+        vi = find_vector_instruction(vector_instructions, str + 1);
+    if (!vi) {
+        vi = find_vector_instruction(vector_instructions, str);
+        *vex = false;
+    }
+    return vi;
+}
+
+/* Get a CPU feature (CPU_*) by its name, such as "avx2". Returns 0 if the
+   name is unknown. */
+uint32_t syntax_get_cpu_feature(const char *name)
+{
+    for (int i = 0; cpu_features[i].name != NULL; i++) {
+        if (strcmp(name, cpu_features[i].name) == 0)
+            return cpu_features[i].feature;
+    }
+    return 0;
+}
+
+/* Name of a CPU feature, or of the lowest one in a set of them */
+const char *syntax_cpu_feature_to_string(uint32_t feature)
+{
+    for (int i = 0; cpu_features[i].name != NULL; i++) {
+        if (feature & cpu_features[i].feature)
+            return cpu_features[i].name;
+    }
+    return "unknown";
+}
+
+/* Add the features that `features` imply, such as AVX for AVX2 */
+uint32_t syntax_get_implied_cpu_features(uint32_t features)
+{
+    uint32_t previous;
+    do {
+        previous = features;
+        for (int i = 0; cpu_implied_features[i].feature != 0; i++) {
+            if (features & cpu_implied_features[i].feature)
+                features |= cpu_implied_features[i].implies;
+        }
+    } while (features != previous);
+    return features;
+}
+
+/* Get the CPUID word (CPUID_*) and bit that report a single feature */
+bool syntax_get_cpuid_bit(uint32_t feature, uint8_t *word, uint8_t *bit)
+{
+    for (int i = 0; cpu_features[i].name != NULL; i++) {
+        if (feature == cpu_features[i].feature) {
+            *word = cpu_features[i].word;
+            *bit = cpu_features[i].bit;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Features of the CPU the assembler runs on. AVX and AVX-512 also need
+   the operating system to save their registers, which XCR0 reports. */
+static uint32_t native_cpu_features(void)
+{
+    uint32_t words[CPUID_WORDS] = {0};
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        words[CPUID_1_ECX] = ecx;
+    if (__get_cpuid_max(0, NULL) >= 7 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        words[CPUID_7_EBX] = ebx;
+    if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx)) {
+        words[CPUID_EXT_ECX] = ecx;
+        words[CPUID_EXT_EDX] = edx;
+    }
+
+    uint32_t xcr0 = 0;
+    if (words[CPUID_1_ECX] & (1u << 27)) { /* OSXSAVE */
+        uint32_t high;
+        __asm__ volatile("xgetbv" : "=a"(xcr0), "=d"(high) : "c"(0));
+    }
+
+    uint32_t features = 0;
+    for (int i = 0; cpu_features[i].name != NULL; i++) {
+        if (words[cpu_features[i].word] & (1u << cpu_features[i].bit))
+            features |= cpu_features[i].feature;
+    }
+    if ((xcr0 & 0x06) != 0x06) /* SSE and AVX state */
+        features &= ~(uint32_t)(CPU_AVX | CPU_AVX2 | CPU_FMA);
+    if ((xcr0 & 0xE6) != 0xE6) /* and the AVX-512 state */
+        features &= ~(uint32_t)(CPU_LEVEL_V4 & ~CPU_LEVEL_V3);
+    return features;
+}
+
+/* Get the features of a --march target: an x86-64 level such as
+   "x86-64-v3", or "native" for the CPU the assembler runs on */
+bool syntax_get_cpu_target(const char *name, uint32_t *features)
+{
+    if (strcmp(name, "native") == 0) {
+        *features = native_cpu_features();
+        return true;
+    }
+    for (int i = 0; cpu_levels[i].name != NULL; i++) {
+        if (strcmp(name, cpu_levels[i].name) == 0) {
+            *features = cpu_levels[i].features;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Find the BMI instruction a line starts with, or NULL */
+const SyntaxBmiInstruction *syntax_get_bmi_instruction(const char *str)
+{
+    if (!str)
+        return NULL;
+
+    /* Skip leading whitespace */
+    while (*str && isspace((unsigned char)*str))
+        str++;
+
+    for (int i = 0; bmi_instructions[i].name != NULL; i++) {
+        size_t len = strlen(bmi_instructions[i].name);
+        if (strncmp(str, bmi_instructions[i].name, len) == 0
+            && (str[len] == '\0' || isspace((unsigned char)str[len])))
+            return &bmi_instructions[i];
+    }
+
+    return NULL;
+}
+
+/* Get the byte-form opcode and operand size of a string instruction such
+   as "movsb" or "stosq". Returns 0 if the mnemonic is something else. */
+uint8_t syntax_get_string_opcode(const char *str, uint8_t *size)
+{
+    if (!str)
+        return 0;
+
+    /* Skip leading whitespace */
+    while (*str && isspace((unsigned char)*str))
+        str++;
+
+    for (int i = 0; string_instructions[i].name != NULL; i++) {
+        size_t len = strlen(string_instructions[i].name);
+        if (strncmp(str, string_instructions[i].name, len) != 0)
+            continue;
+        if (str[len] == '\0'
+            || (str[len + 1] != '\0' && !isspace((unsigned char)str[len + 1])))
+            continue;
+        switch (str[len]) {
+            case 'b':
+                *size = 1;
+                break;
+            case 'w':
+                *size = 2;
+                break;
+            case 'd':
+                *size = 4;
+                break;
+            case 'q':
+                *size = 8;
+                break;
+            default:
+                continue;
+        }
+        return string_instructions[i].opcode;
+    }
+
+    return 0;
+}
+
+/* Get the condition code (0-15) of a mnemonic made of `prefix` and a
+   condition suffix, such as "jmpne" or "jne" for the prefix "jmp" or "j".
+   Returns 0xFF if the mnemonic has another form. */
+uint8_t syntax_get_condition_code(const char *str, const char *prefix)
+{
+    if (!str)
+        return 0xFF;
+
+    /* Skip leading whitespace */
+    while (*str && isspace((unsigned char)*str))
+        str++;
+
+    size_t len = strlen(prefix);
+    if (strncmp(str, prefix, len) != 0)
+        return 0xFF;
+    str += len;
+
+    size_t suffixLen = 0;
+    while (str[suffixLen] && !isspace((unsigned char)str[suffixLen]))
+        suffixLen++;
+
+    for (int i = 0; conditions[i].suffix != NULL; i++) {
+        if (strlen(conditions[i].suffix) == suffixLen
+            && strncmp(str, conditions[i].suffix, suffixLen) == 0)
+            return conditions[i].code;
+    }
+
+    return 0xFF;
+}
+
 /* Check if string is a register */
 bool syntax_is_register(const char *str)
 {
@@ -193,6 +959,65 @@ uint8_t syntax_get_register_code(const char *reg)
     return 0xFF; /* Unknown register */
 }
 
+/* Look up a register name in a table indexed by register code */
+static uint8_t find_register_name(const char *reg, const char **names)
+{
+    for (uint8_t i = 0; i < 16; i++) {
+        if (strcmp(reg, names[i]) == 0)
+            return i;
+    }
+
+    return 0xFF; /* Unknown register */
+}
+
+/* Get register code from the name of an 8-bit register */
+uint8_t syntax_get_byte_register_code(const char *reg)
+{
+    return find_register_name(reg, byte_registers);
+}
+
+/* Get register code and size in bytes of a register of any size, such as
+   rax, eax, ax or al. Returns 0xFF for unknown names. */
+uint8_t syntax_get_sized_register_code(const char *reg, uint8_t *size)
+{
+    static const struct {
+        const char **names;
+        uint8_t size;
+    } tables[] = {{dword_registers, 4}, {word_registers, 2}, {byte_registers, 1}};
+
+    uint8_t code = syntax_get_register_code(reg);
+    if (code != 0xFF) {
+        *size = 8;
+        return code;
+    }
+    for (size_t i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+        code = find_register_name(reg, tables[i].names);
+        if (code != 0xFF) {
+            *size = tables[i].size;
+            return code;
+        }
+    }
+
+    return 0xFF; /* Unknown register */
+}
+
+/* Get register code and size in bytes of a vector register, xmm0-xmm15
+   or ymm0-ymm15. Returns 0xFF for other names. */
+uint8_t syntax_get_vector_register_code(const char *reg, uint8_t *size)
+{
+    if ((strncmp(reg, "xmm", 3) != 0 && strncmp(reg, "ymm", 3) != 0)
+        || !isdigit((unsigned char)reg[3]))
+        return 0xFF;
+
+    char *end;
+    long code = strtol(reg + 3, &end, 10);
+    if (*end != '\0' || code > 15 || (reg[3] == '0' && reg[4] != '\0'))
+        return 0xFF;
+
+    *size = reg[0] == 'y' ? 32 : 16;
+    return (uint8_t)code;
+}
+
 /* Get register code from register type */
 uint8_t syntax_get_register_code_by_type(RegisterType reg)
 {
@@ -298,12 +1123,112 @@ bool syntax_is_data_directive(const char *str)
     return false;
 }
 
+/* Check if string is a keyword on its own, possibly with a comment */
+static bool is_bare_keyword(const char *str, const char *keyword)
+{
+    if (!str)
+        return false;
+    while (*str && isspace((unsigned char)*str))
+        str++;
+
+    const size_t len = strlen(keyword);
+    if (strncmp(str, keyword, len) != 0)
+        return false;
+    str += len;
+    while (*str && isspace((unsigned char)*str))
+        str++;
+    return *str == '\0' || *str == syntax_comment_char;
+}
+
+/* Check if string is a directive of the form <keyword> <operand> */
+static bool is_keyword_directive(const char *str, const char *keyword)
+{
+    if (!str || !*str)
+        return false;
+
+    /* Skip leading whitespace */
+    while (*str && isspace((unsigned char)*str))
+        str++;
+
+    size_t len = strlen(keyword);
+    return strncmp(str, keyword, len) == 0 && isspace((unsigned char)str[len]);
+}
+
+/* Check if string is a global directive (global <symbol>) */
+bool syntax_is_global_directive(const char *str)
+{
+    return is_keyword_directive(str, syntax_global_keyword);
+}
+
+/* Check if string is an extern directive (extern <function>) */
+bool syntax_is_extern_directive(const char *str)
+{
+    return is_keyword_directive(str, syntax_extern_keyword);
+}
+
+/* Check if string is an align directive (align <bytes>) */
+bool syntax_is_align_directive(const char *str)
+{
+    return is_keyword_directive(str, syntax_align_keyword);
+}
+
+/* Check if string starts a proc block (proc <name> [<bytes>]) */
+bool syntax_is_proc_directive(const char *str)
+{
+    return is_keyword_directive(str, syntax_proc_keyword);
+}
+
+/* Check if string ends a proc block (endp, which takes no operand) */
+bool syntax_is_endp_directive(const char *str)
+{
+    return is_bare_keyword(str, syntax_endp_keyword);
+}
+
+/* Check if string starts a CPU dispatch block (ifcpu <feature>...) */
+bool syntax_is_ifcpu_directive(const char *str)
+{
+    return is_keyword_directive(str, syntax_ifcpu_keyword);
+}
+
+/* Check if string starts the fallback of an ifcpu block */
+bool syntax_is_else_directive(const char *str)
+{
+    return is_bare_keyword(str, syntax_else_keyword);
+}
+
+/* Check if string ends an ifcpu block */
+bool syntax_is_endif_directive(const char *str)
+{
+    return is_bare_keyword(str, syntax_endif_keyword);
+}
+
+/* Skip a size qualifier (byte, word, dword, qword) in front of a memory
+   reference, storing its size or 0 if there is none */
+static const char *skip_size_qualifier(const char *str, uint8_t *size)
+{
+    *size = 0;
+    for (int i = 0; size_qualifiers[i].keyword != NULL; i++) {
+        size_t len = strlen(size_qualifiers[i].keyword);
+        if (strncmp(str, size_qualifiers[i].keyword, len) == 0
+            && isspace((unsigned char)str[len])) {
+            *size = size_qualifiers[i].size;
+            str += len;
+            while (isspace((unsigned char)*str))
+                str++;
+            break;
+        }
+    }
+    return str;
+}
+
 /* Check if string is a memory reference */
 bool syntax_is_memory_reference(const char *str)
 {
     if (!str || !*str)
         return false;
 
+    uint8_t size;
+    str = skip_size_qualifier(str, &size);
     return str[0] == '[' && str[strlen(str) - 1] == ']';
 }
 
@@ -313,6 +1238,9 @@ char *syntax_extract_memory_reference(const char *str)
     if (!syntax_is_memory_reference(str))
         return NULL;
 
+    uint8_t size;
+    str = skip_size_qualifier(str, &size);
+
     size_t len = strlen(str) - 2; /* exclude [] */
     strncpy(syntax_buffer, str + 1, len);
     syntax_buffer[len] = '\0';
@@ -320,6 +1248,158 @@ char *syntax_extract_memory_reference(const char *str)
     return syntax_trim(syntax_buffer);
 }
 
+/* Split the operand list of an instruction at the commas that are not inside
+   brackets, dropping a trailing comment. The operands are trimmed in place.
+   Returns how many there are, of which at most `max` are stored. */
+size_t syntax_split_operands(char *str, char **operands, size_t max)
+{
+    size_t count = 0;
+    int depth = 0;
+
+    char *comment = strchr(str, syntax_comment_char);
+    if (comment)
+        *comment = '\0';
+    str = syntax_trim(str);
+    if (*str == '\0')
+        return 0;
+
+    char *start = str;
+    for (char *p = str;; p++) {
+        if (*p == '[')
+            depth++;
+        else if (*p == ']')
+            depth--;
+        else if ((*p == ',' && depth == 0) || *p == '\0') {
+            const int last = *p == '\0';
+            *p = '\0';
+            if (count < max)
+                operands[count] = syntax_trim(start);
+            count++;
+            if (last)
+                break;
+            start = p + 1;
+        }
+    }
+    return count;
+}
+
+/* Add one term of a memory operand: a register, register*scale, a number
+   or a symbol. Registers and symbols cannot be subtracted. */
+static bool add_memory_term(char *term, int sign, SyntaxMemoryOperand *mem)
+{
+    char *star = strchr(term, '*');
+    if (star) {
+        *star = '\0';
+        char *reg = syntax_trim(term);
+        char *scale = syntax_trim(star + 1);
+        if (syntax_is_numeric(reg)) {
+            char *tmp = reg;
+            reg = scale;
+            scale = tmp;
+        }
+        uint8_t indexSize = 0;
+        uint8_t code = syntax_get_register_code(reg);
+        if (code == 0xFF)
+            code = syntax_get_vector_register_code(reg, &indexSize);
+        const long factor = strtol(scale, NULL, 0);
+        if (sign < 0 || code == 0xFF || mem->index != 0xFF
+            || (factor != 1 && factor != 2 && factor != 4 && factor != 8))
+            return false;
+        mem->index = code;
+        mem->indexSize = indexSize;
+        mem->scale = (uint8_t)factor;
+        return true;
+    }
+
+    const uint8_t code = syntax_get_register_code(term);
+    if (code != 0xFF) {
+        if (sign < 0)
+            return false;
+        if (mem->base == 0xFF)
+            mem->base = code;
+        else if (mem->index == 0xFF)
+            mem->index = code;
+        else
+            return false;
+        return true;
+    }
+
+    /* An xmm or ymm register can only be the index, as in gathers */
+    uint8_t indexSize;
+    const uint8_t vectorCode = syntax_get_vector_register_code(term, &indexSize);
+    if (vectorCode != 0xFF) {
+        if (sign < 0 || mem->index != 0xFF)
+            return false;
+        mem->index = vectorCode;
+        mem->indexSize = indexSize;
+        return true;
+    }
+
+    if (isdigit((unsigned char)term[0])) {
+        char *end;
+        const int64_t value = (int64_t)strtoull(term, &end, 0);
+        if (*end != '\0')
+            return false;
+        mem->disp += sign * value;
+        return true;
+    }
+
+    if (sign < 0 || mem->symbol[0] != '\0' || strlen(term) >= sizeof(mem->symbol))
+        return false;
+    for (const char *p = term; *p; p++) {
+        if (!isalnum((unsigned char)*p) && *p != '_' && *p != '.')
+            return false;
+    }
+    strcpy(mem->symbol, term);
+    return true;
+}
+
+/* Parse a memory operand of the form [symbol + base + index*scale + disp],
+   where every part is optional and the terms may come in any order */
+bool syntax_parse_memory_operand(const char *str, SyntaxMemoryOperand *mem)
+{
+    if (!syntax_is_memory_reference(str))
+        return false;
+
+    str = skip_size_qualifier(str, &mem->size);
+    mem->base = 0xFF;
+    mem->index = 0xFF;
+    mem->indexSize = 0;
+    mem->scale = 1;
+    mem->disp = 0;
+    mem->symbol[0] = '\0';
+
+    char buf[SYNTAX_MAX_LINE_LEN];
+    size_t len = strlen(str) - 2; /* exclude [] */
+    if (len >= sizeof(buf))
+        return false;
+    memcpy(buf, str + 1, len);
+    buf[len] = '\0';
+
+    char *p = syntax_trim(buf);
+    int sign = 1;
+    if (*p == '-') {
+        sign = -1;
+        p++;
+    }
+    for (;;) {
+        char *end = p;
+        while (*end && *end != '+' && *end != '-')
+            end++;
+        const char next = *end;
+        *end = '\0';
+
+        char *term = syntax_trim(p);
+        if (*term == '\0' || !add_memory_term(term, sign, mem))
+            return false;
+        if (next == '\0')
+            break;
+        sign = next == '-' ? -1 : 1;
+        p = end + 1;
+    }
+    return true;
+}
+
 /* Check if string is a numeric constant */
 bool syntax_is_numeric(const char *str)
 {
@@ -367,6 +1447,39 @@ void syntax_process_escape_sequences(const char *input, char *output)
     *output = '\0';
 }
 
+/* Check whether `str` starts with the word `keyword` */
+static bool starts_with_keyword(const char *str, const char *keyword)
+{
+    const size_t len = strlen(keyword);
+    return strncmp(str, keyword, len) == 0
+           && (str[len] == '\0' || isspace((unsigned char)str[len]));
+}
+
+/* Check whether a numeric constant is floating-point: decimal with a point
+   or an exponent */
+static bool is_float_literal(const char *str)
+{
+    if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X' || str[1] == 'b' || str[1] == 'B'))
+        return false;
+    char *end;
+    strtod(str, &end);
+    for (const char *p = str; p < end; p++) {
+        if (*p == '.' || *p == 'e' || *p == 'E')
+            return true;
+    }
+    return false;
+}
+
+/* Parse a floating-point value, which may only be followed by a comment */
+static bool parse_float(const char *str, double *value)
+{
+    char *end;
+    *value = strtod(str, &end);
+    while (isspace((unsigned char)*end))
+        end++;
+    return end != str && (*end == '\0' || *end == syntax_comment_char);
+}
+
 /* Process a data directive */
 bool syntax_process_data_directive(const char *line, SyntaxDataDirective *directive)
 {
@@ -387,7 +1500,8 @@ bool syntax_process_data_directive(const char *line, SyntaxDataDirective *direct
     p = syntax_trim(p);
 
     /* Extract label */
-    char *label = strtok(p, " \t");
+    char *save = NULL;
+    char *label = strtok_r(p, " \t", &save);
     if (!label)
         return false;
 
@@ -395,7 +1509,7 @@ bool syntax_process_data_directive(const char *line, SyntaxDataDirective *direct
     directive->label[SYNTAX_MAX_LABEL_LEN - 1] = '\0';
 
     /* Extract value */
-    char *value = strtok(NULL, "\n");
+    char *value = strtok_r(NULL, "\n", &save);
     if (!value)
         return false;
 
@@ -441,6 +1555,43 @@ bool syntax_process_data_directive(const char *line, SyntaxDataDirective *direct
             return false;
 
         directive->data.size = strtoull(value, NULL, 0);
+    } else if (starts_with_keyword(value, syntax_f32_keyword)
+               || starts_with_keyword(value, syntax_f64_keyword)
+               || (syntax_is_numeric(value) && is_float_literal(value))) {
+        /* Floating-point value, f64 unless f32 is given */
+        directive->type = DATA_F64;
+        if (starts_with_keyword(value, syntax_f32_keyword)) {
+            directive->type = DATA_F32;
+            value = syntax_trim(value + strlen(syntax_f32_keyword));
+        } else if (starts_with_keyword(value, syntax_f64_keyword)) {
+            value = syntax_trim(value + strlen(syntax_f64_keyword));
+        }
+
+        double number;
+        if (!parse_float(value, &number))
+            return false;
+        if (directive->type == DATA_F32) {
+            const float single = (float)number;
+            uint32_t bits;
+            memcpy(&bits, &single, sizeof(bits));
+            directive->data.value = bits;
+        } else {
+            memcpy(&directive->data.value, &number, sizeof(number));
+        }
+    } else if (starts_with_keyword(value, syntax_jumptable_keyword)) {
+        /* Addresses of the comma-separated labels, resolved when linking */
+        directive->type = DATA_JUMPTABLE;
+        value = syntax_trim(value + strlen(syntax_jumptable_keyword));
+
+        char *comment = strchr(value, syntax_comment_char);
+        if (comment)
+            *comment = '\0';
+        value = syntax_trim(value);
+        if (!*value)
+            return false;
+
+        strncpy(directive->data.literal, value, SYNTAX_MAX_LINE_LEN - 1);
+        directive->data.literal[SYNTAX_MAX_LINE_LEN - 1] = '\0';
     } else if (syntax_is_numeric(value)) {
         /* Raw numeric value */
         directive->type = DATA_RAW;
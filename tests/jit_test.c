@@ -0,0 +1,117 @@
+/* Tests of jit_assemble(): code that is called in this process, its data,
+   extern functions, and errors in the source */
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "assembler.h"
+
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/* Assemble `src`, or return NULL */
+static void *jit(const char *src, JitCode *code)
+{
+    return jit_assemble(src, strlen(src), code);
+}
+
+static void test_arguments(void)
+{
+    const char *src = "mov rax, 0\n"
+                      "add rax, rdi\n"
+                      "add rax, rsi\n"
+                      "ret\n";
+    JitCode code;
+    long (*add)(long, long) = (long (*)(long, long))jit(src, &code);
+    check(add && add(40, 2) == 42, "add(40, 2)");
+    jit_free(&code);
+}
+
+static void test_data(void)
+{
+    /* .bss and an indexed table, which maps the code into the low 2GB */
+    const char *src = "mov [saved], rdi\n"
+                      "mov rax, [squares + rdi*8]\n"
+                      "add rax, [rsi + 8]\n"
+                      "add rax, [saved]\n"
+                      "ret\n"
+                      "data squares 0\n"
+                      "data s1 1\n"
+                      "data s2 4\n"
+                      "data s3 9\n"
+                      "data saved size 8\n";
+    JitCode code;
+    long (*fn)(long, long *) = (long (*)(long, long *))jit(src, &code);
+    long values[] = {0, 100};
+    check(fn && fn(3, values) == 112, "squares[3] + values[1] + 3");
+    jit_free(&code);
+}
+
+static void test_extern(void)
+{
+    const char *src = "extern strlen\n"
+                      "jmp strlen\n";
+    JitCode code;
+    size_t (*len)(const char *) = (size_t (*)(const char *))jit(src, &code);
+    check(len && len("four") == 4, "tail call to strlen");
+    jit_free(&code);
+}
+
+static void test_errors(void)
+{
+    static const char *const sources[] = {
+        "bogus rax\nret\n",
+        "mov rax, [nowhere]\nret\n",
+        "extern strlen\nmov rax, [strlen]\nret\n",
+        "add rax, 99999999999\nret\n",
+        "ifcpu avx3\nendif\nret\n",
+        "",
+    };
+    for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        JitCode code;
+        check(jit(sources[i], &code) == NULL, sources[i]);
+    }
+}
+
+static void *assemble_many(void *arg)
+{
+    const long n = (long)arg;
+    for (int i = 0; i < 100; i++) {
+        char src[64];
+        snprintf(src, sizeof(src), "mov rax, %ld\nadd rax, rdi\nret\n", n);
+        JitCode code;
+        long (*fn)(long) = (long (*)(long))jit(src, &code);
+        if (!fn || fn(i) != n + i)
+            return arg;
+        jit_free(&code);
+    }
+    return NULL;
+}
+
+static void test_threads(void)
+{
+    pthread_t threads[4];
+    for (long i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, assemble_many, (void *)(i + 1));
+    for (int i = 0; i < 4; i++) {
+        void *result;
+        pthread_join(threads[i], &result);
+        check(result == NULL, "assembling on several threads");
+    }
+}
+
+int main(void)
+{
+    test_arguments();
+    test_data();
+    test_extern();
+    test_errors();
+    test_threads();
+    return failures != 0;
+}
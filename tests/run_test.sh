@@ -0,0 +1,113 @@
+#!/bin/sh
+# Assemble a test program with jasm and check what it does.
+#
+# Usage: run_test.sh <jasm> <source> [<expectations>]
+#
+# The expectations are comments in the source, or in a separate file for
+# sources that cannot carry them (the examples):
+#   # jasm-args: <options>    more options for jasm
+#   # modules: <files>        more sources, relative to tests/inputs
+#   # link-with: cc [<flags>] write an object with -f obj and link it with
+#                             $CC (default cc), which must print nothing
+#   # expect-warning: <text>  jasm warns with <text> while building
+#   # run: memory             run the program with --run
+#   # stdin: <line>           a line of input for the program
+#   # expect-exit: <n>        its exit status, 0 if not given
+#   # expect-stdout: <line>   a line of its output, in order
+#   # expect-file: <name> <text>  a file it writes holds <text>
+#   # expect-bytes: <hex>     the code assembled with -f bin, in order
+#   # expect-error: <text>    jasm fails and prints <text>
+#   # requires: <flags>       skip unless /proc/cpuinfo has the flags
+# A test that is skipped exits with 77.
+
+jasm=$1
+source=$2
+spec=${3:-$2}
+inputs=$(dirname "$0")/inputs
+
+directive() {
+    sed -n "s/^# $1: //p" "$spec"
+}
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+case $jasm in /*) ;; *) jasm=$(pwd)/$jasm ;; esac
+case $source in /*) ;; *) source=$(pwd)/$source ;; esac
+case $inputs in /*) ;; *) inputs=$(pwd)/$inputs ;; esac
+
+for flag in $(directive requires); do
+    grep -qw -- "$flag" /proc/cpuinfo || { echo "SKIP: the CPU has no $flag"; exit 77; }
+done
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work" || exit 1
+
+args=$(directive jasm-args)
+modules=
+for module in $(directive modules); do
+    modules="$modules $inputs/$module"
+done
+
+# Failures that jasm has to report
+error=$(directive expect-error)
+if [ -n "$error" ]; then
+    # shellcheck disable=SC2086
+    "$jasm" $args "$source" $modules -o prog >log 2>&1 && fail "jasm accepted the source"
+    grep -qF -- "$error" log || { cat log; fail "jasm did not say '$error'"; }
+    exit 0
+fi
+
+# Encodings
+bytes=$(directive expect-bytes | tr '\n' ' ' | tr -s ' ' | sed 's/^ //; s/ $//')
+if [ -n "$bytes" ]; then
+    # shellcheck disable=SC2086
+    "$jasm" $args -f bin "$source" $modules -o prog.bin >log 2>&1 || { cat log; fail "jasm failed"; }
+    actual=$(od -An -tx1 -v prog.bin | tr '\n' ' ' | tr -s ' ' | sed 's/^ //; s/ $//')
+    [ "$actual" = "$bytes" ] || fail "expected bytes: $bytes
+                  got: $actual"
+    exit 0
+fi
+
+# Build and run the program
+directive stdin >stdin
+if [ "$(directive run)" = memory ]; then
+    # shellcheck disable=SC2086
+    "$jasm" $args --run "$source" $modules <stdin >stdout 2>stderr
+    status=$?
+else
+    link=$(directive link-with)
+    if [ "${link%% *}" = cc ]; then
+        # shellcheck disable=SC2086
+        "$jasm" $args -f obj "$source" $modules -o prog.o >jasm.log 2>&1 || { cat jasm.log; fail "jasm failed"; }
+        # shellcheck disable=SC2086
+        ${CC:-cc} ${link#cc} prog.o -o prog >log 2>&1 || { cat log; fail "linking with ${CC:-cc} failed"; }
+        [ -s log ] && { cat log; fail "the linker complained"; }
+    else
+        # shellcheck disable=SC2086
+        "$jasm" $args "$source" $modules -o prog >jasm.log 2>&1 || { cat jasm.log; fail "jasm failed"; }
+    fi
+    warning=$(directive expect-warning)
+    if [ -n "$warning" ]; then
+        grep -qF -- "$warning" jasm.log || { cat jasm.log; fail "jasm did not warn '$warning'"; }
+    fi
+    ./prog <stdin >stdout 2>stderr
+    status=$?
+fi
+
+expected=$(directive expect-exit)
+[ "$status" = "${expected:-0}" ] || { cat stdout stderr; fail "exit status $status, expected ${expected:-0}"; }
+
+directive expect-stdout >expected
+if [ -s expected ]; then
+    diff expected stdout >diff || { cat diff; fail "unexpected output"; }
+fi
+
+directive expect-file | while read -r name text; do
+    actual=$(sed 's/[[:space:]]*$//' "$name" 2>/dev/null)
+    [ "$actual" = "$text" ] || fail "$name holds '$actual', not '$text'"
+done || exit 1
+exit 0